@@ -6,12 +6,39 @@
 //
 //  v0.66
 //  Supported features:
-//      - fDNS_Resolve(hostname {; timeoutMs}): Resolves a hostname to an IPv4 address.
-//      - fDNS_Reverse(ipAddress {; timeoutMs}): Resolves an IPv4 address to a hostname.
+//      - fDNS_Resolve(hostname {; timeoutMs; family; allAddresses}): Resolves a hostname to an IPv4 and/or IPv6 address.
+//        family is 4 (default), 6 or "any"; A and AAAA are queried concurrently for "any".
+//        allAddresses = 1 returns every address (comma separated) instead of only the first one.
+//      - fDNS_Reverse(ipAddress {; timeoutMs}): Resolves an IPv4 or IPv6 address (in-addr.arpa / ip6.arpa) to a hostname.
 //      - fDNS_Resolve_Extended(hostname {; timeoutMs}): Returns all DNS records (A, AAAA, CNAME, MX, TXT, NS, SRV, PTR, etc.) for a hostname as a JSON string.
 //      - fDNS_Set_Server(dnsServer): Sets the DNS server to use for subsequent requests (empty string "" resets to system default).
+//        A "tcp://" prefix sends every query to that server over TCP, "tls://" over TLS (DNS over TLS, port 853);
+//        "tls://1.1.1.1#cloudflare-dns.com" verifies the certificate against that name instead of the address.
+//        "https://1.1.1.1/dns-query" is a DNS over HTTPS server (POST; a URL ending in "{?dns}" uses GET).
+//      - fDNS_Set_Route(suffix; dnsServer): Sends the lookups of names under a domain suffix to their own DNS server(s) ("" removes the route).
+//      - fDNS_Get_Routes(): Returns the domain suffix routes as a JSON array.
+//      - fDNS_Set_Search(domains {; ndots}): Sets the search list and ndots for hostnames ("" = names as given, "*" = system default).
 //      - fDNS_Get_Systems_Server(): Returns the system's DNS server(s).
 //      - fDNS_Get_Current_Server(): Returns the DNS server currently set in the plugin.
+//      - fDNS_Set_Hedging(enabled {; delayMs}): Also sends a lookup to the next DNS server when the current one is slow.
+//      - fDNS_Get_Stats(): Returns lookup statistics (lookups, failovers, hedges, hedgeWins) as a JSON string.
+//      - fDNS_Get_Server_Stats(): Returns per-server RTT statistics (srtt, rttvar, RTO, p90) as a JSON array.
+//      - fDNS_Set_Stale(windowSeconds {; clientTimeoutMs}): Serves expired cached answers when the DNS servers fail (RFC 8767).
+//      - fDNS_Set_Snapshot(path): Sets the file the answer cache is persisted to across restarts ("" disables).
+//      - fDNS_Set_Shared_Cache(name {; sizeMB}): Shares cached answers with the other fDNS instances on the host ("" disables).
+//      - fDNS_Set_Cache_Size(kilobytes): Sets the memory budget of the answer cache (0 disables caching).
+//      - fDNS_Benchmark_Cache({maxThreads; durationMs}): Measures cache hit throughput from 1 to maxThreads threads
+//        (only in builds with FDNS_BENCHMARKS defined).
+//      - fDNS_Cache_Flush(name {; includeSubdomains}): Removes the cached answers for a name (and its subdomains).
+//      - fDNS_Cache_Pin(name {; pinned}): Keeps the cached answers for a name from being evicted.
+//      - fDNS_Cache_Dump(): Returns the entries of the answer cache as a JSON array.
+//      - fDNS_Set_Local_Zone(path): Answers the names in a hosts or zone file before any DNS query ("" disables).
+//      - fDNS_Benchmark_TCP(server {; queries; depth}): Measures queries per second over new, reused and pipelined TCP (TLS, HTTPS) connections
+//        (only in builds with FDNS_BENCHMARKS defined).
+//      - fDNS_Configure(json): Sets timeouts, tries, rotation, EDNS0 payload size, UDP port reuse, socket buffer sizes, io_uring use,
+//        a per-server query rate limit for fDNS_Resolve_Bulk and the interactive latency target it must keep.
+//      - fDNS_Get_Configuration(): Returns the options in effect as a JSON object.
+//      - fDNS_Resolve_Bulk(inputPath; outputPath {; type; maxInFlight}): Resolves a file of names and writes the results to another.
 //      - fDNS_Initialize() / DNS_Uninitialize(): Initialize and cleanup the DNS subsystem (should be called at plugin load/unload).
 //  Behavior:
 //      - 3 seconds is the default timeout for DNS_Resolve, DNS_Reverse, and DNS_Resolve_Extended if not specified.
@@ -19,6 +46,67 @@
 //      - When using the system default DNS, the plugin uses the OS system resolver (getaddrinfo/getnameinfo), which works reliably on macOS, Linux, and Windows.
 //      - When a custom DNS server is set, the plugin uses c-ares for DNS queries, supporting all record types.
 //      - This hybrid approach ensures robust DNS resolution across platforms and avoids known c-ares/macOS issues.
+//      - Each custom DNS server keeps a smoothed RTT and RTT variation (as TCP does); queries are retransmitted after
+//        that server's own RTO and servers are tried fastest first.
+//      - Answers from custom DNS servers are cached for their TTL. With a stale window set, an expired answer is
+//        returned (flagged "stale" in the JSON) when its refresh fails or exceeds the client response timer
+//        (1.8 s by default), and the refresh continues in the background.
+//      - The answer cache is bounded by a memory budget (16 MB by default) and uses W-TinyLFU admission: an entry only
+//        displaces another when a frequency sketch says it is used more often, so large batches of one-off lookups
+//        do not flush the names in constant use.
+//      - The cache is split into 16 shards with their own reader/writer locks; cache hits only take a read lock, so
+//        lookups from many threads (e.g. under FileMaker Server) do not queue behind one global lock. Names are
+//        hashed and compared case-insensitively.
+//      - The cache keeps the raw DNS responses and decodes them only when an answer is first read; the rendered
+//        result (address list, host name or JSON records array) is kept with the entry, so later hits copy a string.
+//      - Cached answers that were used since they were fetched are refreshed from the idle callback shortly before
+//        they expire (10% of the TTL, at least 1 s), so names in constant use never fall out of the cache. Their
+//        refresh times are timers in a hierarchical timer wheel, so the idle callback only looks at the due entries.
+//      - The answer cache is saved to a binary snapshot file (by default in the user's cache directory) on
+//        fDNS_Uninitialize, on plugin shutdown and every 5 minutes, and mapped again by fDNS_Initialize. Its
+//        entries keep their original expiry and are used once the same DNS server is set again.
+//      - With a shared cache set, answers are also stored in a named shared memory segment (seqlock-protected
+//        open-addressing table) that every fDNS instance on the host reads, e.g. FileMaker Server's engines.
+//      - A server that keeps timing out or failing gets an open circuit and is skipped by lookups; it is probed
+//        in the background from the idle callback and comes back into rotation once it answers again.
+//      - With several custom DNS servers each lookup goes to one server at a time and fails over to the next one on
+//        errors. With hedging enabled the next server is also queried once the current one is slower than delayMs
+//        (or its observed p90 latency); the first good answer wins and the other queries are cancelled.
+//      - Names under a routed suffix go to the servers of the longest matching route (found in a trie of labels),
+//        all other names to the fDNS_Set_Server list. Every route keeps its own server statistics and circuits.
+//      - The system's DNS servers and search settings are read once and cached. resolv.conf is watched (inotify on
+//        Linux, polled every 2 s otherwise) and the default channel is only rebuilt when they actually changed.
+//      - fDNS_Resolve applies the search list itself when it queries DNS servers: a name with at least ndots dots is
+//        tried as given first, others after the search domains. A trailing dot skips the search list. Every query
+//        for a further name of the list is counted as searchQueries in fDNS_Get_Stats.
+//      - Names in the local zone file are answered by fDNS_Resolve, fDNS_Reverse and fDNS_Resolve_Extended before
+//        the cache or any DNS server. They are kept in a minimal perfect hash table (CHD), so a lookup is one hash,
+//        one displacement read and one name comparison. The file is checked every 2 s from the idle callback and
+//        reloaded once it changed and then stayed the same for a check; a reload that fails keeps the last table.
+//      - Each server used over TCP or TLS ("tcp://" and "tls://" servers, and any server whose UDP response was
+//        truncated) has a pool of up to 4 persistent connections (RFC 7766) shared by all lookups. Queries are
+//        pipelined on the least busy one and responses matched by ID in any order; another connection is only
+//        opened when every one has 32 queries in flight. Connections close after 10 s without traffic. TLS
+//        connections verify the server certificate and resume the last session, so reconnecting skips the full
+//        handshake.
+//      - fDNS_Configure options apply to every channel and connection created afterwards; the option set is
+//        replaced as a whole, and an invalid object changes nothing. 0 or null restores an option's default.
+//      - DNS over HTTPS servers (RFC 8484) get one HTTP/2 connection each, and concurrent queries are sent as
+//        streams of it. Answers are cached no longer than their TTLs and the HTTP response's max-age, minus its Age.
+//      - fDNS_Resolve_Bulk sends its queries straight to the UDP servers over a few sockets per server, in batches
+//        of 64 per sendmmsg/recvmmsg call on Linux, without the cache, local zone, routes or search list. The
+//        results file is flushed every 100 ms while the names are resolved. Where the kernel supports it (Linux 6.0
+//        or later, io_uring not disabled) the sockets are driven by io_uring instead: multishot receives into
+//        registered buffers, and one system call per loop that submits the sends and collects the replies.
+//        The retransmission timers of its queries are kept in a timer wheel (O(1) to set and cancel), and the
+//        loop sleeps until the next reply or the next timer.
+//      - fDNS_Resolve_Bulk runs AIMD congestion control per server: the window of queries in flight doubles per
+//        round trip until the first sign of overload, then grows by 32, and is halved when a round has too many
+//        losses (queries unanswered after the server's RTO), SERVFAIL or REFUSED answers, or an inflated RTT.
+//      - Interactive calls (fDNS_Resolve, fDNS_Reverse, fDNS_Resolve_Extended) come before prefetches and bulk
+//        runs: with an "interactiveP99Ms" target, the queries bulk runs may have in flight are halved whenever
+//        the interactive p99 goes above it and prefetches and stale-answer refreshes wait, and that budget is
+//        shared fairly between the sessions running fDNS_Resolve_Bulk. No target is set by default.
 //
 
 #include "FMWrapper/FMXTypes.h"
@@ -29,37 +117,97 @@
 
 #include <string>
 #include <cstring>
+#include <cctype>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <cstdio>
+#include <cstdlib>
 #include <netdb.h>
 #include <ares.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <openssl/err.h>
+#include <curl/curl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+// The bulk resolver's io_uring backend needs the multishot receives of the Linux 6.0 headers
+// (provided buffer rings and IORING_FEAT_EXT_ARG are older); with older headers it is left out
+// and bulk lookups use sendmmsg/recvmmsg and poll
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define FDNS_IO_URING
+#endif
+#endif
+#include <fcntl.h>
 #include <unistd.h>
 
 #define DEFAULT_TIMEOUT 3000
 
-std::string DNSRecordsToJson(const std::string& hostname, const std::vector<std::pair<std::string, std::string>>& records)
+typedef std::vector<std::pair<std::string, std::string>> DNSRecords;
+
+// The "records" array of fDNS_Resolve_Extended
+std::string DNSRecordsToJsonArray(const DNSRecords& records)
 {
-	std::string json = "{\"hostname\":\"" + hostname + "\",\"records\":[";
+	std::string json = "[";
 	for (size_t i = 0; i < records.size(); ++i) {
 		json += "{\"type\":\"" + records[i].first + "\",\"value\":\"" + records[i].second + "\"}";
 		if (i + 1 < records.size()) json += ",";
 	}
-	json += "]}";
+	return json + "]";
+}
+
+std::string DNSRecordsToJson(const std::string& hostname, const std::string& recordsJson, bool stale = false)
+{
+	std::string json = "{\"hostname\":\"" + hostname + "\",\"records\":" + recordsJson + ",\"stale\":";
+	json += stale ? "true}" : "false}";
 	return json;
 }
 
+std::string DNSRecordsToJson(const std::string& hostname, const DNSRecords& records, bool stale = false)
+{
+	return DNSRecordsToJson(hostname, DNSRecordsToJsonArray(records), stale);
+}
+
 
 std::string getString(const fmx::Text& text);
 int GetIntFromDataVect(const fmx::DataVect& dataVect, fmx::uint32 position);
 
 // DNS plugin state
 static std::string g_currentDnsServer; // empty = system default
-static bool g_dnsInitialized = false;
+// Read without the lock by the lookups; the setters check it again under g_dnsMutex, which
+// fDNS_Uninitialize holds while it tears the state down
+static std::atomic<bool> g_dnsInitialized { false };
 static std::mutex g_dnsMutex;
 static ares_channel g_channel = nullptr;
 
@@ -71,27 +219,130 @@ std::string getString(const fmx::Text& Text)
 	return std::string(buffer);
 }
 
+// Joins a list of values the same way fDNS_Get_Systems_Server() does
+std::string joinValues(const std::vector<std::string>& values)
+{
+	std::string joined;
+	for (const auto& value : values) {
+		if (!joined.empty())
+			joined += ", ";
+		joined += value;
+	}
+	return joined;
+}
+
+static std::string lowercase(std::string value)
+{
+	for (auto& c : value)
+		c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+	return value;
+}
+
+// Modification time of a file in nanoseconds, so that rewrites within the same second are noticed
+static fmx::int64 modifiedNs(const struct stat& file)
+{
+#ifdef __APPLE__
+	return static_cast<fmx::int64>(file.st_mtimespec.tv_sec) * 1000000000 + file.st_mtimespec.tv_nsec;
+#else
+	return static_cast<fmx::int64>(file.st_mtim.tv_sec) * 1000000000 + file.st_mtim.tv_nsec;
+#endif
+}
+
+// Converts a sockaddr (AF_INET or AF_INET6) into its textual form, empty on failure
+std::string sockaddrToString(const struct sockaddr* addr)
+{
+	char ip[INET6_ADDRSTRLEN] = {0};
+	if (addr->sa_family == AF_INET)
+		inet_ntop(AF_INET, &((const struct sockaddr_in*)addr)->sin_addr, ip, sizeof(ip));
+	else if (addr->sa_family == AF_INET6)
+		inet_ntop(AF_INET6, &((const struct sockaddr_in6*)addr)->sin6_addr, ip, sizeof(ip));
+	return std::string(ip);
+}
+
+// Builds the in-addr.arpa or (nibble-reversed) ip6.arpa name of an address, empty if it is neither IPv4 nor IPv6
+std::string reverseName(const std::string& ipAddress)
+{
+	unsigned char addr[16];
+	if (inet_pton(AF_INET, ipAddress.c_str(), addr) == 1) {
+		char name[32];
+		snprintf(name, sizeof(name), "%u.%u.%u.%u.in-addr.arpa", addr[3], addr[2], addr[1], addr[0]);
+		return name;
+	}
+	if (inet_pton(AF_INET6, ipAddress.c_str(), addr) == 1) {
+		static const char hex[] = "0123456789abcdef";
+		std::string name;
+		for (int i = 15; i >= 0; --i) {
+			name += hex[addr[i] & 0x0f];
+			name += '.';
+			name += hex[addr[i] >> 4];
+			name += '.';
+		}
+		return name + "ip6.arpa";
+	}
+	return "";
+}
+
 // Use system resolver for default DNS (forward)
-std::string resolve_with_system(const std::string& hostname) {
+// family is AF_INET, AF_INET6 or AF_UNSPEC (both, resolved concurrently by the OS resolver)
+std::vector<std::string> resolve_with_system(const std::string& hostname, int family) {
+	std::vector<std::string> addresses;
 	struct addrinfo hints = {}, *res = nullptr;
-	hints.ai_family = AF_INET;
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM; // one entry per address instead of one per socket type
 	int err = getaddrinfo(hostname.c_str(), nullptr, &hints, &res);
-	if (err != 0 || !res) return "?";
-	char ip[INET_ADDRSTRLEN] = {0};
-	inet_ntop(AF_INET, &((struct sockaddr_in*)res->ai_addr)->sin_addr, ip, sizeof(ip));
+	if (err != 0 || !res) return addresses;
+	for (struct addrinfo* p = res; p != nullptr; p = p->ai_next) {
+		std::string ip = sockaddrToString(p->ai_addr);
+		if (!ip.empty() && std::find(addresses.begin(), addresses.end(), ip) == addresses.end())
+			addresses.push_back(ip);
+	}
 	freeaddrinfo(res);
-	return std::string(ip);
+	return addresses;
+}
+
+// The addresses of hostname in the hosts file (/etc/hosts), which are used before any DNS server is
+// asked, as getaddrinfo does; empty if the file has none of family (AF_INET, AF_INET6 or AF_UNSPEC)
+static std::vector<std::string> resolve_with_hosts_file(const std::string& hostname, int family)
+{
+	std::string name = hostname;
+	if (!name.empty() && name.back() == '.')
+		name.pop_back();
+	std::vector<std::string> addresses;
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_channel)
+		return addresses;
+	for (int each : { AF_INET, AF_INET6 }) {
+		struct hostent* host = nullptr;
+		if ((family != AF_UNSPEC && family != each) || ares_gethostbyname_file(g_channel, name.c_str(), each, &host) != ARES_SUCCESS)
+			continue;
+		char text[INET6_ADDRSTRLEN];
+		for (char** address = host->h_addr_list; *address; ++address) {
+			if (host->h_addrtype == each && inet_ntop(each, *address, text, sizeof(text)))
+				addresses.push_back(text);
+		}
+		ares_free_hostent(host);
+	}
+	return addresses;
 }
 
-// Use system resolver for default DNS (reverse)
+// Use system resolver for default DNS (reverse), IPv4 or IPv6
 std::string reverse_with_system(const std::string& ipAddress) {
-	struct sockaddr_in sa;
-	memset(&sa, 0, sizeof(sa));
-	sa.sin_family = AF_INET;
-	if (inet_pton(AF_INET, ipAddress.c_str(), &sa.sin_addr) != 1)
+	struct sockaddr_storage ss;
+	socklen_t len = 0;
+	memset(&ss, 0, sizeof(ss));
+	struct sockaddr_in* sa4 = (struct sockaddr_in*)&ss;
+	struct sockaddr_in6* sa6 = (struct sockaddr_in6*)&ss;
+	if (inet_pton(AF_INET, ipAddress.c_str(), &sa4->sin_addr) == 1) {
+		sa4->sin_family = AF_INET;
+		len = sizeof(struct sockaddr_in);
+	} else if (inet_pton(AF_INET6, ipAddress.c_str(), &sa6->sin6_addr) == 1) {
+		sa6->sin6_family = AF_INET6;
+		len = sizeof(struct sockaddr_in6);
+	} else {
 		return "?";
+	}
 	char host[NI_MAXHOST] = {0};
-	int err = getnameinfo((struct sockaddr*)&sa, sizeof(sa), host, sizeof(host), nullptr, 0, NI_NAMEREQD);
+	int err = getnameinfo((struct sockaddr*)&ss, len, host, sizeof(host), nullptr, 0, NI_NAMEREQD);
 	if (err != 0)
 		return "?";
 	return std::string(host);
@@ -101,237 +352,6909 @@ int GetIntFromDataVect(const fmx::DataVect& dataVect, fmx::uint32 position) {
 	return static_cast<int>(dataVect.AtAsNumber(position).AsLong());
 }
 
-// DNS State Management ====================================================================
+// Reads the optional family parameter: 4 (default), 6, or "any"/0 for both.
+// Returns false if the parameter is present but not one of these values.
+bool GetFamilyFromDataVect(const fmx::DataVect& dataVect, fmx::uint32 position, int& family) {
+	family = AF_INET;
+	if (dataVect.Size() <= position)
+		return true;
+	std::string value = getString(dataVect.At(position).GetAsText());
+	for (auto& c : value)
+		c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+	if (value.empty() || value == "4")
+		family = AF_INET;
+	else if (value == "6")
+		family = AF_INET6;
+	else if (value == "0" || value == "any")
+		family = AF_UNSPEC;
+	else
+		return false;
+	return true;
+}
 
-static fmx::errcode fDNS_Initialize()
+// Channel options =========================================================================
+//
+// Tuning set with fDNS_Configure for every c-ares channel and server connection created after it.
+// The options are replaced as a whole, so a lookup sees either the old or the new set; 0 leaves an
+// option at its default (see fDNS_Get_Configuration).
+
+struct ChannelOptions {
+	int timeoutMs = 0;            // retransmit timeout of a server before its RTT is known
+	int tries = 0;                // most transmissions of a query to one server
+	bool rotate = false;          // spread lookups over the servers instead of preferring the fastest
+	int ednsPayloadSize = 0;      // EDNS0 UDP payload size advertised in queries, 0 = no EDNS0
+	int udpMaxQueries = 0;        // queries per UDP socket before a new source port is used
+	int socketSendBuffer = 0;     // SO_SNDBUF in bytes
+	int socketReceiveBuffer = 0;  // SO_RCVBUF in bytes
+	bool ioUring = true;          // fDNS_Resolve_Bulk may use io_uring where the kernel has it
+	int serverQps = 0;            // queries per second fDNS_Resolve_Bulk sends to one server at most, 0 = no limit
+	int interactiveP99Ms = 0;     // interactive latency fDNS_Resolve_Bulk and prefetches must not push p99 above, 0 = no target
+};
+
+static std::shared_ptr<const ChannelOptions> g_channelOptions = std::make_shared<const ChannelOptions>(); // replaced with std::atomic_store
+
+static std::shared_ptr<const ChannelOptions> channelOptions()
 {
-	std::lock_guard<std::mutex> lock(g_dnsMutex);
-	if (!g_dnsInitialized) {
-		if (ares_library_init(ARES_LIB_INIT_ALL) != ARES_SUCCESS)
-			return 1;
-		g_currentDnsServer.clear(); // use system default
-		g_dnsInitialized = true;
-	}
-	// (Re)create the channel for the current DNS server (should be default at init)
-	if (g_channel) {
-		ares_destroy(g_channel);
-		g_channel = nullptr;
-	}
-	if (g_currentDnsServer.empty()) {
-		if (ares_init(&g_channel) != ARES_SUCCESS)
-			return 1;
-	} else {
-		struct ares_options options;
-		memset(&options, 0, sizeof(options));
-		int optmask = 0;
-		if (ares_init_options(&g_channel, &options, optmask) != ARES_SUCCESS)
-			return 1;
-		if (ares_set_servers_ports_csv(g_channel, g_currentDnsServer.c_str()) != ARES_SUCCESS) {
-			ares_destroy(g_channel);
-			g_channel = nullptr;
-			return 1;
-		}
+	return std::atomic_load(&g_channelOptions);
+}
+
+// Server transports & TCP connections =====================================================
+//
+// An fDNS_Set_Server entry may start with a scheme: "tcp://1.1.1.1" only uses TCP, "tls://1.1.1.1"
+// DNS over TLS (RFC 7858, port 853); entries without one use UDP. The name the server's certificate
+// must match can follow the address, as in "tls://1.1.1.1#cloudflare-dns.com"; without it the
+// certificate must be issued for the address. An "https://" entry is the URL of a DNS over HTTPS
+// server (RFC 8484), see HttpsConnection.
+//
+// Every TCP and TLS upstream keeps a small pool of persistent connections (RFC 7766) shared by all
+// lookups: queries are pipelined on them as they come, and responses are matched to them by ID, in
+// whatever order they arrive. A further connection is only opened while the others are busy. UDP
+// answers that come back truncated are retried over TCP in the same way instead of on a new
+// connection per query. A connection is closed once it had no traffic and no query of a running
+// lookup for STREAM_IDLE_TIMEOUT; a reused connection that the server closed is reopened and its
+// queries are sent again once. The TLS connections of a server resume the session of the last
+// handshake, so reconnecting costs one round trip and no certificate check.
+//
+// Whichever thread waits for an answer reads the connection, so another lookup's answer can be
+// read by it. Each attempt therefore waits on a pipe as well, which is written to when one of its
+// queries is completed. Lookups wait with poll(), not select(): pooled connections live long and
+// TLS ones are opened by the plugin on behalf of any thread, so their descriptors can be past
+// FD_SETSIZE in a process with many open files.
+
+#define DNS_PORT 53
+#define DOT_PORT 853
+#define STREAM_IDLE_TIMEOUT 10000   // ms
+#define STREAM_POOL_SIZE 4          // connections per upstream
+#define STREAM_BUSY_QUERIES 32      // queries in flight on every connection before another one is opened
+#define STREAM_READ_SIZE 16384
+
+#ifdef MSG_NOSIGNAL
+#define STREAM_SEND_FLAGS MSG_NOSIGNAL  // a closed connection fails the send instead of raising SIGPIPE
+#else
+#define STREAM_SEND_FLAGS 0             // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+enum Transport {
+	kTransportUdp,
+	kTransportTcp,
+	kTransportTls,
+	kTransportHttps
+};
+
+// Splits an fDNS_Set_Server entry into its transport, endpoint ("ip", "ip:port" or "[ipv6]:port")
+// and the name after '#' that a TLS server must authenticate as. The endpoint of an HTTPS server is
+// its URL. False for an unknown scheme or a URL without a host.
+static bool parseServer(const std::string& server, Transport& transport, std::string& endpoint, std::string& authName)
+{
+	size_t scheme = server.find("://");
+	transport = kTransportUdp;
+	authName.clear();
+	if (scheme != std::string::npos && lowercase(server.substr(0, scheme)) == "https") {
+		transport = kTransportHttps;
+		endpoint = server;
+		return scheme + 3 < server.size() && server[scheme + 3] != '/';
 	}
-	return 0;
+	endpoint = scheme == std::string::npos ? server : server.substr(scheme + 3);
+	size_t hash = endpoint.find('#');
+	authName = hash == std::string::npos ? std::string() : endpoint.substr(hash + 1);
+	if (hash != std::string::npos)
+		endpoint.erase(hash);
+	if (scheme == std::string::npos)
+		return true;
+	std::string name = lowercase(server.substr(0, scheme));
+	if (name == "tcp")
+		transport = kTransportTcp;
+	else if (name == "tls")
+		transport = kTransportTls;
+	else if (name != "udp")
+		return false;
+	return true;
 }
 
-static fmx::errcode fDNS_Uninitialize()
+static int defaultPort(Transport transport)
 {
-	std::lock_guard<std::mutex> lock(g_dnsMutex);
-	if (g_channel) {
-		ares_destroy(g_channel);
-		g_channel = nullptr;
+	return transport == kTransportTls ? DOT_PORT : DNS_PORT;
+}
+
+// Splits a server list as accepted by ares_set_servers_ports_csv into its entries
+static std::vector<std::string> splitServerList(const std::string& dnsServer)
+{
+	std::vector<std::string> servers;
+	size_t start = 0;
+	while (start <= dnsServer.size()) {
+		size_t end = dnsServer.find(',', start);
+		if (end == std::string::npos)
+			end = dnsServer.size();
+		std::string server = dnsServer.substr(start, end - start);
+		server.erase(0, server.find_first_not_of(" \t"));
+		server.erase(server.find_last_not_of(" \t") + 1);
+		if (!server.empty())
+			servers.push_back(server);
+		start = end + 1;
 	}
-	if (g_dnsInitialized) {
-		ares_library_cleanup();
-		g_dnsInitialized = false;
-		g_currentDnsServer.clear();
+	return servers;
+}
+
+// The endpoints of a server list as accepted by ares_set_servers_ports_csv (without the HTTPS
+// servers), false if an entry has an unknown scheme
+static bool endpointList(const std::string& dnsServer, std::string& csv)
+{
+	csv.clear();
+	for (const auto& server : splitServerList(dnsServer)) {
+		Transport transport;
+		std::string endpoint, authName;
+		if (!parseServer(server, transport, endpoint, authName))
+			return false;
+		if (transport == kTransportHttps)
+			continue;
+		if (!csv.empty())
+			csv += ",";
+		csv += endpoint;
 	}
-	return 0;
+	return true;
 }
 
-static fmx::errcode fDNS_Set_Server(const std::string& dnsServer)
+// Parses an endpoint into a socket address
+static bool parseEndpoint(const std::string& endpoint, int defaultPort, struct sockaddr_storage& address, socklen_t& length)
 {
-	std::lock_guard<std::mutex> lock(g_dnsMutex);
-	if (!g_dnsInitialized)
-		return 1;
-	g_currentDnsServer = dnsServer;
-	// Recreate the channel with the new server
-	if (g_channel) {
-		ares_destroy(g_channel);
-		g_channel = nullptr;
+	std::string host = endpoint;
+	int port = defaultPort;
+	if (!host.empty() && host[0] == '[') {
+		size_t close = host.find(']');
+		if (close == std::string::npos)
+			return false;
+		if (close + 1 < host.size()) {
+			if (host[close + 1] != ':')
+				return false;
+			port = atoi(host.c_str() + close + 2);
+		}
+		host = host.substr(1, close - 1);
+	} else if (std::count(host.begin(), host.end(), ':') == 1) {
+		size_t colon = host.find(':');
+		port = atoi(host.c_str() + colon + 1);
+		host.erase(colon);
 	}
-	if (g_currentDnsServer.empty()) {
-		if (ares_init(&g_channel) != ARES_SUCCESS)
-			return 1;
+	if (port <= 0 || port > 65535)
+		return false;
+
+	memset(&address, 0, sizeof(address));
+	struct sockaddr_in* v4 = reinterpret_cast<struct sockaddr_in*>(&address);
+	struct sockaddr_in6* v6 = reinterpret_cast<struct sockaddr_in6*>(&address);
+	if (inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1) {
+		v4->sin_family = AF_INET;
+		v4->sin_port = htons(static_cast<uint16_t>(port));
+		length = sizeof(*v4);
+	} else if (inet_pton(AF_INET6, host.c_str(), &v6->sin6_addr) == 1) {
+		v6->sin6_family = AF_INET6;
+		v6->sin6_port = htons(static_cast<uint16_t>(port));
+		length = sizeof(*v6);
 	} else {
-		struct ares_options options;
-		memset(&options, 0, sizeof(options));
-		int optmask = 0;
-		if (ares_init_options(&g_channel, &options, optmask) != ARES_SUCCESS)
-			return 1;
-		if (ares_set_servers_ports_csv(g_channel, g_currentDnsServer.c_str()) != ARES_SUCCESS) {
-			ares_destroy(g_channel);
-			g_channel = nullptr;
-			return 1;
-		}
+		return false;
 	}
-	return 0;
+	return true;
 }
 
-static std::string fDNS_Get_Current_Server()
+// The status ares_query reports for a response
+static int responseStatus(const std::string& response)
 {
-	std::lock_guard<std::mutex> lock(g_dnsMutex);
-	return g_currentDnsServer;
+	if (response.size() < NS_HFIXEDSZ)
+		return ARES_EBADRESP;
+	const unsigned char* header = reinterpret_cast<const unsigned char*>(response.data());
+	switch (header[3] & 0x0f) {
+	case ns_r_noerror: return (header[6] << 8 | header[7]) > 0 ? ARES_SUCCESS : ARES_ENODATA;
+	case ns_r_formerr: return ARES_EFORMERR;
+	case ns_r_servfail: return ARES_ESERVFAIL;
+	case ns_r_nxdomain: return ARES_ENOTFOUND;
+	case ns_r_notimpl: return ARES_ENOTIMP;
+	case ns_r_refused: return ARES_EREFUSED;
+	default: return ARES_EBADRESP;
+	}
 }
 
-static std::string fDNS_Get_Systems_Server()
+// The query only holds its question, which the response repeats (names compared case-insensitively)
+static bool sameQuestion(const std::string& query, const std::string& response)
 {
-	std::string serverList;
-	ares_channel channel;
-	if (ares_init(&channel) != ARES_SUCCESS)
-		return "?";
+	if (query.size() <= NS_HFIXEDSZ || response.size() < query.size())
+		return false;
+	return std::equal(query.begin() + NS_HFIXEDSZ, query.end(), response.begin() + NS_HFIXEDSZ, [](char a, char b) {
+		return tolower(static_cast<unsigned char>(a)) == tolower(static_cast<unsigned char>(b));
+	});
+}
 
-	struct ares_addr_node* servers = nullptr;
-	if (ares_get_servers(channel, &servers) == ARES_SUCCESS)
+static bool setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Wakes up the attempt whose queries were completed by another thread
+class StreamNotifier {
+public:
+	StreamNotifier()
 	{
-		char ip[INET6_ADDRSTRLEN];
-		for (struct ares_addr_node* node = servers; node != nullptr; node = node->next)
-		{
-			memset(ip, 0, sizeof(ip));
-			if (node->family == AF_INET)
-			{
-				inet_ntop(AF_INET, &node->addr.addr4, ip, sizeof(ip));
-			}
-			else if (node->family == AF_INET6)
-			{
-				inet_ntop(AF_INET6, &node->addr.addr6, ip, sizeof(ip));
-			}
-			if (!serverList.empty())
-				serverList += ", ";
-			serverList += ip;
+		if (pipe(m_fds) != 0 || !setNonBlocking(m_fds[0]) || !setNonBlocking(m_fds[1])) {
+			close();
+			m_fds[0] = m_fds[1] = -1;
 		}
-		ares_free_data(servers);
 	}
-	else
+	~StreamNotifier() { close(); }
+
+	StreamNotifier(const StreamNotifier&) = delete;
+	StreamNotifier& operator=(const StreamNotifier&) = delete;
+
+	int fd() const { return m_fds[0]; }
+
+	void notify()
 	{
-		serverList = "?";
+		char byte = 1;
+		if (m_fds[1] >= 0 && write(m_fds[1], &byte, 1) < 0) {
+			// full pipe: the attempt is woken up anyway
+		}
 	}
-	ares_destroy(channel);
-	return serverList;
-}
 
-// DNS_Resolve: hostname, timeoutMs
-static FMX_PROC(fmx::errcode) fDNS_Resolve(short /*funcId*/, const fmx::ExprEnv& /*env*/, const fmx::DataVect& dataVect, fmx::Data& results)
+	void drain()
+	{
+		char buffer[64];
+		while (m_fds[0] >= 0 && read(m_fds[0], buffer, sizeof(buffer)) > 0) {}
+	}
+
+private:
+	void close()
+	{
+		for (int fd : m_fds) {
+			if (fd >= 0)
+				::close(fd);
+		}
+	}
+
+	int m_fds[2] = { -1, -1 };
+};
+
+// One query sent on a connection. The connection fills in the result and then sets done.
+struct StreamQuery {
+	std::string message;              // the query; its ID is set by the connection
+	std::weak_ptr<StreamNotifier> notifier; // expires with the attempt that sent the query
+	std::atomic<bool> done{false};
+	int status = ARES_SUCCESS;        // ARES_ECONNREFUSED if the connection failed
+	std::string response;
+	bool resent = false;              // already sent again on a reopened connection
+};
+typedef std::shared_ptr<StreamQuery> StreamQueryPtr;
+
+// A query for name and type; its message is empty if the name cannot be encoded
+static StreamQueryPtr makeStreamQuery(const std::string& name, int type)
 {
-	if (!g_dnsInitialized)
-		return 1;
-	if (dataVect.Size() < 1) return 956;
+	StreamQueryPtr query = std::make_shared<StreamQuery>();
+	unsigned char* message = nullptr;
+	int length = 0;
+	if (ares_create_query(name.c_str(), ns_c_in, type, 0, 1, &message, &length, 0) == ARES_SUCCESS) {
+		query->message.assign(reinterpret_cast<const char*>(message), static_cast<size_t>(length));
+		ares_free_string(message);
+	}
+	return query;
+}
 
-	const fmx::Data& inputData = dataVect.At(0);
-	std::string hostname = getString(inputData.GetAsText());
-	if (hostname.empty())
-		return 956;
+struct StreamStats {
+	std::atomic<fmx::uint64> connections{0};  // TCP connections opened, including those for TLS
+	std::atomic<fmx::uint64> queries{0};      // queries sent over TCP or TLS
+	std::atomic<fmx::uint64> reused{0};       // ... on a connection that had already answered
+	std::atomic<fmx::uint64> resent{0};       // queries sent again after the server closed the connection
+	std::atomic<fmx::uint64> tlsHandshakes{0};
+	std::atomic<fmx::uint64> tlsResumed{0};   // handshakes that resumed an earlier session
+	std::atomic<fmx::uint64> httpsConnections{0};
+	std::atomic<fmx::uint64> httpsQueries{0};
+	std::atomic<fmx::uint64> httpsReused{0};  // HTTPS queries answered on a connection that was already open
+};
+static StreamStats g_streamStats;
 
-	int timeoutMs = DEFAULT_TIMEOUT;
-	if (dataVect.Size() > 1) {
-		timeoutMs = GetIntFromDataVect(dataVect, 1);
-		if (timeoutMs < 0) timeoutMs = DEFAULT_TIMEOUT;
+// The TLS settings of a DoT server and the session its next connection resumes
+class TlsContext {
+public:
+	// authName is the name (or address) the server's certificate must be issued for
+	explicit TlsContext(const std::string& authName) : m_authName(authName)
+	{
+		m_ctx = SSL_CTX_new(TLS_client_method());
+		if (!m_ctx)
+			return;
+		SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+		SSL_CTX_set_verify(m_ctx, SSL_VERIFY_PEER, nullptr);
+		SSL_CTX_set_default_verify_paths(m_ctx);
+		SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		static const unsigned char alpn[] = { 3, 'd', 'o', 't' };
+		SSL_CTX_set_alpn_protos(m_ctx, alpn, sizeof(alpn));
+		// Sessions are kept here rather than in OpenSSL's cache, which is keyed by the server side
+		SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(m_ctx, storeSession);
+		SSL_CTX_set_app_data(m_ctx, this);
 	}
 
-	std::string dnsServer;
+	~TlsContext()
 	{
-		std::lock_guard<std::mutex> lock(g_dnsMutex);
-		dnsServer = g_currentDnsServer;
+		if (m_session)
+			SSL_SESSION_free(m_session);
+		if (m_ctx)
+			SSL_CTX_free(m_ctx);
 	}
 
-	std::string result_ip;
-	if (dnsServer.empty()) {
-		// Use system resolver for default DNS
-		result_ip = resolve_with_system(hostname);
-	} else {
-		ares_channel channel;
-		struct ares_options options;
-		int optmask = 0;
+	TlsContext(const TlsContext&) = delete;
+	TlsContext& operator=(const TlsContext&) = delete;
 
-		if (!dnsServer.empty())
-		{
-			memset(&options, 0, sizeof(options));
-			if (ares_init_options(&channel, &options, optmask) != ARES_SUCCESS)
-				return 1;
-			if (ares_set_servers_ports_csv(channel, dnsServer.c_str()) != ARES_SUCCESS)
-			{
-				ares_destroy(channel);
-				return 1;
-			}
+	// A client for the server at address, set up to resume the last session; nullptr on failure.
+	// It reads from and writes to memory BIOs.
+	SSL* createSsl(const std::string& address)
+	{
+		if (!m_ctx)
+			return nullptr;
+		SSL* ssl = SSL_new(m_ctx);
+		if (!ssl)
+			return nullptr;
+		SSL_set_bio(ssl, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+		const std::string& name = m_authName.empty() ? address : m_authName;
+		unsigned char literal[16];
+		bool isAddress = inet_pton(AF_INET, name.c_str(), literal) == 1 || inet_pton(AF_INET6, name.c_str(), literal) == 1;
+		bool ok = SSL_get_rbio(ssl) && SSL_get_wbio(ssl);
+		if (isAddress) {
+			ok = ok && X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), name.c_str()) == 1;
+		} else {
+			ok = ok && SSL_set_tlsext_host_name(ssl, name.c_str()) == 1 && SSL_set1_host(ssl, name.c_str()) == 1;
 		}
-		else
 		{
-			if (ares_init(&channel) != ARES_SUCCESS)
-				return 1;
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (ok && m_session)
+				SSL_set_session(ssl, m_session);
 		}
+		if (!ok) {
+			SSL_free(ssl);
+			return nullptr;
+		}
+		SSL_set_connect_state(ssl);
+		return ssl;
+	}
+
+private:
+	// Called by OpenSSL for every session (TLS 1.3 tickets arrive after the handshake)
+	static int storeSession(SSL* ssl, SSL_SESSION* session)
+	{
+		TlsContext* context = static_cast<TlsContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+		std::lock_guard<std::mutex> lock(context->m_lock);
+		if (context->m_session)
+			SSL_SESSION_free(context->m_session);
+		context->m_session = session;
+		return 1; // the session is ours now
+	}
+
+	SSL_CTX* m_ctx = nullptr;
+	const std::string m_authName;
+	std::mutex m_lock;                  // guards m_session
+	SSL_SESSION* m_session = nullptr;
+};
+
+// A connection that lookups send their queries on and wait on with poll(): a TCP or TLS
+// StreamConnection, or an HttpsConnection. All methods are thread safe.
+class QueryConnection {
+public:
+	virtual ~QueryConnection() {}
+
+	// Queues a query, opening the connection if needed; false if it cannot be opened
+	virtual bool send(const StreamQueryPtr& query) = 0;
+
+	// Adds the sockets to a poll() set with the events they wait for
+	virtual void addPollFds(std::vector<struct pollfd>& fds) = 0;
+
+	// Shortens waitMs to the time by which process() must run even without socket activity
+	virtual void timeout(int& /*waitMs*/) {}
+
+	// Writes and reads what the sockets allow without blocking and completes the answered queries
+	virtual void process() = 0;
+
+	// Queries waiting for an answer for a running lookup
+	virtual size_t load() = 0;
+
+	// True once nothing was sent or received for STREAM_IDLE_TIMEOUT and no running lookup waits
+	// for an answer (only the connection still holds its queries)
+	virtual bool expired(std::chrono::steady_clock::time_point now) = 0;
+
+protected:
+	static void complete(StreamQuery& query, int status, const std::string& response)
+	{
+		query.status = status;
+		query.response = response;
+		query.done.store(true, std::memory_order_release);
+		if (std::shared_ptr<StreamNotifier> notifier = query.notifier.lock())
+			notifier->notify();
+	}
+};
+
+// A persistent, pipelined TCP or TLS connection to one server
+class StreamConnection : public QueryConnection {
+public:
+	// tls is set for DNS over TLS
+	StreamConnection(const struct sockaddr_storage& address, socklen_t length, const std::shared_ptr<TlsContext>& tls = nullptr)
+		: m_address(address), m_length(length), m_tls(tls), m_lastActivity(std::chrono::steady_clock::now()) {}
+
+	~StreamConnection() override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		closeSocket();
+		for (auto& item : m_pending)
+			complete(*item.second, ARES_ECONNREFUSED, std::string());
+	}
+
+	StreamConnection(const StreamConnection&) = delete;
+	StreamConnection& operator=(const StreamConnection&) = delete;
+
+	bool send(const StreamQueryPtr& query) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		dropAbandoned();
+		if (m_pending.size() >= 0xffff || (m_fd < 0 && !openSocket()))
+			return false;
+		if (m_answered > 0)
+			g_streamStats.reused++;
+		g_streamStats.queries++;
+		queue(query);
+		transfer();
+		return true;
+	}
+
+	void addPollFds(std::vector<struct pollfd>& fds) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_fd < 0)
+			return;
+		short events = POLLIN;
+		if (m_connecting || !m_wire.empty() || (!m_handshaking && !m_out.empty()))
+			events |= POLLOUT;
+		fds.push_back({ m_fd, events, 0 });
+	}
+
+	size_t load() override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		dropAbandoned();
+		return m_pending.size();
+	}
+
+	void process() override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		transfer();
+	}
+
+	bool expired(std::chrono::steady_clock::time_point now) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (now - m_lastActivity < std::chrono::milliseconds(STREAM_IDLE_TIMEOUT))
+			return false;
+		dropAbandoned();
+		return m_pending.empty();
+	}
 
-		struct CallbackData {
-			bool done = false;
-			std::string ip;
-		} callbackData;
+private:
+	bool openSocket()
+	{
+		m_fd = socket(m_address.ss_family, SOCK_STREAM, 0);
+		if (m_fd < 0)
+			return false;
+		int on = 1;
+		setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		setsockopt(m_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+		std::shared_ptr<const ChannelOptions> options = channelOptions();
+		if (options->socketSendBuffer > 0)
+			setsockopt(m_fd, SOL_SOCKET, SO_SNDBUF, &options->socketSendBuffer, sizeof(options->socketSendBuffer));
+		if (options->socketReceiveBuffer > 0)
+			setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &options->socketReceiveBuffer, sizeof(options->socketReceiveBuffer));
+#ifdef SO_NOSIGPIPE
+		setsockopt(m_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+		if (!setNonBlocking(m_fd)) {
+			closeSocket();
+			return false;
+		}
+		if (connect(m_fd, reinterpret_cast<const struct sockaddr*>(&m_address), m_length) != 0 && errno != EINPROGRESS) {
+			closeSocket();
+			return false;
+		}
+		if (m_tls) {
+			m_ssl = m_tls->createSsl(sockaddrToString(reinterpret_cast<const struct sockaddr*>(&m_address)));
+			if (!m_ssl) {
+				closeSocket();
+				return false;
+			}
+			m_handshaking = true;
+		}
+		m_connecting = true;
+		m_answered = 0;
+		m_lastActivity = std::chrono::steady_clock::now();
+		g_streamStats.connections++;
+		return true;
+	}
 
-		auto callback = [](void* arg, int status, int /*timeouts*/, struct hostent* host) {
-			auto* data = static_cast<CallbackData*>(arg);
-			if (status == ARES_SUCCESS && host && host->h_addr_list[0])
-			{
-				char ip[INET_ADDRSTRLEN] = {0};
-				inet_ntop(AF_INET, host->h_addr_list[0], ip, sizeof(ip));
-				data->ip = ip;
+	void closeSocket()
+	{
+		if (m_ssl) {
+			if (!m_handshaking && !m_connecting && m_fd >= 0) {
+				SSL_shutdown(m_ssl); // close_notify, without waiting for the server's
+				flushTls();
 			}
+			SSL_free(m_ssl);
+			m_ssl = nullptr;
+		}
+		if (m_fd >= 0)
+			close(m_fd);
+		m_fd = -1;
+		m_connecting = false;
+		m_handshaking = false;
+		m_wire.clear();
+		m_out.clear();
+		m_in.clear();
+	}
+
+	// Forgets the queries whose lookup is over, so a server that stops answering does not use up the IDs
+	void dropAbandoned()
+	{
+		for (auto it = m_pending.begin(); it != m_pending.end();) {
+			if (it->second.use_count() == 1)
+				it = m_pending.erase(it);
 			else
-			{
-				data->ip = "?";
-			}
-			data->done = true;
-		};
+				++it;
+		}
+	}
 
-		ares_gethostbyname(channel, hostname.c_str(), AF_INET, callback, &callbackData);
+	// Gives the query a free ID and appends it, with its length prefix, to the output
+	void queue(const StreamQueryPtr& query)
+	{
+		fmx::uint16 id;
+		do {
+			id = m_nextId++;
+		} while (m_pending.count(id));
+		query->message[0] = static_cast<char>(id >> 8);
+		query->message[1] = static_cast<char>(id & 0xff);
+		m_pending[id] = query;
+		m_out += static_cast<char>(query->message.size() >> 8);
+		m_out += static_cast<char>(query->message.size() & 0xff);
+		m_out += query->message;
+	}
 
-		int totalWaitMs = 0;
+	// The socket failed or was closed by the server. Queries of a connection that was in use are
+	// sent once more on a new one (the server may close idle connections at any time), the others fail.
+	void fail(bool closedByServer)
+	{
+		bool reopen = closedByServer && m_answered > 0;
+		closeSocket();
+		std::vector<StreamQueryPtr> resend;
+		for (auto& item : m_pending) {
+			if (reopen && !item.second->resent && item.second.use_count() > 1) {
+				item.second->resent = true;
+				resend.push_back(item.second);
+			} else {
+				complete(*item.second, ARES_ECONNREFUSED, std::string());
+			}
+		}
+		m_pending.clear();
+		if (resend.empty())
+			return;
+		if (!openSocket()) {
+			for (auto& query : resend)
+				complete(*query, ARES_ECONNREFUSED, std::string());
+			return;
+		}
+		for (auto& query : resend) {
+			g_streamStats.resent++;
+			queue(query);
+		}
+	}
 
-		while (!callbackData.done && totalWaitMs < timeoutMs)
-		{
-			fd_set read_fds, write_fds;
-			int nfds;
-			struct timeval tv, *tvp;
-
-			FD_ZERO(&read_fds);
-			FD_ZERO(&write_fds);
-			nfds = ares_fds(channel, &read_fds, &write_fds);
-			if (nfds == 0)
-				break;
+	void transfer()
+	{
+		if (m_fd < 0)
+			return;
+		if (m_connecting) {
+			struct pollfd poll_fd = { m_fd, POLLOUT, 0 };
+			if (poll(&poll_fd, 1, 0) <= 0)
+				return;
+			int error = 0;
+			socklen_t size = sizeof(error);
+			if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0 || error != 0) {
+				fail(false);
+				return;
+			}
+			m_connecting = false;
+		}
+		if (m_ssl) {
+			if (!transferTls())
+				return;
+		} else if (!sendBuffered(m_out) || !receive(m_in)) {
+			readResponses();
+			fail(true); // closed by the server, or a socket error
+			return;
+		}
+		readResponses();
+	}
 
-			tvp = ares_timeout(channel, nullptr, &tv);
+	// Writes as much of buffer as the socket takes; false on errors
+	bool sendBuffered(std::string& buffer)
+	{
+		while (!buffer.empty()) {
+			ssize_t sent = ::send(m_fd, buffer.data(), buffer.size(), STREAM_SEND_FLAGS);
+			if (sent < 0)
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			buffer.erase(0, static_cast<size_t>(sent));
+			m_lastActivity = std::chrono::steady_clock::now();
+		}
+		return true;
+	}
 
-			int waitMs = (tvp->tv_sec * 1000) + (tvp->tv_usec / 1000);
-			if (waitMs > (timeoutMs - totalWaitMs))
-				waitMs = timeoutMs - totalWaitMs;
+	// Appends what the socket has to buffer; false once the connection was closed or failed
+	bool receive(std::string& buffer)
+	{
+		char chunk[STREAM_READ_SIZE];
+		for (;;) {
+			ssize_t received = recv(m_fd, chunk, sizeof(chunk), 0);
+			if (received <= 0)
+				return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+			buffer.append(chunk, static_cast<size_t>(received));
+			m_lastActivity = std::chrono::steady_clock::now();
+		}
+	}
 
-			struct timeval tv_limit = { waitMs / 1000, (waitMs % 1000) * 1000 };
+	// TLS runs over memory BIOs: the socket is still read and written here, with STREAM_SEND_FLAGS
+	// (OpenSSL's socket BIO would raise SIGPIPE on a closed connection). Returns false once the
+	// connection failed; a failed handshake (e.g. a certificate that does not match) or a TLS error
+	// fails the queries without reopening.
+	bool transferTls()
+	{
+		ERR_clear_error();
+		std::string received;
+		bool open = receive(received);
+		if (!received.empty())
+			BIO_write(SSL_get_rbio(m_ssl), received.data(), static_cast<int>(received.size()));
 
-			int waited = select(nfds, &read_fds, &write_fds, nullptr, &tv_limit);
-			if (waited >= 0)
-			{
-				ares_process(channel, &read_fds, &write_fds);
-				totalWaitMs += waitMs;
+		bool ok = true;
+		if (m_handshaking) {
+			int result = SSL_do_handshake(m_ssl);
+			if (result == 1) {
+				m_handshaking = false;
+				g_streamStats.tlsHandshakes++;
+				if (SSL_session_reused(m_ssl))
+					g_streamStats.tlsResumed++;
+			} else {
+				int error = SSL_get_error(m_ssl, result);
+				ok = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
 			}
-			else
-			{
-				break; // select error
+		}
+		if (ok && !m_handshaking) {
+			size_t written = 0;
+			if (!m_out.empty()) {
+				ok = SSL_write_ex(m_ssl, m_out.data(), m_out.size(), &written) == 1;
+				m_out.erase(0, written);
 			}
+			char chunk[STREAM_READ_SIZE];
+			size_t bytes = 0;
+			while (ok && SSL_read_ex(m_ssl, chunk, sizeof(chunk), &bytes) == 1)
+				m_in.append(chunk, bytes);
+			if (ok) {
+				int error = SSL_get_error(m_ssl, 0);
+				if (error == SSL_ERROR_ZERO_RETURN)
+					open = false; // close_notify
+				else if (error != SSL_ERROR_WANT_READ)
+					ok = false;
+			}
+		}
+
+		if (!flushTls())
+			open = false;
+		if (!ok || !open) {
+			readResponses();
+			fail(ok);
+			return false;
 		}
+		return true;
+	}
+
+	// Sends what TLS has written to its memory BIO; false on socket errors
+	bool flushTls()
+	{
+		char chunk[STREAM_READ_SIZE];
+		int length;
+		while ((length = BIO_read(SSL_get_wbio(m_ssl), chunk, sizeof(chunk))) > 0)
+			m_wire.append(chunk, static_cast<size_t>(length));
+		return sendBuffered(m_wire);
+	}
+
+	// Completes the queries whose responses were read; responses to unknown IDs or with
+	// another question are dropped
+	void readResponses()
+	{
+		size_t offset = 0;
+		while (m_in.size() - offset >= 2) {
+			size_t length = static_cast<unsigned char>(m_in[offset]) << 8 | static_cast<unsigned char>(m_in[offset + 1]);
+			if (m_in.size() - offset - 2 < length)
+				break;
+			std::string response = m_in.substr(offset + 2, length);
+			offset += 2 + length;
+			if (response.size() < NS_HFIXEDSZ)
+				continue;
+			fmx::uint16 id = static_cast<fmx::uint16>(static_cast<unsigned char>(response[0]) << 8 | static_cast<unsigned char>(response[1]));
+			auto it = m_pending.find(id);
+			if (it == m_pending.end() || !sameQuestion(it->second->message, response))
+				continue;
+			m_answered++;
+			complete(*it->second, responseStatus(response), response);
+			m_pending.erase(it);
+		}
+		m_in.erase(0, offset);
+	}
+
+	const struct sockaddr_storage m_address;
+	const socklen_t m_length;
+	const std::shared_ptr<TlsContext> m_tls;
+	std::mutex m_lock;                  // guards the members below
+	int m_fd = -1;
+	SSL* m_ssl = nullptr;
+	bool m_connecting = false;
+	bool m_handshaking = false;         // TLS handshake in progress
+	std::string m_out;                  // length-prefixed queries not written yet
+	std::string m_wire;                 // TLS records not sent yet
+	std::string m_in;                   // received bytes not parsed yet
+	std::unordered_map<fmx::uint16, StreamQueryPtr> m_pending;
+	fmx::uint16 m_nextId = static_cast<fmx::uint16>(std::chrono::steady_clock::now().time_since_epoch().count());
+	fmx::uint64 m_answered = 0;         // responses read on the current socket
+	std::chrono::steady_clock::time_point m_lastActivity;
+};
+
+#define HTTPS_MAX_RESPONSE 65535  // bytes, the largest DNS message
+
+// RFC 4648 base64url without padding, as the dns parameter of a GET request carries the query
+static std::string base64Url(const std::string& data)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	std::string encoded;
+	fmx::uint32 bits = 0;
+	int count = 0;
+	for (unsigned char byte : data) {
+		bits = (bits << 8) | byte;
+		count += 8;
+		while (count >= 6) {
+			count -= 6;
+			encoded += alphabet[(bits >> count) & 0x3f];
+		}
+	}
+	if (count > 0)
+		encoded += alphabet[(bits << (6 - count)) & 0x3f];
+	return encoded;
+}
+
+// Lowers the TTLs of a DoH response by the Age of the HTTP response and caps them at its max-age
+// (RFC 8484 section 5.1), so an answer that waited in an HTTP cache is not kept longer than its
+// records live. The TTL field of an OPT record holds flags and is left alone.
+static void applyHttpFreshness(std::string& response, long maxAge, long age)
+{
+	if ((maxAge < 0 && age <= 0) || response.size() < NS_HFIXEDSZ)
+		return;
+	unsigned char* message = reinterpret_cast<unsigned char*>(&response[0]);
+	const unsigned char* eom = message + response.size();
+	int questions = message[4] << 8 | message[5];
+	int records = (message[6] << 8 | message[7]) + (message[8] << 8 | message[9]) + (message[10] << 8 | message[11]);
+	unsigned char* p = message + NS_HFIXEDSZ;
+	for (int i = 0; i < questions; ++i) {
+		int length = dn_skipname(p, eom);
+		if (length < 0 || eom - p < length + NS_QFIXEDSZ)
+			return;
+		p += length + NS_QFIXEDSZ;
+	}
+	for (int i = 0; i < records; ++i) {
+		int length = dn_skipname(p, eom);
+		if (length < 0 || eom - p < length + NS_RRFIXEDSZ)
+			return;
+		p += length;
+		int type = p[0] << 8 | p[1];
+		size_t rdlength = static_cast<size_t>(p[8] << 8 | p[9]);
+		if (type != ns_t_opt) {
+			long long ttl = static_cast<long long>(static_cast<fmx::uint32>(p[4]) << 24 | p[5] << 16 | p[6] << 8 | p[7]);
+			if (maxAge >= 0)
+				ttl = std::min<long long>(ttl, maxAge);
+			ttl = std::max<long long>(0, ttl - std::max(0L, age));
+			p[4] = static_cast<unsigned char>(ttl >> 24);
+			p[5] = static_cast<unsigned char>(ttl >> 16);
+			p[6] = static_cast<unsigned char>(ttl >> 8);
+			p[7] = static_cast<unsigned char>(ttl);
+		}
+		if (static_cast<size_t>(eom - p) < NS_RRFIXEDSZ + rdlength)
+			return;
+		p += NS_RRFIXEDSZ + rdlength;
+	}
+}
+
+// A DNS over HTTPS server (RFC 8484). Queries are POSTed to its URL in wire format, or sent with
+// GET when the URL is a template ending in "{?dns}". libcurl keeps a single HTTP/2 connection to
+// the server and sends every query as one stream of it, so concurrent lookups are multiplexed
+// instead of queuing or opening more connections (queries beyond the server's stream limit wait
+// for a free stream). Queries carry ID 0 to stay cacheable by HTTP caches, and the answers' TTLs
+// are adjusted for the Age and max-age of their HTTP response before they are cached.
+class HttpsConnection : public QueryConnection {
+public:
+	// url is the server's URL or URL template, e.g. "https://1.1.1.1/dns-query"
+	explicit HttpsConnection(const std::string& url) : m_lastActivity(std::chrono::steady_clock::now())
+	{
+		size_t dns = url.find("{?dns}");
+		m_get = dns != std::string::npos;
+		m_url = m_get ? url.substr(0, dns) : url;
+		m_multi = curl_multi_init();
+		if (m_multi) {
+			curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+			curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, 1L);
+			curl_multi_setopt(m_multi, CURLMOPT_SOCKETFUNCTION, watchSocket);
+			curl_multi_setopt(m_multi, CURLMOPT_SOCKETDATA, &m_sockets);
+		}
+		m_headers = curl_slist_append(m_headers, "Accept: application/dns-message");
+		if (!m_get)
+			m_headers = curl_slist_append(m_headers, "Content-Type: application/dns-message");
+	}
+
+	~HttpsConnection() override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (auto& item : m_transfers) {
+			complete(*item.second.query, ARES_ECONNREFUSED, std::string());
+			curl_multi_remove_handle(m_multi, item.first);
+			curl_easy_cleanup(item.first);
+		}
+		if (m_multi)
+			curl_multi_cleanup(m_multi);
+		curl_slist_free_all(m_headers);
+	}
+
+	HttpsConnection(const HttpsConnection&) = delete;
+	HttpsConnection& operator=(const HttpsConnection&) = delete;
+
+	bool send(const StreamQueryPtr& query) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		dropAbandoned();
+		if (!m_multi || !m_headers || query->message.size() < NS_HFIXEDSZ)
+			return false;
+		CURL* easy = curl_easy_init();
+		if (!easy)
+			return false;
+		query->message[0] = query->message[1] = 0;
+		Transfer& transfer = m_transfers[easy];
+		transfer.query = query;
+		if (m_get) {
+			curl_easy_setopt(easy, CURLOPT_URL, (m_url + "?dns=" + base64Url(query->message)).c_str());
+		} else {
+			curl_easy_setopt(easy, CURLOPT_URL, m_url.c_str());
+			curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, static_cast<long>(query->message.size()));
+			curl_easy_setopt(easy, CURLOPT_COPYPOSTFIELDS, query->message.data());
+		}
+		curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+		curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L); // wait for the connection in progress rather than open another
+		curl_easy_setopt(easy, CURLOPT_HTTPHEADER, m_headers);
+		curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, writeBody);
+		curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer);
+		curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, readHeader);
+		curl_easy_setopt(easy, CURLOPT_HEADERDATA, &transfer);
+		curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+		if (curl_multi_add_handle(m_multi, easy) != CURLM_OK) {
+			m_transfers.erase(easy);
+			curl_easy_cleanup(easy);
+			return false;
+		}
+		g_streamStats.httpsQueries++;
+		m_lastActivity = std::chrono::steady_clock::now();
+		perform();
+		return true;
+	}
+
+	void addPollFds(std::vector<struct pollfd>& fds) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (const auto& item : m_sockets)
+			fds.push_back({ item.first, pollEvents(item.second), 0 });
+	}
+
+	void timeout(int& waitMs) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		long ms = -1;
+		if (!m_multi || curl_multi_timeout(m_multi, &ms) != CURLM_OK || ms < 0)
+			return;
+		waitMs = static_cast<int>(std::min<long>(waitMs, ms));
+	}
+
+	void process() override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		perform();
+	}
+
+	size_t load() override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		dropAbandoned();
+		return m_transfers.size();
+	}
+
+	bool expired(std::chrono::steady_clock::time_point now) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (now - m_lastActivity < std::chrono::milliseconds(STREAM_IDLE_TIMEOUT))
+			return false;
+		dropAbandoned();
+		return m_transfers.empty();
+	}
+
+private:
+	// One query's HTTP request
+	struct Transfer {
+		StreamQueryPtr query;
+		std::string body;
+		long maxAge = -1;   // s, from Cache-Control
+		long age = 0;       // s the response spent in HTTP caches
+	};
+
+	// CURLMOPT_SOCKETFUNCTION: keeps m_sockets up to date with the sockets libcurl waits on
+	static int watchSocket(CURL* /*easy*/, curl_socket_t socket, int what, void* user, void* /*socketData*/)
+	{
+		auto* sockets = static_cast<std::unordered_map<curl_socket_t, int>*>(user);
+		if (what == CURL_POLL_REMOVE)
+			sockets->erase(socket);
+		else
+			(*sockets)[socket] = what;
+		return 0;
+	}
+
+	// The poll() events for CURL_POLL_* flags
+	static short pollEvents(int what)
+	{
+		return static_cast<short>((what & CURL_POLL_IN ? POLLIN : 0) | (what & CURL_POLL_OUT ? POLLOUT : 0));
+	}
+
+	static size_t writeBody(char* data, size_t size, size_t count, void* user)
+	{
+		Transfer* transfer = static_cast<Transfer*>(user);
+		size_t length = size * count;
+		if (transfer->body.size() + length > HTTPS_MAX_RESPONSE)
+			return 0; // not a DNS message, fails the transfer
+		transfer->body.append(data, length);
+		return length;
+	}
+
+	static size_t readHeader(char* data, size_t size, size_t count, void* user)
+	{
+		Transfer* transfer = static_cast<Transfer*>(user);
+		std::string line = lowercase(std::string(data, size * count));
+		if (line.compare(0, 5, "http/") == 0) {
+			transfer->maxAge = -1; // a new response (after a redirect or 100 Continue)
+			transfer->age = 0;
+		} else if (line.compare(0, 14, "cache-control:") == 0) {
+			size_t maxAge = line.find("max-age=");
+			if (line.find("no-store") != std::string::npos || line.find("no-cache") != std::string::npos)
+				transfer->maxAge = 0;
+			else if (maxAge != std::string::npos)
+				transfer->maxAge = atol(line.c_str() + maxAge + 8);
+		} else if (line.compare(0, 4, "age:") == 0) {
+			transfer->age = atol(line.c_str() + 4);
+		}
+		return size * count;
+	}
+
+	// Cancels the requests whose lookup is over (HTTP/2 resets only their stream)
+	void dropAbandoned()
+	{
+		for (auto it = m_transfers.begin(); it != m_transfers.end();) {
+			if (it->second.query.use_count() == 1) {
+				curl_multi_remove_handle(m_multi, it->first);
+				curl_easy_cleanup(it->first);
+				it = m_transfers.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	// Lets libcurl read and write without blocking, then completes the finished requests. A
+	// response other than 200 with an answer to the question fails the query. libcurl is driven
+	// through its socket interface rather than curl_multi_perform(), which has it report its
+	// sockets for poll() (curl_multi_fdset() cannot report descriptors past FD_SETSIZE).
+	void perform()
+	{
+		if (!m_multi)
+			return;
+		int running = 0;
+		std::vector<struct pollfd> fds;
+		for (const auto& item : m_sockets)
+			fds.push_back({ item.first, pollEvents(item.second), 0 });
+		if (!fds.empty() && poll(fds.data(), fds.size(), 0) > 0) {
+			for (const struct pollfd& fd : fds) {
+				int events = (fd.revents & POLLIN ? CURL_CSELECT_IN : 0) | (fd.revents & POLLOUT ? CURL_CSELECT_OUT : 0) |
+					(fd.revents & (POLLERR | POLLHUP | POLLNVAL) ? CURL_CSELECT_ERR : 0);
+				if (events != 0)
+					curl_multi_socket_action(m_multi, fd.fd, events, &running);
+			}
+		}
+		// Starts the requests just added and runs libcurl's expired timers
+		if (curl_multi_socket_action(m_multi, CURL_SOCKET_TIMEOUT, 0, &running) != CURLM_OK)
+			return;
+		CURLMsg* message;
+		int queued = 0;
+		while ((message = curl_multi_info_read(m_multi, &queued)) != nullptr) {
+			if (message->msg != CURLMSG_DONE)
+				continue;
+			CURL* easy = message->easy_handle;
+			CURLcode result = message->data.result;
+			auto it = m_transfers.find(easy);
+			if (it != m_transfers.end()) {
+				Transfer& transfer = it->second;
+				long code = 0;
+				long connects = 0;
+				curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+				curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+				g_streamStats.httpsConnections += static_cast<fmx::uint64>(connects);
+				if (result == CURLE_OK && code == 200 && sameQuestion(transfer.query->message, transfer.body)) {
+					if (connects == 0)
+						g_streamStats.httpsReused++;
+					applyHttpFreshness(transfer.body, transfer.maxAge, transfer.age);
+					complete(*transfer.query, responseStatus(transfer.body), transfer.body);
+				} else {
+					complete(*transfer.query, ARES_ECONNREFUSED, std::string());
+				}
+				m_transfers.erase(it);
+			}
+			curl_multi_remove_handle(m_multi, easy);
+			curl_easy_cleanup(easy);
+			m_lastActivity = std::chrono::steady_clock::now();
+		}
+	}
+
+	std::string m_url;                  // without the "{?dns}" of a template
+	bool m_get = false;
+	std::mutex m_lock;                  // guards the members below; libcurl handles are not thread safe
+	CURLM* m_multi = nullptr;           // holds the connection
+	std::unordered_map<curl_socket_t, int> m_sockets; // the sockets libcurl waits on, by CURL_POLL_* flags
+	struct curl_slist* m_headers = nullptr;
+	std::unordered_map<CURL*, Transfer> m_transfers;
+	std::chrono::steady_clock::time_point m_lastActivity;
+};
+
+// c-ares helpers ==========================================================================
+
+// Creates a c-ares channel for dnsServer (CSV list as accepted by fDNS_Set_Server, transports are ignored).
+// retransmitMs and tries > 0 override the first retransmit timeout and number of tries of the channel
+// options (or the library's); flags are ARES_FLAG_* values.
+static int create_channel(const std::string& dnsServer, ares_channel* channel, int retransmitMs = 0, int tries = 0, int flags = 0)
+{
+	std::string endpoints;
+	if (!endpointList(dnsServer, endpoints))
+		return 1;
+	std::shared_ptr<const ChannelOptions> configured = channelOptions();
+	if (retransmitMs <= 0)
+		retransmitMs = configured->timeoutMs;
+	if (tries <= 0)
+		tries = configured->tries;
+	struct ares_options options;
+	memset(&options, 0, sizeof(options));
+	int optmask = configured->rotate ? ARES_OPT_ROTATE : 0;
+	if (configured->ednsPayloadSize > 0) {
+		flags |= ARES_FLAG_EDNS;
+		options.ednspsz = configured->ednsPayloadSize;
+		optmask |= ARES_OPT_EDNSPSZ;
+	}
+	if (configured->socketSendBuffer > 0) {
+		options.socket_send_buffer_size = configured->socketSendBuffer;
+		optmask |= ARES_OPT_SOCK_SNDBUF;
+	}
+	if (configured->socketReceiveBuffer > 0) {
+		options.socket_receive_buffer_size = configured->socketReceiveBuffer;
+		optmask |= ARES_OPT_SOCK_RCVBUF;
+	}
+#ifdef ARES_OPT_UDP_MAX_QUERIES
+	if (configured->udpMaxQueries > 0) {
+		options.udp_max_queries = configured->udpMaxQueries;
+		optmask |= ARES_OPT_UDP_MAX_QUERIES;
+	}
+#endif
+	if (flags != 0) {
+		options.flags = flags;
+		optmask |= ARES_OPT_FLAGS;
+	}
+	if (retransmitMs > 0) {
+		options.timeout = retransmitMs;
+		optmask |= ARES_OPT_TIMEOUTMS;
+	}
+	if (tries > 0) {
+		options.tries = tries;
+		optmask |= ARES_OPT_TRIES;
+	}
+	if (ares_init_options(channel, &options, optmask) != ARES_SUCCESS)
+		return 1;
+	if (!endpoints.empty() && ares_set_servers_ports_csv(*channel, endpoints.c_str()) != ARES_SUCCESS) {
+		ares_destroy(*channel);
+		*channel = nullptr;
+		return 1;
+	}
+	return 0;
+}
+
+// Adds the sockets of a channel to a poll() set with the events c-ares waits for. Unlike
+// ares_fds() this has no FD_SETSIZE limit on the descriptors.
+static void addChannelPollFds(ares_channel channel, std::vector<struct pollfd>& fds)
+{
+	ares_socket_t sockets[ARES_GETSOCK_MAXNUM];
+	int bits = ares_getsock(channel, sockets, ARES_GETSOCK_MAXNUM);
+	for (int i = 0; i < ARES_GETSOCK_MAXNUM; ++i) {
+		short events = 0;
+		if (ARES_GETSOCK_READABLE(bits, i))
+			events |= POLLIN;
+		if (ARES_GETSOCK_WRITABLE(bits, i))
+			events |= POLLOUT;
+		if (events == 0)
+			break;
+		fds.push_back({ sockets[i], events, 0 });
+	}
+}
+
+// Shortens waitMs to the channel's next retransmit or timeout (rounded up to whole ms)
+static void channelTimeout(ares_channel channel, int& waitMs)
+{
+	struct timeval maxtv = { waitMs / 1000, (waitMs % 1000) * 1000 };
+	struct timeval tv;
+	const struct timeval* next = ares_timeout(channel, &maxtv, &tv);
+	waitMs = static_cast<int>(next->tv_sec * 1000 + (next->tv_usec + 999) / 1000);
+}
+
+// Handles the sockets poll() found ready among the count added by addChannelPollFds(), and the
+// channel's retransmits and timeouts
+static void processChannel(ares_channel channel, const struct pollfd* fds, size_t count)
+{
+	bool processed = false;
+	for (size_t i = 0; i < count; ++i) {
+		const short error = POLLERR | POLLHUP | POLLNVAL;
+		ares_socket_t readFd = fds[i].revents & (POLLIN | error) ? fds[i].fd : ARES_SOCKET_BAD;
+		ares_socket_t writeFd = fds[i].revents & (POLLOUT | error) ? fds[i].fd : ARES_SOCKET_BAD;
+		if (readFd != ARES_SOCKET_BAD || writeFd != ARES_SOCKET_BAD) {
+			ares_process_fd(channel, readFd, writeFd);
+			processed = true;
+		}
+	}
+	if (!processed)
+		ares_process_fd(channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD); // only the timeouts
+}
+
+// DNS messages ============================================================================
+//
+// Lookups keep the raw responses to their queries. When a response arrives only the answer
+// records of the queried type are counted (with their lowest TTL); they are turned into text
+// when a caller reads them, so answers that are cached or refreshed in the background are not
+// decoded until they are used.
+
+// Name of a record type the plugin decodes, nullptr for the others
+static const char* recordTypeName(int type)
+{
+	switch (type) {
+	case ns_t_a: return "A";
+	case ns_t_aaaa: return "AAAA";
+	case ns_t_cname: return "CNAME";
+	case ns_t_mx: return "MX";
+	case ns_t_txt: return "TXT";
+	case ns_t_ns: return "NS";
+	case ns_t_srv: return "SRV";
+	case ns_t_ptr: return "PTR";
+	default: return nullptr;
+	}
+}
+
+// Type of the question of a parsed message, -1 if it has none
+static int questionType(ns_msg& handle)
+{
+	ns_rr question;
+	if (ns_msg_count(handle, ns_s_qd) < 1 || ns_parserr(&handle, ns_s_qd, 0, &question) != 0)
+		return -1;
+	return ns_rr_type(question);
+}
+
+// Counts the answer records of the queried type and lowers minTtl to theirs
+static int scanResponse(const unsigned char* abuf, int alen, fmx::uint32& minTtl)
+{
+	ns_msg handle;
+	if (ns_initparse(abuf, alen, &handle) != 0)
+		return 0;
+	int type = questionType(handle);
+	if (!recordTypeName(type))
+		return 0;
+	int count = 0;
+	for (int i = 0; i < ns_msg_count(handle, ns_s_an); ++i) {
+		ns_rr rr;
+		if (ns_parserr(&handle, ns_s_an, i, &rr) == 0 && ns_rr_type(rr) == type) {
+			minTtl = std::min<fmx::uint32>(minTtl, ns_rr_ttl(rr));
+			count++;
+		}
+	}
+	return count;
+}
+
+// Expands the domain name at offset in the data of rr into name; false if it is malformed or runs
+// past the end of the record
+static bool expandRecordName(const unsigned char* abuf, const unsigned char* eom, const ns_rr& rr, size_t offset, char* name, int size)
+{
+	size_t rdlen = ns_rr_rdlen(rr);
+	if (offset >= rdlen)
+		return false;
+	int used = dn_expand(abuf, eom, ns_rr_rdata(rr) + offset, name, size);
+	return used >= 0 && static_cast<size_t>(used) <= rdlen - offset;
+}
+
+// Appends the answer records of the queried type in message to records, skipping duplicates.
+// Records whose data is shorter than their type needs are skipped.
+static void decodeResponse(const std::string& message, DNSRecords& records)
+{
+	const unsigned char* abuf = reinterpret_cast<const unsigned char*>(message.data());
+	const unsigned char* eom = abuf + message.size();
+	ns_msg handle;
+	if (ns_initparse(abuf, static_cast<int>(message.size()), &handle) != 0)
+		return;
+	int type = questionType(handle);
+	const char* typeName = recordTypeName(type);
+	if (!typeName)
+		return;
+	int count = ns_msg_count(handle, ns_s_an);
+	for (int i = 0; i < count; ++i) {
+		ns_rr rr;
+		if (ns_parserr(&handle, ns_s_an, i, &rr) != 0 || ns_rr_type(rr) != type)
+			continue;
+		const unsigned char* rdata = ns_rr_rdata(rr);
+		const size_t rdlen = ns_rr_rdlen(rr);
+		std::string value;
+		if (type == ns_t_a) {
+			char ip[INET_ADDRSTRLEN];
+			if (rdlen == NS_INADDRSZ && inet_ntop(AF_INET, rdata, ip, sizeof(ip)))
+				value = ip;
+		} else if (type == ns_t_aaaa) {
+			char ip[INET6_ADDRSTRLEN];
+			if (rdlen == NS_IN6ADDRSZ && inet_ntop(AF_INET6, rdata, ip, sizeof(ip)))
+				value = ip;
+		} else if (type == ns_t_mx) {
+			char mx[256];
+			if (expandRecordName(abuf, eom, rr, 2, mx, sizeof(mx))) {
+				uint16_t preference = (rdata[0] << 8) | rdata[1];
+				value = std::to_string(preference) + " " + mx;
+			}
+		} else if (type == ns_t_txt) {
+			size_t txt_len = rdlen > 0 ? *rdata : 0;
+			if (rdlen > 0 && 1 + txt_len <= rdlen)
+				value.assign(reinterpret_cast<const char*>(rdata + 1), txt_len);
+		} else if (type == ns_t_srv) {
+			char target[256];
+			if (expandRecordName(abuf, eom, rr, 6, target, sizeof(target))) {
+				uint16_t priority = (rdata[0] << 8) | rdata[1];
+				uint16_t weight = (rdata[2] << 8) | rdata[3];
+				uint16_t port = (rdata[4] << 8) | rdata[5];
+				value = std::to_string(priority) + " " + std::to_string(weight) + " " + std::to_string(port) + " " + target;
+			}
+		} else {
+			// CNAME, NS and PTR hold a single name
+			char name[256];
+			if (expandRecordName(abuf, eom, rr, 0, name, sizeof(name)))
+				value = name;
+		}
+		std::pair<std::string, std::string> record(typeName, value);
+		if (!value.empty() && std::find(records.begin(), records.end(), record) == records.end())
+			records.push_back(record);
+	}
+}
+
+static DNSRecords decodeResponses(const std::vector<std::string>& responses)
+{
+	DNSRecords records;
+	for (const auto& response : responses)
+		decodeResponse(response, records);
+	return records;
+}
+
+// Upstream servers & hedged lookups =======================================================
+//
+// Every server of the fDNS_Set_Server list is an Upstream with its own statistics, and each
+// lookup sends its queries to one upstream at a time through a single-server channel.
+// Upstreams are tried in order of their smoothed RTT, and each channel retransmits after the
+// upstream's own RTO (computed as in TCP, RFC 6298) instead of the library's fixed timer.
+// When the upstream answers with an error or times out the next one is tried (failover). With
+// hedging enabled the next upstream is also tried when the current one has not answered within
+// the hedge delay; the first good answer wins and the other attempts are cancelled. Queries to
+// "tcp://" and "tls://" upstreams are sent over the upstream's connection pool instead of a channel.
+
+#define MAX_CACHE_TTL 86400       // s, longer TTLs are capped
+#define DEFAULT_HEDGE_DELAY 100   // ms, used until an upstream has enough RTT samples for a p90
+#define RTT_SAMPLE_COUNT 64       // recent answer latencies kept per upstream
+#define RTT_MIN_SAMPLES 8
+#define INITIAL_RTO 1000.0        // ms, retransmit timeout before the first RTT sample
+#define MIN_RTO 10.0              // ms
+#define MAX_RTO 5000.0            // ms
+#define MAX_TRIES 12              // transmissions per attempt, with exponential backoff
+#define RANK_DECAY 0.98           // applied to upstreams passed over by a lookup, so they get retried eventually
+#define CIRCUIT_FAILURE_THRESHOLD 3 // consecutive failed attempts that open an upstream's circuit
+#define CIRCUIT_ERROR_RATE 0.5      // ... or this failure rate once CIRCUIT_MIN_ATTEMPTS completed
+#define CIRCUIT_MIN_ATTEMPTS 10
+#define CIRCUIT_COOLDOWN 1000       // ms until an open circuit is probed, doubled after every failed probe
+#define CIRCUIT_MAX_COOLDOWN 60000  // ms
+
+// Circuit breaker state of an upstream. Open upstreams are skipped by lookups until a
+// background probe (sent from Do_PluginIdle) gets an answer from them again.
+enum CircuitState {
+	kCircuitClosed,
+	kCircuitOpen,
+	kCircuitHalfOpen  // cooldown over, probe in flight
+};
+
+struct Upstream {
+	explicit Upstream(const std::string& serverAddress) : address(serverAddress)
+	{
+		parseServer(address, transport, endpoint, authName);
+		int timeoutMs = channelOptions()->timeoutMs;
+		if (timeoutMs > 0)
+			rtoMs = timeoutMs;
+	}
+
+	const std::string address;        // one entry of the fDNS_Set_Server list, e.g. "1.1.1.1" or "[::1]:5353"
+	Transport transport;
+	std::string endpoint;             // address without the transport
+	std::string authName;             // name a TLS server's certificate must match, "" = its address
+	std::mutex lock;                  // guards the fields below
+	std::vector<std::shared_ptr<QueryConnection>> streams; // TCP/TLS/HTTPS connections, opened as queries need them
+	std::shared_ptr<TlsContext> tls;  // settings and session shared by the TLS connections
+	std::vector<int> rttSamples;      // ring buffer of recent answer latencies in microseconds
+	size_t nextSample = 0;
+	double srttMs = 0;                // smoothed RTT, 0 until the first sample
+	double rttvarMs = 0;              // RTT variation
+	double rtoMs = INITIAL_RTO;       // retransmit timeout used for the next channel
+	double rankMs = 0;                // orders the upstreams: the srtt, raised by timeouts and decayed while passed over
+	fmx::uint64 attempts = 0;         // attempts that completed (cancelled hedge losers are not counted)
+	fmx::uint64 answers = 0;
+	fmx::uint64 timeouts = 0;         // attempts that ran out of retransmissions
+	fmx::uint64 errors = 0;           // SERVFAIL, REFUSED and other error responses
+	fmx::uint64 retransmits = 0;
+	CircuitState circuit = kCircuitClosed;
+	int consecutiveFailures = 0;
+	double errorRate = 0;             // EWMA of failed attempts
+	int cooldownMs = CIRCUIT_COOLDOWN;
+	std::chrono::steady_clock::time_point openedAt;
+};
+typedef std::shared_ptr<Upstream> UpstreamPtr;
+
+struct DNSStats {
+	std::atomic<fmx::uint64> lookups{0};    // lookups sent to custom DNS servers
+	std::atomic<fmx::uint64> failovers{0};  // attempts started because the previous upstream failed or exceeded its RTO
+	std::atomic<fmx::uint64> hedges{0};     // attempts started because the previous upstream was slow
+	std::atomic<fmx::uint64> hedgeWins{0};  // lookups answered by a hedged attempt
+	std::atomic<fmx::uint64> circuitOpens{0};   // upstreams taken out of rotation
+	std::atomic<fmx::uint64> circuitSkips{0};   // times an open upstream was skipped by a lookup
+	std::atomic<fmx::uint64> probes{0};         // background probes of open upstreams
+	std::atomic<fmx::uint64> cacheHits{0};
+	std::atomic<fmx::uint64> cacheMisses{0};
+	std::atomic<fmx::uint64> staleAnswers{0};   // expired answers served (RFC 8767)
+	std::atomic<fmx::uint64> backgroundRefreshes{0};
+	std::atomic<fmx::uint64> prefetches{0};     // hot entries refreshed ahead of their expiry
+	std::atomic<fmx::uint64> snapshotHits{0};   // entries loaded from the cache snapshot
+	std::atomic<fmx::uint64> sharedHits{0};     // entries found in the shared-memory cache
+	std::atomic<fmx::uint64> localAnswers{0};   // lookups answered from the local zone
+	std::atomic<fmx::uint64> searchQueries{0};  // queries for search list names after the first name of a lookup
+	std::atomic<fmx::uint64> systemConfigChanges{0}; // changes of the system's servers or search settings seen
+	std::atomic<fmx::uint64> tcpFallbacks{0};   // truncated UDP responses queried again over TCP
+};
+
+static std::vector<UpstreamPtr> g_upstreams; // parsed from g_currentDnsServer, protected by g_dnsMutex
+static bool g_hedgingEnabled = false;        // protected by g_dnsMutex
+static int g_hedgeDelayMs = 0;               // 0 = use the upstream's observed p90
+static DNSStats g_stats;
+
+// Builds the upstream list for dnsServer, keeping the statistics of servers that stay configured
+static std::vector<UpstreamPtr> buildUpstreams(const std::string& dnsServer, const std::vector<UpstreamPtr>& previous)
+{
+	std::vector<UpstreamPtr> upstreams;
+	for (const auto& server : splitServerList(dnsServer)) {
+		auto it = std::find_if(previous.begin(), previous.end(), [&server](const UpstreamPtr& u) { return u->address == server; });
+		upstreams.push_back(it != previous.end() ? *it : std::make_shared<Upstream>(server));
+	}
+	return upstreams;
+}
+
+// The connection of the upstream's pool that the next queries go to: the least busy one, or a new
+// one when all are busy and the pool is not full. nullptr if the endpoint is not an address.
+// Truncated UDP answers are retried over TCP, so a UDP upstream gets TCP connections too. An HTTPS
+// upstream has a single connection, which multiplexes its queries.
+static std::shared_ptr<QueryConnection> streamFor(Upstream& upstream)
+{
+	std::lock_guard<std::mutex> lock(upstream.lock);
+	if (upstream.transport == kTransportHttps) {
+		if (upstream.streams.empty())
+			upstream.streams.push_back(std::make_shared<HttpsConnection>(upstream.endpoint));
+		return upstream.streams.front();
+	}
+	std::shared_ptr<QueryConnection> leastBusy;
+	size_t leastLoad = 0;
+	for (const auto& stream : upstream.streams) {
+		size_t load = stream->load();
+		if (!leastBusy || load < leastLoad) {
+			leastBusy = stream;
+			leastLoad = load;
+		}
+	}
+	if (leastBusy && (leastLoad < STREAM_BUSY_QUERIES || upstream.streams.size() >= STREAM_POOL_SIZE))
+		return leastBusy;
+
+	struct sockaddr_storage address;
+	socklen_t length = 0;
+	Transport transport = upstream.transport == kTransportUdp ? kTransportTcp : upstream.transport;
+	if (!parseEndpoint(upstream.endpoint, defaultPort(transport), address, length))
+		return nullptr;
+	if (transport == kTransportTls && !upstream.tls)
+		upstream.tls = std::make_shared<TlsContext>(upstream.authName);
+	upstream.streams.push_back(std::make_shared<StreamConnection>(address, length, transport == kTransportTls ? upstream.tls : nullptr));
+	return upstream.streams.back();
+}
+
+// Reads and writes the TCP/TLS/HTTPS connections of the upstreams without waiting and closes the idle ones.
+// Called from Do_PluginIdle.
+static void pumpStreams(const std::vector<UpstreamPtr>& upstreams)
+{
+	auto now = std::chrono::steady_clock::now();
+	for (const auto& upstream : upstreams) {
+		std::vector<std::shared_ptr<QueryConnection>> streams;
+		{
+			std::lock_guard<std::mutex> lock(upstream->lock);
+			auto expired = std::remove_if(upstream->streams.begin(), upstream->streams.end(), [now](const std::shared_ptr<QueryConnection>& stream) {
+				return stream->expired(now);
+			});
+			upstream->streams.erase(expired, upstream->streams.end());
+			streams = upstream->streams;
+		}
+		for (const auto& stream : streams)
+			stream->process();
+	}
+}
+
+// Folds one RTT sample into the upstream's estimators (RFC 6298 with K = 4, G = 1 ms)
+static void recordRtt(Upstream& upstream, int rttUs)
+{
+	std::lock_guard<std::mutex> lock(upstream.lock);
+	if (upstream.rttSamples.size() < RTT_SAMPLE_COUNT) {
+		upstream.rttSamples.push_back(rttUs);
+	} else {
+		upstream.rttSamples[upstream.nextSample] = rttUs;
+		upstream.nextSample = (upstream.nextSample + 1) % RTT_SAMPLE_COUNT;
+	}
+
+	double rttMs = rttUs / 1000.0;
+	if (upstream.srttMs == 0) {
+		upstream.srttMs = rttMs;
+		upstream.rttvarMs = rttMs / 2;
+	} else {
+		upstream.rttvarMs = 0.75 * upstream.rttvarMs + 0.25 * fabs(upstream.srttMs - rttMs);
+		upstream.srttMs = 0.875 * upstream.srttMs + 0.125 * rttMs;
+	}
+	upstream.rtoMs = std::min(MAX_RTO, std::max(MIN_RTO, upstream.srttMs + std::max(1.0, 4 * upstream.rttvarMs)));
+	upstream.rankMs = upstream.srttMs;
+}
+
+// The upstream ran out of retransmissions: back off its RTO and, as it could not answer within
+// the old RTO, assume at least that much latency when ordering upstreams. The RTT estimators
+// themselves only change with samples.
+static void recordTimeout(Upstream& upstream)
+{
+	std::lock_guard<std::mutex> lock(upstream.lock);
+	upstream.rankMs = std::max(upstream.rankMs, upstream.rtoMs);
+	upstream.rtoMs = std::min(MAX_RTO, upstream.rtoMs * 2);
+	upstream.timeouts++;
+}
+
+static int retransmitTimeoutMs(Upstream& upstream)
+{
+	std::lock_guard<std::mutex> lock(upstream.lock);
+	return static_cast<int>(ceil(upstream.rtoMs));
+}
+
+// 90th percentile of the recent answer latencies in microseconds, or -1 without enough samples
+static int rttPercentile90(Upstream& upstream)
+{
+	std::vector<int> samples;
+	{
+		std::lock_guard<std::mutex> lock(upstream.lock);
+		samples = upstream.rttSamples;
+	}
+	if (samples.size() < RTT_MIN_SAMPLES)
+		return -1;
+	auto nth = samples.begin() + (samples.size() * 9) / 10;
+	std::nth_element(samples.begin(), nth, samples.end());
+	return *nth;
+}
+
+static const char* circuitName(CircuitState state)
+{
+	switch (state) {
+		case kCircuitOpen: return "open";
+		case kCircuitHalfOpen: return "half-open";
+		default: return "closed";
+	}
+}
+
+// Updates the circuit after a completed attempt or probe, upstream.lock must be held
+static void updateCircuit(Upstream& upstream, bool answered)
+{
+	if (answered) {
+		upstream.consecutiveFailures = 0;
+		upstream.errorRate *= 0.9;
+		if (upstream.circuit != kCircuitClosed) {
+			// The errors that opened it are history; keeping them would reopen it on the next one
+			upstream.circuit = kCircuitClosed;
+			upstream.cooldownMs = CIRCUIT_COOLDOWN;
+			upstream.errorRate = 0;
+		}
+		return;
+	}
+
+	upstream.consecutiveFailures++;
+	upstream.errorRate = 0.9 * upstream.errorRate + 0.1;
+	if (upstream.circuit == kCircuitHalfOpen) {
+		// Failed probe: stay out of rotation for twice as long
+		upstream.circuit = kCircuitOpen;
+		upstream.cooldownMs = std::min(upstream.cooldownMs * 2, CIRCUIT_MAX_COOLDOWN);
+		upstream.openedAt = std::chrono::steady_clock::now();
+	} else if (upstream.circuit == kCircuitClosed &&
+			   (upstream.consecutiveFailures >= CIRCUIT_FAILURE_THRESHOLD ||
+				(upstream.attempts >= CIRCUIT_MIN_ATTEMPTS && upstream.errorRate >= CIRCUIT_ERROR_RATE))) {
+		upstream.circuit = kCircuitOpen;
+		upstream.openedAt = std::chrono::steady_clock::now();
+		g_stats.circuitOpens++;
+	}
+}
+
+// Orders upstreams by expected latency (rankMs); untested ones (0) come first so they get measured,
+// and the rank of the others decays a little so that a server that was slow once is retried later.
+// Upstreams with an open circuit are left out, unless every upstream is open. With the rotate
+// option the upstreams are taken in turn instead.
+static std::atomic<size_t> g_nextRotation{0};
+
+static std::vector<UpstreamPtr> orderUpstreams(const std::vector<UpstreamPtr>& upstreams)
+{
+	std::vector<std::pair<double, UpstreamPtr>> keyed;
+	for (const auto& upstream : upstreams) {
+		std::lock_guard<std::mutex> lock(upstream->lock);
+		if (upstream->circuit == kCircuitClosed)
+			keyed.emplace_back(upstream->rankMs, upstream);
+	}
+	if (keyed.empty()) {
+		for (const auto& upstream : upstreams) {
+			std::lock_guard<std::mutex> lock(upstream->lock);
+			keyed.emplace_back(upstream->rankMs, upstream);
+		}
+	} else {
+		g_stats.circuitSkips += upstreams.size() - keyed.size();
+	}
+	if (keyed.empty())
+		return std::vector<UpstreamPtr>();
+	if (channelOptions()->rotate) {
+		// Round robin: each lookup starts with the next server
+		std::rotate(keyed.begin(), keyed.begin() + static_cast<std::ptrdiff_t>(g_nextRotation++ % keyed.size()), keyed.end());
+	} else {
+		std::stable_sort(keyed.begin(), keyed.end(), [](const std::pair<double, UpstreamPtr>& a, const std::pair<double, UpstreamPtr>& b) { return a.first < b.first; });
+	}
+	std::vector<UpstreamPtr> ordered;
+	for (const auto& entry : keyed) {
+		if (!ordered.empty()) {
+			std::lock_guard<std::mutex> lock(entry.second->lock);
+			entry.second->rankMs *= RANK_DECAY;
+		}
+		ordered.push_back(entry.second);
+	}
+	return ordered;
+}
+
+// A response that should end the lookup: an answer, or an authoritative "no such name/data"
+static bool isAnswerStatus(int status)
+{
+	return status == ARES_SUCCESS || status == ARES_ENOTFOUND || status == ARES_ENODATA;
+}
+
+struct Attempt;
+
+// c-ares callback argument for one query of an attempt
+struct AttemptQuery {
+	Attempt* attempt;
+	std::string response; // kept only when it answers the query with records
+	std::string name;     // the query, as sent by transmit()
+	int type = 0;
+	ares_callback callback = nullptr;
+	std::vector<std::string> names; // search list names of a searchQuery()
+	size_t nextName = 0;
+};
+
+// The queries of one lookup sent to a single upstream
+struct Attempt {
+	UpstreamPtr upstream;
+	ares_channel channel = nullptr;
+	std::chrono::steady_clock::time_point started;
+	std::chrono::steady_clock::time_point finished;
+	std::shared_ptr<QueryConnection> stream;        // TCP/TLS/HTTPS connection the queries were sent on, if any
+	std::shared_ptr<StreamNotifier> notifier;       // signalled when another thread completes a query sent on it
+	std::vector<std::pair<StreamQueryPtr, AttemptQuery*>> streamQueries; // sent on stream, callback not run yet
+	bool hedged = false;          // started because the previous upstream was slow
+	int rtoMs = 0;                // retransmit timeout of the channel
+	int pending = 0;              // outstanding queries
+	int status = ARES_SUCCESS;    // first non-answer status among the queries
+	int timeouts = 0;             // retransmissions, RTT samples are only taken without any (Karn)
+	size_t recordCount = 0;       // answer records of the queried types
+	fmx::uint32 ttl = MAX_CACHE_TTL; // lowest TTL of the records
+	std::deque<AttemptQuery> queries;
+
+	bool done() const { return pending == 0; }
+	bool answered() const { return done() && isAnswerStatus(status); }
+
+	// Registers one more outstanding query, the result is the argument for its c-ares callback
+	AttemptQuery* addQuery()
+	{
+		queries.push_back(AttemptQuery());
+		queries.back().attempt = this;
+		++pending;
+		return &queries.back();
+	}
+
+	void addResponse(AttemptQuery& query, const unsigned char* abuf, int alen)
+	{
+		int count = scanResponse(abuf, alen, ttl);
+		if (count == 0)
+			return;
+		recordCount += count;
+		query.response.assign(reinterpret_cast<const char*>(abuf), alen);
+	}
+
+	// The responses with records, in the order the queries were sent
+	std::vector<std::string> responses() const
+	{
+		std::vector<std::string> result;
+		for (const auto& query : queries) {
+			if (!query.response.empty())
+				result.push_back(query.response);
+		}
+		return result;
+	}
+
+	void finishQuery(int queryStatus, int queryTimeouts)
+	{
+		if (!isAnswerStatus(queryStatus) && isAnswerStatus(status))
+			status = queryStatus;
+		timeouts += queryTimeouts;
+		if (--pending == 0)
+			finished = std::chrono::steady_clock::now();
+	}
+
+	// Runs the callbacks of the queries completed on the TCP connection, on the thread that runs
+	// the lookup; a callback may send further queries
+	void deliverStreamResponses()
+	{
+		for (size_t i = 0; i < streamQueries.size();) {
+			if (!streamQueries[i].first->done.load(std::memory_order_acquire)) {
+				++i;
+				continue;
+			}
+			StreamQueryPtr sent = streamQueries[i].first;
+			AttemptQuery* query = streamQueries[i].second;
+			streamQueries.erase(streamQueries.begin() + static_cast<std::ptrdiff_t>(i));
+			unsigned char* abuf = sent->response.empty() ? nullptr : reinterpret_cast<unsigned char*>(&sent->response[0]);
+			query->callback(query, sent->status, 0, abuf, static_cast<int>(sent->response.size()));
+		}
+	}
+};
+
+// c-ares callback of the lookups' queries: keeps the response for when it is read
+static void storeResponse(void* arg, int status, int timeouts, unsigned char* abuf, int alen)
+{
+	AttemptQuery* query = static_cast<AttemptQuery*>(arg);
+	if (status == ARES_SUCCESS && abuf)
+		query->attempt->addResponse(*query, abuf, alen);
+	query->attempt->finishQuery(status, timeouts);
+}
+
+static void udpResponse(void* arg, int status, int timeouts, unsigned char* abuf, int alen);
+
+// Sends query->name over UDP through the attempt's channel, or over a TCP/TLS/HTTPS connection of the upstream.
+// query->callback gets the result either way.
+static void transmit(AttemptQuery* query, bool overTcp)
+{
+	Attempt& attempt = *query->attempt;
+	if (!overTcp) {
+		ares_query(attempt.channel, query->name.c_str(), ns_c_in, query->type, udpResponse, query);
+		return;
+	}
+
+	if (!attempt.stream)
+		attempt.stream = streamFor(*attempt.upstream);
+	if (!attempt.notifier)
+		attempt.notifier = std::make_shared<StreamNotifier>();
+	StreamQueryPtr sent = makeStreamQuery(query->name, query->type);
+	sent->notifier = attempt.notifier;
+	if (!attempt.stream || sent->message.empty() || !attempt.stream->send(sent)) {
+		// Completed by the next deliverStreamResponses(), not from within the starter
+		sent->status = ARES_ECONNREFUSED;
+		sent->done = true;
+		attempt.notifier->notify();
+	}
+	attempt.streamQueries.emplace_back(sent, query);
+}
+
+// Callback of the queries sent over UDP. A truncated response is queried again over the
+// upstream's TCP connection, which is opened once and then reused (the channels ignore TC).
+static void udpResponse(void* arg, int status, int timeouts, unsigned char* abuf, int alen)
+{
+	AttemptQuery* query = static_cast<AttemptQuery*>(arg);
+	if (abuf && alen >= NS_HFIXEDSZ && (abuf[2] & 0x02)) {
+		g_stats.tcpFallbacks++;
+		query->attempt->timeouts += timeouts;
+		transmit(query, true);
+		return;
+	}
+	query->callback(arg, status, timeouts, abuf, alen);
+}
+
+// Sends one query of an attempt, over the transport of its upstream; callback gets its result
+static void sendQuery(Attempt& attempt, const std::string& name, int type, ares_callback callback = storeResponse)
+{
+	AttemptQuery* query = attempt.addQuery();
+	query->name = name;
+	query->type = type;
+	query->callback = callback;
+	transmit(query, attempt.upstream->transport != kTransportUdp);
+}
+
+class Lookup {
+public:
+	// Issues the queries of one attempt with sendQuery()
+	typedef std::function<void(Attempt&)> Starter;
+
+	Lookup(const std::vector<UpstreamPtr>& upstreams, const Starter& starter)
+		: m_upstreams(orderUpstreams(upstreams)), m_starter(starter)
+	{
+		std::lock_guard<std::mutex> lock(g_dnsMutex);
+		m_hedging = g_hedgingEnabled;
+		m_hedgeDelayMs = g_hedgeDelayMs;
+	}
+
+	~Lookup()
+	{
+		// Destroying a channel runs the callbacks of its queries, so the attempts must still exist
+		for (auto& attempt : m_attempts) {
+			if (attempt->channel)
+				ares_destroy(attempt->channel);
+		}
+	}
+
+	Lookup(const Lookup&) = delete;
+	Lookup& operator=(const Lookup&) = delete;
+
+	const Starter& starter() const { return m_starter; }
+
+	// Runs the lookup to completion (answer, every upstream failed, or timeoutMs elapsed)
+	void run(int timeoutMs)
+	{
+		start(timeoutMs);
+		while (!step(timeoutMs)) {}
+		finish();
+	}
+
+	void start(int timeoutMs)
+	{
+		m_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		g_stats.lookups++;
+		launch(false);
+	}
+
+	// Waits at most maxWaitMs for progress; returns true once the lookup is over.
+	// step(0) only processes what is ready, which lets Do_PluginIdle drive lookups in the background.
+	bool step(int maxWaitMs)
+	{
+		if (winner())
+			return true;
+
+		bool anyPending = std::any_of(m_attempts.begin(), m_attempts.end(), [](const std::unique_ptr<Attempt>& a) { return !a->done(); });
+		if (!anyPending) {
+			if (!launch(false))
+				return true; // every upstream failed
+			g_stats.failovers++;
+			return false;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now >= m_deadline)
+			return true;
+
+		auto wakeAt = std::min(m_deadline, now + std::chrono::milliseconds(maxWaitMs));
+		if (m_next < m_upstreams.size()) {
+			// Like c-ares with several servers, the next upstream is tried once the current one has not
+			// answered within its RTO (failover), or earlier when hedging (the current one keeps retrying)
+			const Attempt& last = *m_attempts.back();
+			int delayMs = last.rtoMs;
+			bool hedge = false;
+			if (m_hedging) {
+				int hedgeMs = hedgeDelayMs(*last.upstream);
+				if (hedgeMs < delayMs) {
+					delayMs = hedgeMs;
+					hedge = true;
+				}
+			}
+			auto launchAt = last.started + std::chrono::milliseconds(delayMs);
+			if (last.done() || now >= launchAt) {
+				launch(hedge && !last.done());
+				if (hedge && !last.done())
+					g_stats.hedges++;
+				else
+					g_stats.failovers++;
+				return false;
+			}
+			wakeAt = std::min(wakeAt, launchAt);
+		}
+
+		int waitMs = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(wakeAt - now).count());
+		if (wakeAt < m_deadline && maxWaitMs > 0)
+			waitMs++; // round up so the launch time has passed when poll() returns
+
+		// The descriptors of attempt i are pollFds[first[i]] to pollFds[first[i + 1]]
+		std::vector<struct pollfd> pollFds;
+		std::vector<size_t> first(m_attempts.size() + 1, 0);
+		for (size_t i = 0; i < m_attempts.size(); ++i) {
+			Attempt& attempt = *m_attempts[i];
+			first[i] = pollFds.size();
+			if (attempt.done())
+				continue;
+			if (attempt.channel) {
+				addChannelPollFds(attempt.channel, pollFds);
+				channelTimeout(attempt.channel, waitMs);
+			}
+			if (attempt.stream) {
+				attempt.stream->addPollFds(pollFds);
+				attempt.stream->timeout(waitMs);
+			}
+			if (attempt.notifier && attempt.notifier->fd() >= 0)
+				pollFds.push_back({ attempt.notifier->fd(), POLLIN, 0 });
+		}
+		first[m_attempts.size()] = pollFds.size();
+
+		if (poll(pollFds.data(), pollFds.size(), waitMs) < 0 && errno != EINTR)
+			return true; // poll error
+
+		for (size_t i = 0; i < m_attempts.size(); ++i) {
+			Attempt* attempt = m_attempts[i].get();
+			if (attempt->done())
+				continue;
+			if (attempt->channel)
+				processChannel(attempt->channel, pollFds.data() + first[i], first[i + 1] - first[i]);
+			if (attempt->stream) {
+				attempt->stream->process();
+				attempt->notifier->drain();
+				attempt->deliverStreamResponses();
+			}
+		}
+		return winner() != nullptr;
+	}
+
+	// Cancels the attempts still in flight and records the outcome in the upstream statistics
+	void finish()
+	{
+		if (m_finished)
+			return;
+		m_finished = true;
+
+		const Attempt* answer = winner();
+		if (answer && answer->hedged)
+			g_stats.hedgeWins++;
+
+		// The first good answer wins, the attempts still in flight are cancelled. Those that got no
+		// answer within their RTO count as timeouts of their upstream, hedges that simply lost do not.
+		const auto end = std::chrono::steady_clock::now();
+		for (auto& attempt : m_attempts) {
+			if (!attempt->done()) {
+				bool timedOut = !answer || end - attempt->started >= std::chrono::milliseconds(attempt->rtoMs);
+				if (attempt->channel)
+					ares_cancel(attempt->channel);
+				if (timedOut)
+					recordAttempt(*attempt, true);
+			} else {
+				recordAttempt(*attempt, false);
+			}
+		}
+	}
+
+	// The attempt that answered first, or nullptr
+	const Attempt* winner() const
+	{
+		const Attempt* first = nullptr;
+		for (const auto& attempt : m_attempts) {
+			if (attempt->answered() && (!first || attempt->finished < first->finished))
+				first = attempt.get();
+		}
+		return first;
+	}
+
+	// The winner, or else the attempt with the most partial records (nullptr if none)
+	const Attempt* result() const
+	{
+		if (const Attempt* answer = winner())
+			return answer;
+		const Attempt* best = nullptr;
+		for (const auto& attempt : m_attempts) {
+			if (attempt->recordCount > 0 && (!best || attempt->recordCount > best->recordCount))
+				best = attempt.get();
+		}
+		return best;
+	}
+
+private:
+	int hedgeDelayMs(Upstream& upstream) const
+	{
+		if (m_hedgeDelayMs > 0)
+			return m_hedgeDelayMs;
+		int p90 = rttPercentile90(upstream);
+		return p90 >= 0 ? std::max((p90 + 999) / 1000, 1) : DEFAULT_HEDGE_DELAY;
+	}
+
+	static void recordAttempt(const Attempt& attempt, bool cancelledAfterTimeout)
+	{
+		Upstream& upstream = *attempt.upstream;
+		if (cancelledAfterTimeout) {
+			recordTimeout(upstream);
+			std::lock_guard<std::mutex> lock(upstream.lock);
+			upstream.attempts++;
+			updateCircuit(upstream, false);
+			return;
+		}
+		if (attempt.status == ARES_ETIMEOUT) {
+			recordTimeout(upstream);
+		} else if (attempt.answered() && attempt.timeouts == 0) {
+			// Karn's algorithm: answers to retransmitted queries are ambiguous and not sampled
+			recordRtt(upstream, static_cast<int>(std::chrono::duration_cast<std::chrono::microseconds>(attempt.finished - attempt.started).count()));
+		}
+		std::lock_guard<std::mutex> lock(upstream.lock);
+		upstream.attempts++;
+		upstream.retransmits += attempt.timeouts;
+		if (attempt.answered())
+			upstream.answers++;
+		else if (attempt.status != ARES_ETIMEOUT)
+			upstream.errors++;
+		updateCircuit(upstream, attempt.answered());
+	}
+
+	// Starts an attempt on the next upstream, false if there is none left
+	bool launch(bool hedged)
+	{
+		while (m_next < m_upstreams.size()) {
+			std::unique_ptr<Attempt> attempt(new Attempt);
+			attempt->upstream = m_upstreams[m_next++];
+			attempt->hedged = hedged;
+			attempt->started = std::chrono::steady_clock::now();
+			attempt->rtoMs = retransmitTimeoutMs(*attempt->upstream);
+			// c-ares doubles the timeout on every retransmission and accepts a late answer to any of them,
+			// so allow enough tries to keep the query alive until the lookup's deadline
+			int remainingMs = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(m_deadline - attempt->started).count());
+			int maxTries = channelOptions()->tries;
+			if (maxTries <= 0)
+				maxTries = MAX_TRIES;
+			int tries = 1;
+			while (tries < maxTries && attempt->rtoMs * ((1 << tries) - 1) < remainingMs)
+				tries++;
+			if (attempt->upstream->transport != kTransportUdp) {
+				// TCP does its own retransmissions; the queries go over a connection of the upstream's pool
+				attempt->stream = streamFor(*attempt->upstream);
+				if (!attempt->stream)
+					continue;
+			} else if (create_channel(attempt->upstream->address, &attempt->channel, attempt->rtoMs, tries, ARES_FLAG_IGNTC) != 0) {
+				continue;
+			}
+			m_attempts.push_back(std::move(attempt));
+			m_starter(*m_attempts.back());
+			return true;
+		}
+		return false;
+	}
+
+	std::vector<UpstreamPtr> m_upstreams;
+	Starter m_starter;
+	bool m_hedging = false;
+	int m_hedgeDelayMs = 0;
+	size_t m_next = 0;
+	std::vector<std::unique_ptr<Attempt>> m_attempts;
+	std::chrono::steady_clock::time_point m_deadline;
+	bool m_finished = false;
+};
+
+// Probes of upstreams with an open circuit. They are started and driven without blocking from
+// Do_PluginIdle, so a dead server comes back into rotation without any lookup waiting on it.
+// Probes of TCP, TLS and HTTPS upstreams go over their connections instead of a channel.
+struct Probe {
+	UpstreamPtr upstream;
+	ares_channel channel = nullptr;
+	StreamQueryPtr query;             // sent over TCP, TLS or HTTPS
+	std::chrono::steady_clock::time_point deadline; // ... and given up on after MAX_RTO
+	bool done = false;
+	bool answered = false;
+};
+
+static std::mutex g_probeMutex;                       // guards g_probes
+static std::vector<std::unique_ptr<Probe>> g_probes;
+
+static void startProbes(const std::vector<UpstreamPtr>& upstreams)
+{
+	auto now = std::chrono::steady_clock::now();
+	for (const auto& upstream : upstreams) {
+		{
+			std::lock_guard<std::mutex> lock(upstream->lock);
+			if (upstream->circuit != kCircuitOpen || now < upstream->openedAt + std::chrono::milliseconds(upstream->cooldownMs))
+				continue;
+			upstream->circuit = kCircuitHalfOpen;
+		}
+
+		// Any response to "./NS", even a negative one, shows that the server is back
+		std::unique_ptr<Probe> probe(new Probe);
+		probe->upstream = upstream;
+		bool started;
+		if (upstream->transport != kTransportUdp) {
+			std::shared_ptr<QueryConnection> stream = streamFor(*upstream);
+			probe->query = makeStreamQuery(".", ns_t_ns);
+			probe->deadline = now + std::chrono::milliseconds(static_cast<int>(MAX_RTO));
+			started = stream && !probe->query->message.empty() && stream->send(probe->query);
+		} else {
+			started = create_channel(upstream->address, &probe->channel, retransmitTimeoutMs(*upstream)) == 0;
+		}
+		if (!started) {
+			std::lock_guard<std::mutex> lock(upstream->lock);
+			updateCircuit(*upstream, false);
+			continue;
+		}
+		if (probe->channel) {
+			auto callback = [](void* arg, int status, int /*timeouts*/, unsigned char* /*abuf*/, int /*alen*/) {
+				auto* p = static_cast<Probe*>(arg);
+				p->answered = isAnswerStatus(status);
+				p->done = true;
+			};
+			ares_query(probe->channel, ".", ns_c_in, ns_t_ns, callback, probe.get());
+		}
+		g_stats.probes++;
+		g_probes.push_back(std::move(probe));
+	}
+}
+
+// Processes whatever the probe channels have ready, without waiting. The connections of stream
+// probes are read by pumpStreams().
+static void pumpProbes()
+{
+	// The descriptors of probe i are pollFds[first[i]] to pollFds[first[i + 1]]
+	std::vector<struct pollfd> pollFds;
+	std::vector<size_t> first(g_probes.size() + 1, 0);
+	for (size_t i = 0; i < g_probes.size(); ++i) {
+		first[i] = pollFds.size();
+		if (g_probes[i]->channel)
+			addChannelPollFds(g_probes[i]->channel, pollFds);
+	}
+	first[g_probes.size()] = pollFds.size();
+	if (!pollFds.empty() && poll(pollFds.data(), pollFds.size(), 0) < 0)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < g_probes.size(); ++i) {
+		Probe* probe = g_probes[i].get();
+		if (probe->done)
+			continue;
+		if (probe->channel) {
+			processChannel(probe->channel, pollFds.data() + first[i], first[i + 1] - first[i]); // also handles retransmits and timeouts
+		} else if (probe->query->done.load(std::memory_order_acquire)) {
+			probe->answered = isAnswerStatus(probe->query->status);
+			probe->done = true;
+		} else if (now >= probe->deadline) {
+			probe->done = true;
+		}
+	}
+
+	for (auto it = g_probes.begin(); it != g_probes.end();) {
+		Probe& probe = **it;
+		if (!probe.done) {
+			++it;
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> lock(probe.upstream->lock);
+			updateCircuit(*probe.upstream, probe.answered);
+		}
+		if (probe.channel)
+			ares_destroy(probe.channel);
+		it = g_probes.erase(it);
+	}
+}
+
+static void destroyProbes()
+{
+	std::lock_guard<std::mutex> lock(g_probeMutex);
+	for (auto& probe : g_probes) {
+		std::lock_guard<std::mutex> upstreamLock(probe->upstream->lock);
+		if (probe->upstream->circuit == kCircuitHalfOpen)
+			probe->upstream->circuit = kCircuitOpen;
+		if (probe->channel)
+			ares_destroy(probe->channel);
+	}
+	g_probes.clear();
+}
+
+// Conditional forwarding ==================================================================
+//
+// fDNS_Set_Route sends the names under a domain suffix (e.g. corp.local) to their own servers,
+// everything else goes to the fDNS_Set_Server list (the default route). Routes are kept in a
+// trie of labels read from the right, so the longest matching suffix is found with one map
+// lookup per label of the name. Each route has its own upstreams, with their RTT statistics and
+// circuit state; an upstream that appears in several routes is shared.
+
+struct Route {
+	std::string suffix;                 // lowercased, without the trailing dot
+	std::string dnsServer;              // server list as for fDNS_Set_Server
+	std::vector<UpstreamPtr> upstreams;
+};
+
+// One label of the route trie; the children are keyed by the label to their left
+struct RouteNode {
+	std::map<std::string, std::unique_ptr<RouteNode>> children;
+	std::shared_ptr<const Route> route; // set if a route ends at this label
+};
+
+static RouteNode g_routes; // protected by g_dnsMutex
+
+// Calls visit for each label of name, from the rightmost one, until it returns false
+template <typename Visit>
+static void forEachLabelFromRight(const std::string& name, Visit visit)
+{
+	size_t end = name.size();
+	if (end > 0 && name[end - 1] == '.')
+		end--;
+	while (end > 0) {
+		size_t dot = name.rfind('.', end - 1);
+		size_t start = dot == std::string::npos ? 0 : dot + 1;
+		if (!visit(name.substr(start, end - start)) || dot == std::string::npos)
+			return;
+		end = dot;
+	}
+}
+
+// The route with the longest suffix of name, nullptr if none matches. Called with g_dnsMutex held.
+static std::shared_ptr<const Route> findRoute(const std::string& name)
+{
+	std::shared_ptr<const Route> route;
+	const RouteNode* node = &g_routes;
+	forEachLabelFromRight(lowercase(name), [&](const std::string& label) {
+		auto it = node->children.find(label);
+		if (it == node->children.end())
+			return false;
+		node = it->second.get();
+		if (node->route)
+			route = node->route;
+		return true;
+	});
+	return route;
+}
+
+// The servers for a lookup of name: those of its route, else the default ones ("" = system resolver).
+// True if a route matched.
+static bool serversFor(const std::string& name, std::string& dnsServer, std::vector<UpstreamPtr>& upstreams)
+{
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	std::shared_ptr<const Route> route = findRoute(name);
+	if (route) {
+		dnsServer = route->dnsServer;
+		upstreams = route->upstreams;
+	} else {
+		dnsServer = g_currentDnsServer;
+		upstreams = g_upstreams;
+	}
+	return route != nullptr;
+}
+
+static void collectRoutes(const RouteNode& node, std::vector<std::shared_ptr<const Route>>& routes)
+{
+	if (node.route)
+		routes.push_back(node.route);
+	for (const auto& child : node.children)
+		collectRoutes(*child.second, routes);
+}
+
+// The upstreams of the default route and of every route, each once. Called with g_dnsMutex held.
+static std::vector<UpstreamPtr> allUpstreams()
+{
+	std::vector<UpstreamPtr> upstreams = g_upstreams;
+	std::vector<std::shared_ptr<const Route>> routes;
+	collectRoutes(g_routes, routes);
+	for (const auto& route : routes) {
+		for (const auto& upstream : route->upstreams) {
+			if (std::find(upstreams.begin(), upstreams.end(), upstream) == upstreams.end())
+				upstreams.push_back(upstream);
+		}
+	}
+	return upstreams;
+}
+
+// Search list =============================================================================
+//
+// Names looked up through DNS servers are expanded with the search list by the plugin instead of
+// ares_search, so that the list and ndots can be set with fDNS_Set_Search and every extra query is
+// counted (searchQueries in fDNS_Get_Stats). By default the list and ndots of resolv.conf are used,
+// as c-ares would. The system resolver (no server set) keeps applying resolv.conf itself, as
+// getaddrinfo also matches the hosts file, which has no absolute names.
+
+#define MAX_NDOTS 15                            // as in resolv.conf
+
+static bool g_searchSystem = true;              // use the system's search list; protected by g_dnsMutex
+static std::vector<std::string> g_searchDomains; // set by fDNS_Set_Search, protected by g_dnsMutex
+static int g_searchNdots = -1;                  // -1 = the system's ndots, protected by g_dnsMutex
+static std::vector<std::string> g_systemSearchDomains; // read from the default channel, protected by g_dnsMutex
+static int g_systemNdots = 1;
+
+// Reads the search list and ndots that c-ares took from the system configuration (see readSystemConfig).
+// Called with g_dnsMutex held.
+static void readSystemSearch(ares_channel channel)
+{
+	struct ares_options options;
+	int optmask = 0;
+	if (ares_save_options(channel, &options, &optmask) != ARES_SUCCESS)
+		return;
+	g_systemSearchDomains.assign(options.domains, options.domains + options.ndomains);
+	g_systemNdots = options.ndots;
+	ares_destroy_options(&options);
+}
+
+// The names a lookup of hostname tries, in order, as ares_search would: the name as given first
+// when it has at least ndots dots, else last. A trailing dot makes the name absolute, so it is the
+// only one tried. The names have no trailing dot.
+static std::vector<std::string> searchNames(const std::string& hostname)
+{
+	std::string name = hostname;
+	bool absolute = !name.empty() && name.back() == '.';
+	if (absolute)
+		name.pop_back();
+	std::vector<std::string> names;
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	const std::vector<std::string>& domains = g_searchSystem ? g_systemSearchDomains : g_searchDomains;
+	if (absolute || domains.empty())
+		return std::vector<std::string>(1, name);
+
+	int ndots = g_searchNdots >= 0 ? g_searchNdots : g_systemNdots;
+	bool asIsFirst = std::count(name.begin(), name.end(), '.') >= ndots;
+	if (asIsFirst)
+		names.push_back(name);
+	for (const auto& domain : domains)
+		names.push_back(name + "." + domain);
+	if (!asIsFirst)
+		names.push_back(name);
+	return names;
+}
+
+// c-ares callback of searchQuery(): tries the next name when the current one does not exist or has
+// no records of the type, as ares_search does
+static void searchResponse(void* arg, int status, int timeouts, unsigned char* abuf, int alen)
+{
+	AttemptQuery* query = static_cast<AttemptQuery*>(arg);
+	if ((status == ARES_ENOTFOUND || status == ARES_ENODATA) && query->nextName < query->names.size()) {
+		g_stats.searchQueries++;
+		query->attempt->timeouts += timeouts;
+		query->name = query->names[query->nextName++];
+		transmit(query, query->attempt->upstream->transport != kTransportUdp);
+		return;
+	}
+	storeResponse(arg, status, timeouts, abuf, alen);
+}
+
+// Queries the names of searchNames() one after the other until one has records of type
+static void searchQuery(Attempt& attempt, const std::vector<std::string>& names, int type)
+{
+	AttemptQuery* query = attempt.addQuery();
+	query->name = names[0];
+	query->type = type;
+	query->callback = searchResponse;
+	query->names = names;
+	query->nextName = 1;
+	transmit(query, attempt.upstream->transport != kTransportUdp);
+}
+
+// Timer wheel =============================================================================
+//
+// A hashed hierarchical timing wheel (Varghese and Lauck) holds the deadlines that are too many
+// to keep in a sorted structure: the retransmission timers of fDNS_Resolve_Bulk's queries and
+// the refresh times of the cached answers. Time is counted in ticks of 1 ms since the wheel was
+// created. The first level has one slot per tick for the next 256 ticks; each further level has
+// 64 slots that each span the whole level below, and the slot that comes up is moved down a
+// level (cascaded) whenever the level below wraps around. Timers are list nodes embedded in the
+// objects they belong to, so scheduling and cancelling one is O(1) and allocates nothing, and
+// each tick expires its whole slot at once. Ticks with nothing to fire or cascade are skipped, so
+// catching up after a long idle gap costs the occupied slots, not the milliseconds. The deadlines
+// of single lookups (retransmits, hedges, probes and stream waits) stay with c-ares and the
+// lookup's own poll() loop: each lookup waits in its caller's thread for a few deadlines only, so
+// a shared wheel would cost a lock and cross-thread wakeups and save nothing.
+
+#define TIMER_WHEEL_BITS 8   // first level: 256 slots of one tick
+#define TIMER_LEVEL_BITS 6   // further levels: 64 slots each
+#define TIMER_LEVELS 5       // 2^32 ticks (49 days); later timers wait in the last level
+
+class TimerWheel {
+public:
+	// Embedded in the object it belongs to; copies are not scheduled
+	struct Timer {
+		Timer* prev = nullptr;
+		Timer* next = nullptr;
+		fmx::uint64 due = 0;   // tick
+
+		Timer() = default;
+		Timer(const Timer&) {}
+		Timer& operator=(const Timer&) { return *this; }
+
+		bool scheduled() const { return next != nullptr; }
+	};
+
+	TimerWheel() : m_start(std::chrono::steady_clock::now()), m_slots(FIRST_SLOTS + (TIMER_LEVELS - 1) * LEVEL_SLOTS)
+	{
+		clear();
+	}
+
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	// Fires the timer at when, rounded up to the next tick; a scheduled timer is moved
+	void schedule(Timer& timer, std::chrono::steady_clock::time_point when)
+	{
+		cancel(timer);
+		auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(when - m_start).count();
+		timer.due = std::max<fmx::uint64>(elapsed > 0 ? (static_cast<fmx::uint64>(elapsed) + 999999) / 1000000 : 0, m_now + 1);
+		link(timer);
+		m_count++;
+	}
+
+	void cancel(Timer& timer)
+	{
+		if (!timer.scheduled())
+			return;
+		unlink(timer);
+		m_count--;
+	}
+
+	// Unschedules every timer at once; their owners must not cancel them afterwards
+	void clear()
+	{
+		for (Timer& slot : m_slots)
+			slot.prev = slot.next = &slot;
+		m_count = 0;
+	}
+
+	size_t size() const { return m_count; }
+
+	// Fires the timers that are due by now, calling handler(Timer&) for each after it was
+	// unscheduled; the handler may schedule timers (that one too) or destroy it
+	template <typename Handler>
+	void advance(std::chrono::steady_clock::time_point now, Handler handler)
+	{
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_start).count();
+		fmx::uint64 target = elapsed > 0 ? static_cast<fmx::uint64>(elapsed) : 0;
+		while (m_now < target) {
+			if (m_count == 0) {
+				m_now = target;
+				break;
+			}
+			size_t following = (m_now + 1) & (FIRST_SLOTS - 1);
+			if (following != 0 && m_slots[following].next == &m_slots[following])
+				m_now = std::min(nextEvent(), target) - 1;
+			m_now++;
+			size_t index = m_now & (FIRST_SLOTS - 1);
+			if (index == 0)
+				cascade(1);
+			Timer& slot = m_slots[index];
+			if (slot.next == &slot)
+				continue;
+			// Taken off the slot first, as the handlers may schedule timers for the next round
+			Timer expired;
+			splice(slot, expired);
+			while (expired.next != &expired) {
+				Timer& timer = *expired.next;
+				unlink(timer);
+				m_count--;
+				handler(timer);
+			}
+		}
+	}
+
+	// When the next timer fires, time_point::max() if none is scheduled. Timers in the further
+	// levels count from the tick their slot is cascaded, which may be early but never late.
+	std::chrono::steady_clock::time_point nextExpiry() const
+	{
+		if (m_count == 0)
+			return std::chrono::steady_clock::time_point::max();
+		return m_start + std::chrono::milliseconds(nextEvent());
+	}
+
+private:
+	static const size_t FIRST_SLOTS = 1 << TIMER_WHEEL_BITS;
+	static const size_t LEVEL_SLOTS = 1 << TIMER_LEVEL_BITS;
+
+	// The next tick with timers in its slot of the first level, or at which an occupied slot of a
+	// further level is cascaded; ~0 if there is none. The ticks before it have nothing to do.
+	fmx::uint64 nextEvent() const
+	{
+		fmx::uint64 next = ~0ULL;
+		for (fmx::uint64 tick = m_now + 1; tick <= m_now + FIRST_SLOTS; ++tick) {
+			const Timer& slot = m_slots[tick & (FIRST_SLOTS - 1)];
+			if (slot.next != &slot) {
+				next = tick;
+				break;
+			}
+		}
+		// Nothing is cascaded before the first level wraps around
+		if (next <= (m_now | (FIRST_SLOTS - 1)))
+			return next;
+		for (int level = 1; level < TIMER_LEVELS; ++level) {
+			int shift = TIMER_WHEEL_BITS + (level - 1) * TIMER_LEVEL_BITS;
+			for (fmx::uint64 position = (m_now >> shift) + 1; position <= (m_now >> shift) + LEVEL_SLOTS; ++position) {
+				const Timer& slot = levelSlot(level, position);
+				if (slot.next != &slot) {
+					next = std::min(next, position << shift);
+					break;
+				}
+			}
+		}
+		return next;
+	}
+
+	Timer& levelSlot(int level, fmx::uint64 position)
+	{
+		return m_slots[FIRST_SLOTS + (level - 1) * LEVEL_SLOTS + (position & (LEVEL_SLOTS - 1))];
+	}
+
+	const Timer& levelSlot(int level, fmx::uint64 position) const
+	{
+		return m_slots[FIRST_SLOTS + (level - 1) * LEVEL_SLOTS + (position & (LEVEL_SLOTS - 1))];
+	}
+
+	// Appends the timer to the slot of its due tick, in the lowest level that reaches that far
+	void link(Timer& timer)
+	{
+		Timer* slot;
+		if (timer.due - m_now < FIRST_SLOTS) {
+			slot = &m_slots[timer.due & (FIRST_SLOTS - 1)];
+		} else {
+			fmx::uint64 due = std::min<fmx::uint64>(timer.due, m_now + (1ULL << (TIMER_WHEEL_BITS + (TIMER_LEVELS - 1) * TIMER_LEVEL_BITS)) - 1);
+			int level = 1;
+			int shift = TIMER_WHEEL_BITS;
+			while (level < TIMER_LEVELS - 1 && (due - m_now) >> (shift + TIMER_LEVEL_BITS) != 0) {
+				level++;
+				shift += TIMER_LEVEL_BITS;
+			}
+			slot = &levelSlot(level, due >> shift);
+		}
+		timer.next = slot;
+		timer.prev = slot->prev;
+		slot->prev->next = &timer;
+		slot->prev = &timer;
+	}
+
+	static void unlink(Timer& timer)
+	{
+		timer.prev->next = timer.next;
+		timer.next->prev = timer.prev;
+		timer.prev = timer.next = nullptr;
+	}
+
+	// Moves the timers of the slot from to the empty list head to
+	static void splice(Timer& from, Timer& to)
+	{
+		to.next = from.next;
+		to.prev = from.prev;
+		to.next->prev = &to;
+		to.prev->next = &to;
+		from.prev = from.next = &from;
+	}
+
+	// Moves the timers of the slot of level that has come up to the levels below, after those of
+	// the next level if this one wrapped around as well
+	void cascade(int level)
+	{
+		fmx::uint64 position = m_now >> (TIMER_WHEEL_BITS + (level - 1) * TIMER_LEVEL_BITS);
+		if ((position & (LEVEL_SLOTS - 1)) == 0 && level + 1 < TIMER_LEVELS)
+			cascade(level + 1);
+		Timer& slot = levelSlot(level, position);
+		if (slot.next == &slot)
+			return;
+		Timer pending;
+		splice(slot, pending);
+		while (pending.next != &pending) {
+			Timer& timer = *pending.next;
+			unlink(timer);
+			link(timer);
+		}
+	}
+
+	const std::chrono::steady_clock::time_point m_start;
+	std::vector<Timer> m_slots;  // list heads: the first level, then LEVEL_SLOTS per further level
+	fmx::uint64 m_now = 0;       // the last tick advanced to
+	size_t m_count = 0;
+};
+
+// Scheduling ==============================================================================
+//
+// Lookups come in three classes, served in order of priority: interactive (fDNS_Resolve,
+// fDNS_Reverse and fDNS_Resolve_Extended, which a user waits for), background (prefetches started
+// from the idle callback, and refreshes of stale answers) and bulk (fDNS_Resolve_Bulk). Interactive
+// calls are never held back; the scheduler measures their latency instead. Without a target (the
+// default) nothing else is held back either. With a target set (fDNS_Configure "interactiveP99Ms"),
+// it keeps a budget of bulk queries in flight: every SCHEDULER_INTERVAL in which the p99 of the
+// interactive calls started since the last cut is above the target, the budget is halved, down to
+// BULK_MIN_BUDGET, and background work waits; while it is below SCHEDULER_HEADROOM percent of the
+// target, the budget grows by BULK_BUDGET_INCREASE, once calls started since the cut were measured.
+// Without interactive calls in the last SCHEDULER_WINDOW there is nothing to protect and bulk work
+// is not limited. The budget is split fairly between the FileMaker sessions (or files, where there
+// is only one session) running bulk jobs: by max-min fairness on what each job could use, so a
+// session gets an equal share, and what one does not use goes to the others.
+
+#define SCHEDULER_INTERVAL 100        // ms between budget adjustments
+#define SCHEDULER_WINDOW 5000         // ms of interactive calls the p99 is taken over
+#define INTERACTIVE_SAMPLES 1024      // latencies kept at most
+#define BULK_MIN_BUDGET 16            // bulk queries in flight at least, so jobs still finish
+#define BULK_BUDGET_INCREASE 64       // per SCHEDULER_INTERVAL below the target's headroom
+#define SCHEDULER_HEADROOM 80         // percent of the target the p99 must be under for the budget to grow
+
+// A running fDNS_Resolve_Bulk call, as the scheduler sees it
+struct BulkJob {
+	fmx::ptrtype owner = 0;                  // the session, or file, that called it
+	std::atomic<size_t> window{0};           // its servers' congestion windows together
+	std::atomic<size_t> demand{0};           // queries it could have in flight
+	std::atomic<size_t> share{0};            // queries it may have in flight, 0 = no limit
+	std::atomic<size_t> queued{0};           // names and retransmissions not sent yet
+	std::atomic<size_t> inFlight{0};
+};
+
+struct SchedulerStats {
+	size_t interactive = 0;       // interactive calls in progress
+	size_t bulkJobs = 0;
+	size_t bulkWindow = 0;        // of all running jobs
+	size_t bulkQueued = 0;
+	size_t bulkInFlight = 0;
+	size_t bulkBudget = 0;        // 0 = no limit
+	double interactiveP99Ms = 0;  // over the last SCHEDULER_WINDOW
+};
+
+class Scheduler {
+public:
+	void interactiveStarted()
+	{
+		m_interactive++;
+	}
+
+	void interactiveFinished(std::chrono::steady_clock::time_point started)
+	{
+		auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Sample& sample = m_samples[m_nextSample++ % INTERACTIVE_SAMPLES];
+		sample.started = started;
+		sample.ms = std::chrono::duration<double, std::milli>(now - started).count();
+		m_interactive--;
+	}
+
+	std::shared_ptr<BulkJob> startBulk(fmx::ptrtype owner)
+	{
+		auto job = std::make_shared<BulkJob>();
+		job->owner = owner;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(job);
+		divide();
+		return job;
+	}
+
+	void finishBulk(const std::shared_ptr<BulkJob>& job)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.erase(std::remove(m_jobs.begin(), m_jobs.end(), job), m_jobs.end());
+		divide();
+	}
+
+	// The queries the job may have in flight now
+	size_t bulkShare(BulkJob& job)
+	{
+		adjust();
+		return job.share;
+	}
+
+	// Whether the interactive p99 is above its target, so background work should wait
+	bool interactiveFirst()
+	{
+		adjust();
+		return m_overTarget;
+	}
+
+	// Queue depths and the budget, for fDNS_Get_Stats
+	SchedulerStats stats()
+	{
+		adjust();
+		SchedulerStats stats;
+		stats.interactive = m_interactive;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		stats.bulkJobs = m_jobs.size();
+		for (const auto& job : m_jobs) {
+			stats.bulkWindow += job->window;
+			stats.bulkQueued += job->queued;
+			stats.bulkInFlight += job->inFlight;
+		}
+		stats.bulkBudget = m_budget;
+		stats.interactiveP99Ms = m_p99Ms;
+		return stats;
+	}
+
+private:
+	struct Sample {
+		std::chrono::steady_clock::time_point started;
+		double ms = -1;  // -1: not used yet
+	};
+
+	// Recomputes the p99 and adjusts the budget once every SCHEDULER_INTERVAL
+	void adjust()
+	{
+		auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (now < m_nextAdjust)
+			return;
+		m_nextAdjust = now + std::chrono::milliseconds(SCHEDULER_INTERVAL);
+		int target = channelOptions()->interactiveP99Ms;
+
+		// Calls started before the last cut ran against the larger budget and do not count
+		std::vector<double> recent, sinceCut;
+		for (const Sample& sample : m_samples) {
+			if (sample.ms < 0 || now - sample.started > std::chrono::milliseconds(SCHEDULER_WINDOW))
+				continue;
+			recent.push_back(sample.ms);
+			if (sample.started >= m_cut)
+				sinceCut.push_back(sample.ms);
+		}
+		m_p99Ms = p99(recent);
+		if (target == 0 || recent.empty()) {
+			m_budget = 0;
+			m_overTarget = false;
+		} else {
+			size_t inFlight = 0, demand = 0;
+			for (const auto& job : m_jobs) {
+				inFlight += job->inFlight;
+				demand += job->demand;
+			}
+			double latency = p99(sinceCut);
+			m_overTarget = latency > target;
+			if (m_overTarget) {
+				m_budget = std::max<size_t>(BULK_MIN_BUDGET, (m_budget ? std::min(m_budget, inFlight) : inFlight) / 2);
+				m_cut = now;
+			} else if (m_budget != 0 && !sinceCut.empty() && latency * 100 < target * SCHEDULER_HEADROOM) {
+				// Only grows on calls that ran against the current budget, not on their absence
+				// Not beyond what the jobs could use, which would only allow a burst later
+				m_budget = std::min(m_budget, std::max<size_t>(demand, BULK_MIN_BUDGET)) + BULK_BUDGET_INCREASE;
+			}
+		}
+		divide();
+	}
+
+	// The nearest-rank 99th percentile
+	static double p99(std::vector<double>& values)
+	{
+		if (values.empty())
+			return 0;
+		size_t rank = (values.size() * 99 + 99) / 100 - 1;
+		std::nth_element(values.begin(), values.begin() + rank, values.end());
+		return values[rank];
+	}
+
+	// Splits m_budget between the owners of the jobs by max-min fairness, then evenly between the
+	// jobs of an owner; called with m_mutex held
+	void divide()
+	{
+		if (m_budget == 0) {
+			for (const auto& job : m_jobs)
+				job->share = 0;
+			return;
+		}
+		std::map<fmx::ptrtype, std::pair<size_t, size_t>> owners; // demand, jobs
+		for (const auto& job : m_jobs) {
+			auto& owner = owners[job->owner];
+			owner.first += job->demand;
+			owner.second++;
+		}
+		std::vector<std::pair<size_t, fmx::ptrtype>> byDemand;
+		for (const auto& owner : owners)
+			byDemand.emplace_back(owner.second.first, owner.first);
+		std::sort(byDemand.begin(), byDemand.end());
+		std::map<fmx::ptrtype, size_t> shares;
+		size_t left = m_budget;
+		for (size_t i = 0; i < byDemand.size(); ++i) {
+			size_t share = std::min(byDemand[i].first, left / (byDemand.size() - i));
+			shares[byDemand[i].second] = share;
+			left -= share;
+		}
+		// What nobody could use goes to every owner evenly, so a job whose demand grows can
+		// take more before the next adjustment
+		size_t spare = owners.empty() ? 0 : left / owners.size();
+		for (const auto& job : m_jobs) {
+			const auto& owner = owners[job->owner];
+			job->share = std::max<size_t>(1, (shares[job->owner] + spare) / owner.second);
+		}
+	}
+
+	std::mutex m_mutex;                            // guards all but m_interactive
+	std::atomic<size_t> m_interactive{0};          // interactive calls in progress
+	std::vector<Sample> m_samples = std::vector<Sample>(INTERACTIVE_SAMPLES); // ring buffer
+	size_t m_nextSample = 0;
+	std::vector<std::shared_ptr<BulkJob>> m_jobs;
+	size_t m_budget = 0;                           // bulk queries in flight, 0 = no limit
+	bool m_overTarget = false;
+	double m_p99Ms = 0;
+	std::chrono::steady_clock::time_point m_cut;   // when the budget was last halved
+	std::chrono::steady_clock::time_point m_nextAdjust;
+};
+
+static Scheduler g_scheduler;
+
+// Counts an interactive call while it runs and records its latency when it returns
+class InteractiveCall {
+public:
+	InteractiveCall() : m_started(std::chrono::steady_clock::now())
+	{
+		g_scheduler.interactiveStarted();
+	}
+
+	~InteractiveCall()
+	{
+		g_scheduler.interactiveFinished(m_started);
+	}
+
+	InteractiveCall(const InteractiveCall&) = delete;
+	InteractiveCall& operator=(const InteractiveCall&) = delete;
+
+private:
+	const std::chrono::steady_clock::time_point m_started;
+};
+
+// Answer cache ============================================================================
+//
+// Answers from custom DNS servers are cached for their TTL under a key made of the lookup kind
+// and the name. Entries hold the raw DNS responses; the first read decodes them and renders them
+// into the caller's output (JSON array, address list, host name), which is kept with the entry so
+// that later hits only copy a string. With a stale window set (RFC 8767), expired entries are kept that
+// much longer: when refreshing one fails, or takes longer than the client response timer,
+// the stale answer is returned and the refresh goes on in the background (Do_PluginIdle).
+// Entries that were hit since they were fetched are refreshed ahead of their expiry from
+// Do_PluginIdle, so names in constant use never fall out of the cache.
+//
+// The cache has a byte budget and uses W-TinyLFU: new entries go to a small LRU window; an entry
+// leaving the window only enters the main cache (a segmented LRU of probation and protected
+// entries) if it has been used more often than the entry it would evict, as estimated by a
+// count-min sketch over all lookups. A scan over many one-off names therefore cannot flush the
+// names that are used all the time.
+
+#define DEFAULT_CACHE_BUDGET (16 * 1024 * 1024) // bytes
+#define CACHE_SHARDS 16             // independently locked parts of the cache
+#define CACHE_WINDOW_PERCENT 1      // of the budget, admission window
+#define CACHE_PROTECTED_PERCENT 80  // of the main cache, entries used again after admission
+#define CACHE_ENTRY_OVERHEAD 160    // bytes per entry for the map node, lists and bookkeeping
+#define CACHE_RESPONSE_OVERHEAD 32  // bytes per stored response
+#define SKETCH_AVERAGE_ENTRY 256    // bytes, sizes the frequency sketch for the budget
+#define SKETCH_SAMPLE_FACTOR 10     // counters are halved after this many lookups per sketch column
+#define STALE_REFRESH_INTERVAL 30   // s, a failed refresh is not retried sooner; stale answers are served meanwhile
+#define DEFAULT_CLIENT_TIMEOUT 1800 // ms, RFC 8767 client response timer
+#define PREFETCH_PERCENT 10         // refresh hot entries when this much of their TTL is left
+#define PREFETCH_MIN_LEAD 1000      // ms, but at least this long before they expire
+#define PREFETCH_RECHECK_INTERVAL 250 // ms, until an entry that is due but not used yet is looked at again
+#define MAX_PREFETCHES 16           // prefetch lookups in flight
+
+// Pinned entries sit outside the budget and are never evicted
+enum CacheSegment { kSegmentWindow, kSegmentProbation, kSegmentProtected, kSegmentPinned };
+
+// A value that readers holding only a shard's read lock may update; copies with its entry
+template <typename T>
+struct RelaxedAtomic {
+	std::atomic<T> value;
+
+	RelaxedAtomic(T initial = T()) : value(initial) {}
+	RelaxedAtomic(const RelaxedAtomic& other) : value(other.load()) {}
+	RelaxedAtomic& operator=(const RelaxedAtomic& other) { store(other.load()); return *this; }
+
+	T load() const { return value.load(std::memory_order_relaxed); }
+	void store(T newValue) { value.store(newValue, std::memory_order_relaxed); }
+	void increment() { value.fetch_add(1, std::memory_order_relaxed); }
+};
+
+struct CacheEntry {
+	std::vector<std::string> responses;                   // raw DNS responses with the answer records
+	std::string rendered;                                 // the records as rendered by the lookup, "" until first read
+	std::chrono::system_clock::time_point expires;
+	std::chrono::steady_clock::time_point retryRefreshAt; // set when a refresh failed
+	bool refreshing = false;                              // a refresh is in flight
+	fmx::uint32 ttl = 0;                                  // s, as fetched
+	RelaxedAtomic<fmx::uint32> hits;                      // since the entry was fetched
+	std::function<void(Attempt&)> starter;                // re-issues the lookup for prefetching
+	CacheSegment segment = kSegmentWindow;
+	std::list<const std::string*>::iterator position;     // in the segment's LRU list (front = most recent)
+	RelaxedAtomic<bool> referenced;                       // hit under a read lock since its last move
+	size_t bytes = 0;
+};
+
+struct CachedAnswer {
+	std::string rendered;  // the records as rendered by the lookup's renderer
+	bool answered = false; // false: no answer, rendered may hold a partial result
+	bool stale = false;    // served from an expired entry
+};
+
+// Turns the records of an answer into what the plugin function returns; a lookup kind always
+// uses the same renderer, so its output can be kept in the cache entry
+typedef std::function<std::string(const DNSRecords&)> Renderer;
+
+// FNV-1a over the ASCII-lowercased key: DNS names compare case-insensitively
+static fmx::uint64 hashKey(const std::string& key)
+{
+	fmx::uint64 hash = 14695981039346656037ULL;
+	for (unsigned char c : key) {
+		hash ^= static_cast<unsigned char>(tolower(c));
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+struct DnsNameHash {
+	size_t operator()(const std::string& key) const { return static_cast<size_t>(hashKey(key)); }
+};
+
+struct DnsNameEqual {
+	bool operator()(const std::string& a, const std::string& b) const
+	{
+		return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+			return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y));
+		});
+	}
+};
+
+typedef std::unordered_map<std::string, CacheEntry, DnsNameHash, DnsNameEqual> CacheMap;
+
+// Count-min sketch with four rows of saturating 4-bit counters (kept in bytes for simplicity).
+// All counters are halved periodically so that the estimates follow recent popularity.
+// Counters are updated by readers holding only a read lock, so they are relaxed atomics;
+// a lost increment only makes an estimate slightly lower.
+class FrequencySketch {
+public:
+	FrequencySketch() { resize(1024); }
+
+	// Not thread-safe; the shard's write lock must be held
+	void resize(size_t columns)
+	{
+		m_columns = 1;
+		while (m_columns < columns)
+			m_columns <<= 1;
+		m_counters.reset(new std::atomic<unsigned char>[m_columns * 4]);
+		for (size_t i = 0; i < m_columns * 4; ++i)
+			m_counters[i].store(0, std::memory_order_relaxed);
+		m_additions.store(0, std::memory_order_relaxed);
+	}
+
+	void increment(fmx::uint64 hash)
+	{
+		bool added = false;
+		for (int row = 0; row < 4; ++row) {
+			std::atomic<unsigned char>& counter = m_counters[index(hash, row)];
+			unsigned char value = counter.load(std::memory_order_relaxed);
+			if (value < 15) {
+				counter.store(static_cast<unsigned char>(value + 1), std::memory_order_relaxed);
+				added = true;
+			}
+		}
+		if (!added)
+			return;
+		size_t additions = m_additions.fetch_add(1, std::memory_order_relaxed) + 1;
+		if (additions >= m_columns * SKETCH_SAMPLE_FACTOR && m_additions.compare_exchange_strong(additions, additions / 2)) {
+			for (size_t i = 0; i < m_columns * 4; ++i)
+				m_counters[i].store(static_cast<unsigned char>(m_counters[i].load(std::memory_order_relaxed) >> 1), std::memory_order_relaxed);
+		}
+	}
+
+	int estimate(fmx::uint64 hash) const
+	{
+		int frequency = 15;
+		for (int row = 0; row < 4; ++row)
+			frequency = std::min<int>(frequency, m_counters[index(hash, row)].load(std::memory_order_relaxed));
+		return frequency;
+	}
+
+private:
+	size_t index(fmx::uint64 hash, int row) const
+	{
+		// Double hashing: the upper half of the hash steps through the rows
+		fmx::uint64 step = (hash >> 32) | 1;
+		return static_cast<size_t>(row) * m_columns + static_cast<size_t>((hash + row * step) & (m_columns - 1));
+	}
+
+	size_t m_columns = 0;
+	std::unique_ptr<std::atomic<unsigned char>[]> m_counters;
+	std::atomic<size_t> m_additions{0};
+};
+
+struct CacheUsage {
+	size_t budget = DEFAULT_CACHE_BUDGET / CACHE_SHARDS;
+	size_t windowBytes = 0, probationBytes = 0, protectedBytes = 0, pinnedBytes = 0;
+	size_t entries = 0;
+	fmx::uint64 evictions = 0;  // admitted entries dropped to make room
+	fmx::uint64 rejections = 0; // entries that left the window without being admitted
+};
+
+// One independently locked part of the cache with its own W-TinyLFU state.
+// Cache hits only take the read lock: they bump the sketch and set the entry's referenced flag,
+// and the LRU order catches up when the entry reaches the end of its list (second chance).
+struct CacheShard {
+	std::shared_timed_mutex lock;
+	CacheMap entries;
+	std::list<const std::string*> window, probation, protectedEntries, pinnedEntries;
+	CacheUsage usage;
+	FrequencySketch sketch;
+};
+
+// The lowercased labels of the name in a cache key, or of a name, in reverse order:
+// "A|www.Example.com" -> "com.example.www". A name and all of its subdomains then form one
+// range of an ordered index ("com.example" and everything from "com.example.").
+static std::string reversedName(const std::string& key)
+{
+	size_t start = key.find('|');
+	start = start == std::string::npos ? 0 : start + 1;
+	size_t end = key.size();
+	if (end > start && key[end - 1] == '.')
+		end--;
+	std::string reversed;
+	reversed.reserve(end - start);
+	while (end > start) {
+		size_t dot = key.rfind('.', end - 1);
+		size_t label = dot == std::string::npos || dot < start ? start : dot + 1;
+		if (!reversed.empty())
+			reversed += '.';
+		for (size_t i = label; i < end; ++i)
+			reversed += static_cast<char>(tolower(static_cast<unsigned char>(key[i])));
+		end = label > start ? label - 1 : start;
+	}
+	return reversed;
+}
+
+// Defined with the refresh timers below; called with the shard's write lock held
+static void cancelRefresh(const std::string& key);
+
+class AnswerCache {
+public:
+	explicit AnswerCache(size_t shardCount = CACHE_SHARDS)
+		: m_shardCount(shardCount), m_shards(new CacheShard[shardCount])
+	{
+		setBudget(DEFAULT_CACHE_BUDGET);
+	}
+
+	AnswerCache(const AnswerCache&) = delete;
+	AnswerCache& operator=(const AnswerCache&) = delete;
+
+	size_t shardCount() const { return m_shardCount; }
+	CacheShard& shard(size_t index) { return m_shards[index]; }
+	// The top bits pick the shard; the map inside uses the low bits
+	CacheShard& shardFor(fmx::uint64 hash) { return m_shards[static_cast<size_t>((hash >> 48) % m_shardCount)]; }
+
+	// The fast path of a lookup, under the shard's read lock: copies the rendered records of a
+	// fresh entry that has been read before
+	bool findFresh(const std::string& key, fmx::uint64 hash, std::string& rendered)
+	{
+		CacheShard& s = shardFor(hash);
+		std::shared_lock<std::shared_timed_mutex> lock(s.lock);
+		s.sketch.increment(hash);
+		auto it = s.entries.find(key);
+		if (it == s.entries.end() || it->second.rendered.empty() || std::chrono::system_clock::now() >= it->second.expires)
+			return false;
+		it->second.hits.increment();
+		it->second.referenced.store(true);
+		rendered = it->second.rendered;
+		return true;
+	}
+
+	// The functions below need the shard's write lock
+
+	// Adds an entry to the admission window, or to the pinned entries when its name is pinned;
+	// returns s.entries.end() when it does not fit at all.
+	// A shard's window may be smaller than one entry, which then goes straight to admission.
+	CacheMap::iterator insert(CacheShard& s, const std::string& key, CacheEntry&& entry)
+	{
+		std::string name = reversedName(key);
+		bool pinned;
+		{
+			std::lock_guard<std::mutex> lock(m_namesLock);
+			pinned = m_pinned.count(name) != 0;
+		}
+		entry.bytes = entryBytes(key, entry);
+		if (!pinned && entry.bytes > mainBudget(s))
+			return s.entries.end();
+		auto it = s.entries.emplace(key, std::move(entry)).first;
+		{
+			std::lock_guard<std::mutex> lock(m_namesLock);
+			m_names[name].push_back(key);
+		}
+		CacheSegment segment = pinned ? kSegmentPinned : kSegmentWindow;
+		segmentList(s, segment).push_front(&it->first);
+		it->second.segment = segment;
+		it->second.position = segmentList(s, segment).begin();
+		segmentBytes(s, segment) += it->second.bytes;
+		s.usage.entries++;
+		if (pinned)
+			return it;
+		enforceBudget(s);
+		return s.entries.find(key);
+	}
+
+	// Records a cache hit
+	void touch(CacheShard& s, CacheMap::iterator it)
+	{
+		it->second.referenced.store(false);
+		if (it->second.segment == kSegmentWindow || it->second.segment == kSegmentPinned) {
+			moveToSegment(s, it, it->second.segment);
+		} else {
+			moveToSegment(s, it, kSegmentProtected);
+			enforceBudget(s);
+		}
+	}
+
+	// Re-accounts an entry whose responses or rendering changed; may evict it
+	void resized(CacheShard& s, CacheMap::iterator it)
+	{
+		size_t bytes = entryBytes(it->first, it->second);
+		segmentBytes(s, it->second.segment) += bytes;
+		segmentBytes(s, it->second.segment) -= it->second.bytes;
+		it->second.bytes = bytes;
+		enforceBudget(s);
+	}
+
+	// The functions below take the locks themselves
+
+	void clear()
+	{
+		for (size_t i = 0; i < m_shardCount; ++i) {
+			CacheShard& s = m_shards[i];
+			std::lock_guard<std::shared_timed_mutex> lock(s.lock);
+			s.entries.clear();
+			s.window.clear();
+			s.probation.clear();
+			s.protectedEntries.clear();
+			s.pinnedEntries.clear();
+			s.usage.windowBytes = s.usage.probationBytes = s.usage.protectedBytes = s.usage.pinnedBytes = s.usage.entries = 0;
+		}
+		std::lock_guard<std::mutex> lock(m_namesLock);
+		m_names.clear();
+		m_flushes.clear();
+	}
+
+	// Sets the byte budget, split evenly over the shards, and shrinks them right away
+	void setBudget(size_t budget)
+	{
+		for (size_t i = 0; i < m_shardCount; ++i) {
+			CacheShard& s = m_shards[i];
+			std::lock_guard<std::shared_timed_mutex> lock(s.lock);
+			s.usage.budget = budget / m_shardCount;
+			s.sketch.resize(std::max<size_t>(s.usage.budget / SKETCH_AVERAGE_ENTRY, 1024));
+			// Shrink from the least recently used end of each segment
+			while (s.usage.windowBytes > windowBudget(s) && !s.window.empty()) {
+				s.usage.evictions++;
+				erase(s, s.entries.find(*s.window.back()));
+			}
+			shrinkMain(s);
+			enforceBudget(s);
+		}
+	}
+
+	// Removes the entries of a name (reversed, see reversedName), and those of its subdomains
+	// if asked, through the name index. Returns the number of entries removed. The flush is
+	// remembered for retention, the longest time an answer can still be served after it was fetched.
+	size_t flush(const std::string& name, bool subdomains, std::chrono::seconds retention)
+	{
+		std::vector<std::string> keys;
+		{
+			std::lock_guard<std::mutex> lock(m_namesLock);
+			auto now = std::chrono::system_clock::now();
+			FlushTimes& times = m_flushes[name];
+			times.name = now;
+			if (subdomains)
+				times.subdomains = now;
+			// Entries fetched before a flush may still come back from the snapshot or the shared cache
+			for (auto it = m_flushes.begin(); it != m_flushes.end();) {
+				if (std::max(it->second.name, it->second.subdomains) < now - retention)
+					it = m_flushes.erase(it);
+				else
+					++it;
+			}
+
+			auto exact = m_names.find(name);
+			if (exact != m_names.end())
+				keys = exact->second;
+			if (subdomains) {
+				std::string prefix = name + ".";
+				for (auto it = m_names.lower_bound(prefix); it != m_names.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+					keys.insert(keys.end(), it->second.begin(), it->second.end());
+			}
+		}
+
+		size_t flushed = 0;
+		for (const auto& key : keys) {
+			CacheShard& s = shardFor(hashKey(key));
+			std::lock_guard<std::shared_timed_mutex> lock(s.lock);
+			auto it = s.entries.find(key);
+			if (it != s.entries.end()) {
+				erase(s, it);
+				flushed++;
+			}
+		}
+		return flushed;
+	}
+
+	// True when the name of key was flushed after an answer fetched at fetched
+	bool flushedSince(const std::string& key, std::chrono::system_clock::time_point fetched)
+	{
+		std::string name = reversedName(key);
+		std::lock_guard<std::mutex> lock(m_namesLock);
+		if (m_flushes.empty())
+			return false;
+		auto exact = m_flushes.find(name);
+		if (exact != m_flushes.end() && std::max(exact->second.name, exact->second.subdomains) >= fetched)
+			return true;
+		for (size_t dot = name.find('.'); dot != std::string::npos; dot = name.find('.', dot + 1)) {
+			auto parent = m_flushes.find(name.substr(0, dot));
+			if (parent != m_flushes.end() && parent->second.subdomains >= fetched)
+				return true;
+		}
+		return false;
+	}
+
+	// Pins or unpins a name (reversed): its current and future entries are kept regardless of the budget
+	void pin(const std::string& name, bool pinned)
+	{
+		std::vector<std::string> keys;
+		{
+			std::lock_guard<std::mutex> lock(m_namesLock);
+			if (pinned)
+				m_pinned.insert(name);
+			else
+				m_pinned.erase(name);
+			auto it = m_names.find(name);
+			if (it != m_names.end())
+				keys = it->second;
+		}
+		for (const auto& key : keys) {
+			CacheShard& s = shardFor(hashKey(key));
+			std::lock_guard<std::shared_timed_mutex> lock(s.lock);
+			auto it = s.entries.find(key);
+			if (it == s.entries.end() || (it->second.segment == kSegmentPinned) == pinned)
+				continue;
+			// An unpinned entry competes for the main cache again, and may not fit in it
+			moveToSegment(s, it, pinned ? kSegmentPinned : kSegmentProbation);
+			shrinkMain(s);
+			enforceBudget(s);
+		}
+	}
+
+	bool pinned(const std::string& name)
+	{
+		std::lock_guard<std::mutex> lock(m_namesLock);
+		return m_pinned.count(name) != 0;
+	}
+
+	// Totals over all shards
+	CacheUsage usage()
+	{
+		CacheUsage total;
+		total.budget = 0;
+		for (size_t i = 0; i < m_shardCount; ++i) {
+			CacheShard& s = m_shards[i];
+			std::shared_lock<std::shared_timed_mutex> lock(s.lock);
+			total.budget += s.usage.budget;
+			total.windowBytes += s.usage.windowBytes;
+			total.probationBytes += s.usage.probationBytes;
+			total.protectedBytes += s.usage.protectedBytes;
+			total.pinnedBytes += s.usage.pinnedBytes;
+			total.entries += s.usage.entries;
+			total.evictions += s.usage.evictions;
+			total.rejections += s.usage.rejections;
+		}
+		return total;
+	}
+
+private:
+	struct FlushTimes {
+		std::chrono::system_clock::time_point name;       // the name itself was flushed
+		std::chrono::system_clock::time_point subdomains; // the name and its subdomains were flushed
+	};
+
+	static size_t entryBytes(const std::string& key, const CacheEntry& entry)
+	{
+		size_t bytes = CACHE_ENTRY_OVERHEAD + key.size() + entry.rendered.size();
+		for (const auto& response : entry.responses)
+			bytes += CACHE_RESPONSE_OVERHEAD + response.size();
+		return bytes;
+	}
+
+	static std::list<const std::string*>& segmentList(CacheShard& s, CacheSegment segment)
+	{
+		switch (segment) {
+		case kSegmentWindow: return s.window;
+		case kSegmentProbation: return s.probation;
+		case kSegmentProtected: return s.protectedEntries;
+		default: return s.pinnedEntries;
+		}
+	}
+
+	static size_t& segmentBytes(CacheShard& s, CacheSegment segment)
+	{
+		switch (segment) {
+		case kSegmentWindow: return s.usage.windowBytes;
+		case kSegmentProbation: return s.usage.probationBytes;
+		case kSegmentProtected: return s.usage.protectedBytes;
+		default: return s.usage.pinnedBytes;
+		}
+	}
+
+	static size_t windowBudget(const CacheShard& s) { return s.usage.budget * CACHE_WINDOW_PERCENT / 100; }
+	static size_t mainBudget(const CacheShard& s) { return s.usage.budget - windowBudget(s); }
+
+	// Moves an entry to the most recent end of segment
+	static void moveToSegment(CacheShard& s, CacheMap::iterator it, CacheSegment segment)
+	{
+		CacheEntry& entry = it->second;
+		segmentList(s, entry.segment).erase(entry.position);
+		segmentBytes(s, entry.segment) -= entry.bytes;
+		entry.segment = segment;
+		segmentList(s, segment).push_front(&it->first);
+		entry.position = segmentList(s, segment).begin();
+		segmentBytes(s, segment) += entry.bytes;
+	}
+
+	void erase(CacheShard& s, CacheMap::iterator it)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_namesLock);
+			auto name = m_names.find(reversedName(it->first));
+			if (name != m_names.end()) {
+				auto& keys = name->second;
+				keys.erase(std::remove(keys.begin(), keys.end(), it->first), keys.end());
+				if (keys.empty())
+					m_names.erase(name);
+			}
+		}
+		segmentList(s, it->second.segment).erase(it->second.position);
+		segmentBytes(s, it->second.segment) -= it->second.bytes;
+		s.usage.entries--;
+		cancelRefresh(it->first);
+		s.entries.erase(it);
+	}
+
+	// Keeps every segment within its share of the byte budget
+	void enforceBudget(CacheShard& s)
+	{
+		// Entries leaving the window compete with the main cache's eviction candidate
+		while (s.usage.windowBytes > windowBudget(s) && !s.window.empty()) {
+			auto candidate = s.entries.find(*s.window.back());
+			if (candidate->second.referenced.load()) {
+				touch(s, candidate, kSegmentWindow); // hit while in the window
+				continue;
+			}
+			int candidateFrequency = s.sketch.estimate(hashKey(candidate->first));
+			moveToSegment(s, candidate, kSegmentProbation);
+			while (s.usage.probationBytes + s.usage.protectedBytes > mainBudget(s)) {
+				auto& victims = s.probation.size() > 1 ? s.probation : s.protectedEntries;
+				auto victim = victims.empty() ? candidate : s.entries.find(*victims.back());
+				if (victim != candidate && victim->second.referenced.load()) {
+					touch(s, victim, kSegmentProtected); // hit since it was last moved
+					continue;
+				}
+				if (victim != candidate && candidateFrequency > s.sketch.estimate(hashKey(victim->first))) {
+					s.usage.evictions++;
+					erase(s, victim);
+				} else {
+					s.usage.rejections++;
+					erase(s, candidate);
+					break;
+				}
+			}
+		}
+
+		// Protected entries that no longer fit go back to probation
+		size_t protectedBudget = mainBudget(s) * CACHE_PROTECTED_PERCENT / 100;
+		while (s.usage.protectedBytes > protectedBudget && !s.protectedEntries.empty())
+			moveToSegment(s, s.entries.find(*s.protectedEntries.back()), kSegmentProbation);
+	}
+
+	// Evicts from the least recently used end of the main cache until it fits its budget
+	void shrinkMain(CacheShard& s)
+	{
+		while (s.usage.probationBytes + s.usage.protectedBytes > mainBudget(s)) {
+			auto& victims = s.probation.empty() ? s.protectedEntries : s.probation;
+			s.usage.evictions++;
+			erase(s, s.entries.find(*victims.back()));
+		}
+	}
+
+	// Applies a hit recorded under a read lock
+	static void touch(CacheShard& s, CacheMap::iterator it, CacheSegment segment)
+	{
+		it->second.referenced.store(false);
+		moveToSegment(s, it, segment);
+	}
+
+	size_t m_shardCount;
+	std::unique_ptr<CacheShard[]> m_shards;
+	std::mutex m_namesLock;                                  // guards the members below; taken after a shard lock
+	std::map<std::string, std::vector<std::string>> m_names; // reversed name -> cache keys
+	std::unordered_set<std::string> m_pinned;                // reversed names
+	std::unordered_map<std::string, FlushTimes> m_flushes;   // reversed name -> last flushes
+};
+
+static std::mutex g_cacheMutex;                       // guards the cache settings, the snapshot and the shared cache
+static AnswerCache g_answerCache;
+static int g_staleWindowSec = 0;                      // 0 = expired entries are never served
+static int g_clientTimeoutMs = DEFAULT_CLIENT_TIMEOUT;
+static std::atomic<fmx::uint64> g_cacheGeneration{0}; // bumped whenever an answer is stored
+static std::string g_cacheServer;                     // DNS server list the cached answers come from
+
+struct BackgroundLookup {
+	std::unique_ptr<Lookup> lookup;
+	std::string key;
+	bool prefetch;
+};
+
+static std::mutex g_backgroundMutex;                  // guards g_backgroundLookups
+static std::vector<BackgroundLookup> g_backgroundLookups;
+
+// When the entry of a key is next looked at for prefetching
+struct RefreshTimer : TimerWheel::Timer {
+	const std::string* key = nullptr; // of its item in g_refreshTimers
+};
+
+static std::mutex g_refreshMutex;                     // guards g_refreshWheel and g_refreshTimers; taken after the cache locks
+static TimerWheel g_refreshWheel;
+static std::unordered_map<std::string, RefreshTimer, DnsNameHash, DnsNameEqual> g_refreshTimers;
+
+// Keys compare case-insensitively, so the name is not lowercased. Answers of a routed server are
+// kept apart from those of the default servers (which the cache, snapshot and shared cache are
+// tagged with as a whole) by naming the route's servers: "A@10.0.0.53|host.corp". The trailing dot
+// of an absolute name is kept, as "host" may be answered through the search list and "host." not.
+static std::string cacheKey(const std::string& kind, const std::string& name, const std::string& routeServer = std::string())
+{
+	return routeServer.empty() ? kind + "|" + name : kind + "@" + routeServer + "|" + name;
+}
+
+static void cacheClear()
+{
+	g_answerCache.clear();
+	std::lock_guard<std::mutex> lock(g_refreshMutex);
+	g_refreshWheel.clear();
+	g_refreshTimers.clear();
+}
+
+// Has the entry of key looked at by startPrefetches at when (again)
+static void scheduleRefresh(const std::string& key, std::chrono::steady_clock::time_point when)
+{
+	std::lock_guard<std::mutex> lock(g_refreshMutex);
+	auto item = g_refreshTimers.emplace(key, RefreshTimer()).first;
+	item->second.key = &item->first;
+	g_refreshWheel.schedule(item->second, when);
+}
+
+// Drops the refresh timer of an entry that left the cache
+static void cancelRefresh(const std::string& key)
+{
+	std::lock_guard<std::mutex> lock(g_refreshMutex);
+	auto item = g_refreshTimers.find(key);
+	if (item == g_refreshTimers.end())
+		return;
+	g_refreshWheel.cancel(item->second);
+	g_refreshTimers.erase(item);
+}
+
+// When an entry is due for prefetching: 10% of its TTL (PREFETCH_PERCENT), but at least
+// PREFETCH_MIN_LEAD, before it expires
+static std::chrono::steady_clock::time_point prefetchTime(const CacheEntry& entry)
+{
+	// ttl is in seconds: ttl * 1000 * PREFETCH_PERCENT / 100 ms
+	auto leadMs = std::max<fmx::int64>(static_cast<fmx::int64>(entry.ttl) * 10 * PREFETCH_PERCENT, PREFETCH_MIN_LEAD);
+	auto left = std::chrono::duration_cast<std::chrono::milliseconds>(entry.expires - std::chrono::system_clock::now());
+	return std::chrono::steady_clock::now() + left - std::chrono::milliseconds(leadMs);
+}
+
+// When an entry's answer was fetched from the DNS server
+static std::chrono::system_clock::time_point fetchedAt(const CacheEntry& entry)
+{
+	return entry.expires - std::chrono::seconds(entry.ttl);
+}
+
+// Defined in the Cache snapshot and Shared cache sections; called with g_cacheMutex and
+// the write lock of the key's shard held
+static CacheMap::iterator promoteFromSnapshot(CacheShard& shard, const std::string& key);
+static CacheMap::iterator promoteFromSharedCache(CacheShard& shard, const std::string& key);
+static void storeInSharedCache(const std::string& key, const CacheEntry& entry);
+
+// Stores the result of a finished lookup for key, or marks the refresh of key as failed.
+// rendered is the answer as rendered for the caller, "" when nobody has read it yet.
+static void completeLookup(const std::string& key, const Lookup& lookup, const std::string& rendered = std::string())
+{
+	const Attempt* answer = lookup.winner();
+	auto now = std::chrono::system_clock::now();
+	CacheShard& shard = g_answerCache.shardFor(hashKey(key));
+	std::lock_guard<std::mutex> lock(g_cacheMutex);
+	std::lock_guard<std::shared_timed_mutex> shardLock(shard.lock);
+
+	auto it = shard.entries.find(key);
+	if (it != shard.entries.end()) {
+		it->second.refreshing = false;
+		if (!answer) {
+			it->second.retryRefreshAt = std::chrono::steady_clock::now() + std::chrono::seconds(STALE_REFRESH_INTERVAL);
+			if (it->second.starter)
+				scheduleRefresh(key, it->second.retryRefreshAt);
+			return;
+		}
+	}
+	if (!answer || answer->recordCount == 0 || answer->ttl == 0)
+		return; // negative answers are not cached
+
+	CacheEntry fetched;
+	CacheEntry& entry = it != shard.entries.end() ? it->second : fetched;
+	entry.responses = answer->responses();
+	entry.rendered = rendered;
+	entry.expires = now + std::chrono::seconds(answer->ttl);
+	entry.retryRefreshAt = std::chrono::steady_clock::time_point();
+	entry.ttl = answer->ttl;
+	entry.hits = 0;
+	entry.starter = lookup.starter();
+	storeInSharedCache(key, entry);
+	if (entry.starter)
+		scheduleRefresh(key, prefetchTime(entry));
+
+	g_cacheGeneration++;
+	if (it != shard.entries.end())
+		g_answerCache.resized(shard, it);
+	else
+		g_answerCache.insert(shard, key, std::move(fetched));
+}
+
+// Continues a lookup from Do_PluginIdle after the caller has been answered
+static void runInBackground(std::unique_ptr<Lookup> lookup, const std::string& key, bool prefetch = false)
+{
+	if (prefetch)
+		g_stats.prefetches++;
+	else
+		g_stats.backgroundRefreshes++;
+	std::lock_guard<std::mutex> lock(g_backgroundMutex);
+	g_backgroundLookups.push_back(BackgroundLookup{std::move(lookup), key, prefetch});
+}
+
+// Starts background lookups for the entries that were hit since they were fetched and
+// are about to expire. Called from Do_PluginIdle, which spreads the refreshes over idle time;
+// only the entries whose refresh timers fired are looked at.
+static void startPrefetches()
+{
+	auto now = std::chrono::steady_clock::now();
+	std::vector<std::string> fired;
+	{
+		std::lock_guard<std::mutex> lock(g_refreshMutex);
+		g_refreshWheel.advance(now, [&fired](TimerWheel::Timer& timer) {
+			fired.push_back(*static_cast<RefreshTimer&>(timer).key);
+			g_refreshTimers.erase(fired.back());
+		});
+	}
+	if (fired.empty())
+		return;
+
+	// Prefetches wait while interactive calls are slower than their target
+	bool interactiveFirst = g_scheduler.interactiveFirst();
+	size_t inFlight;
+	{
+		std::lock_guard<std::mutex> lock(g_backgroundMutex);
+		inFlight = std::count_if(g_backgroundLookups.begin(), g_backgroundLookups.end(), [](const BackgroundLookup& b) { return b.prefetch; });
+	}
+
+	// Entries that are gone, expired or being refreshed already get no new timer; a refresh
+	// schedules the next one when it completes
+	std::vector<std::pair<std::string, Lookup::Starter>> due;
+	std::vector<std::pair<std::string, std::chrono::steady_clock::time_point>> later;
+	auto wallNow = std::chrono::system_clock::now();
+	for (const std::string& key : fired) {
+		CacheShard& shard = g_answerCache.shardFor(hashKey(key));
+		std::lock_guard<std::shared_timed_mutex> lock(shard.lock);
+		auto it = shard.entries.find(key);
+		if (it == shard.entries.end())
+			continue;
+		CacheEntry& entry = it->second;
+		if (entry.refreshing || !entry.starter || wallNow >= entry.expires)
+			continue;
+		bool used = entry.hits.load() != 0 || entry.segment == kSegmentPinned;
+		auto dueAt = prefetchTime(entry);
+		if (now < dueAt)
+			later.emplace_back(key, dueAt); // fetched again since the timer was set
+		else if (now < entry.retryRefreshAt)
+			later.emplace_back(key, entry.retryRefreshAt);
+		else if (!used || inFlight + due.size() >= MAX_PREFETCHES || interactiveFirst)
+			later.emplace_back(key, now + std::chrono::milliseconds(PREFETCH_RECHECK_INTERVAL));
+		else {
+			entry.refreshing = true;
+			due.emplace_back(key, entry.starter);
+		}
+	}
+	for (auto& item : later)
+		scheduleRefresh(item.first, item.second);
+
+	for (auto& item : due) {
+		// Refreshed through the route of the name, which is the part of the key after the kind
+		std::string dnsServer;
+		std::vector<UpstreamPtr> upstreams;
+		serversFor(item.first.substr(item.first.find('|') + 1), dnsServer, upstreams);
+		std::unique_ptr<Lookup> lookup(new Lookup(upstreams, item.second));
+		lookup->start(DEFAULT_TIMEOUT);
+		runInBackground(std::move(lookup), item.first, true);
+	}
+}
+
+static void pumpBackgroundLookups()
+{
+	std::lock_guard<std::mutex> lock(g_backgroundMutex);
+	for (auto it = g_backgroundLookups.begin(); it != g_backgroundLookups.end();) {
+		if (!it->lookup->step(0)) {
+			++it;
+			continue;
+		}
+		it->lookup->finish();
+		completeLookup(it->key, *it->lookup);
+		it = g_backgroundLookups.erase(it);
+	}
+}
+
+static void destroyBackgroundLookups()
+{
+	std::lock_guard<std::mutex> lock(g_backgroundMutex);
+	g_backgroundLookups.clear();
+}
+
+// The records of a cached entry as rendered by render, decoded and kept on the first read.
+// Growing the entry may evict it, so the caller must not use it afterwards.
+static std::string renderEntry(CacheShard& shard, CacheMap::iterator it, const Renderer& render)
+{
+	CacheEntry& entry = it->second;
+	if (!entry.rendered.empty())
+		return entry.rendered;
+	std::string rendered = render(decodeResponses(entry.responses));
+	entry.rendered = rendered;
+	g_answerCache.resized(shard, it);
+	return rendered;
+}
+
+// Answers a lookup from the cache, or runs it against the upstreams and caches the answer
+static CachedAnswer cachedLookup(const std::string& key, const std::vector<UpstreamPtr>& upstreams, int timeoutMs, const Lookup::Starter& starter, const Renderer& render)
+{
+	CachedAnswer result;
+	fmx::uint64 hash = hashKey(key);
+	if (g_answerCache.findFresh(key, hash, result.rendered)) {
+		g_stats.cacheHits++;
+		result.answered = true;
+		return result;
+	}
+
+	int clientTimeoutMs = timeoutMs;
+	bool interactiveFirst = g_scheduler.interactiveFirst();
+	{
+		CacheShard& shard = g_answerCache.shardFor(hash);
+		std::lock_guard<std::mutex> lock(g_cacheMutex);
+		std::lock_guard<std::shared_timed_mutex> shardLock(shard.lock);
+		auto it = shard.entries.find(key);
+		if (it == shard.entries.end())
+			it = promoteFromSharedCache(shard, key);
+		if (it == shard.entries.end())
+			it = promoteFromSnapshot(shard, key);
+		auto now = std::chrono::system_clock::now();
+		if (it != shard.entries.end()) {
+			CacheEntry& entry = it->second;
+			bool fresh = now < entry.expires;
+			if (fresh || now < entry.expires + std::chrono::seconds(g_staleWindowSec)) {
+				bool refresh = !fresh && !entry.refreshing && std::chrono::steady_clock::now() >= entry.retryRefreshAt;
+				if (refresh && interactiveFirst) {
+					// Background work waits while interactive calls are over their target: the
+					// stale answer is served and a later call refreshes it
+					entry.retryRefreshAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(PREFETCH_RECHECK_INTERVAL);
+					refresh = false;
+				}
+				if (refresh)
+					entry.refreshing = true;
+				entry.hits.increment();
+				g_answerCache.touch(shard, it);
+				result.rendered = renderEntry(shard, it, render);
+				result.answered = true;
+				if (fresh) {
+					g_stats.cacheHits++;
+					return result;
+				}
+				result.stale = true;
+				if (!refresh) {
+					g_stats.staleAnswers++;
+					return result;
+				}
+				clientTimeoutMs = std::min(timeoutMs, g_clientTimeoutMs);
+			}
+		}
+		g_stats.cacheMisses++;
+	}
+
+	std::unique_ptr<Lookup> lookup(new Lookup(upstreams, starter));
+	lookup->start(timeoutMs);
+	const auto clientDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(clientTimeoutMs);
+	bool done = false;
+	while (!done) {
+		int remainingMs = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(clientDeadline - std::chrono::steady_clock::now()).count());
+		if (remainingMs <= 0)
+			break;
+		done = lookup->step(remainingMs);
+	}
+
+	if (!done) {
+		// Client response timer fired: answer stale now, keep refreshing
+		g_stats.staleAnswers++;
+		runInBackground(std::move(lookup), key);
+		if (!result.answered)
+			result.rendered = render(DNSRecords());
+		return result;
+	}
+
+	lookup->finish();
+	if (const Attempt* answer = lookup->winner()) {
+		result.rendered = render(decodeResponses(answer->responses()));
+		result.answered = true;
+		result.stale = false;
+		completeLookup(key, *lookup, result.rendered);
+		return result;
+	}
+	completeLookup(key, *lookup);
+	if (result.stale) {
+		g_stats.staleAnswers++;  // refresh failed
+	} else {
+		const Attempt* partial = lookup->result();
+		result.rendered = render(partial ? decodeResponses(partial->responses()) : DNSRecords());
+	}
+	return result;
+}
+
+// Cache snapshot ==========================================================================
+//
+// The answer cache is written to a versioned binary file on fDNS_Uninitialize, on plugin shutdown
+// and periodically from Do_PluginIdle, so that a reloaded plugin starts with a warm cache.
+// fDNS_Initialize only maps the file (mmap) and checks its header, which keeps startup fast however
+// many entries it holds. Cache misses look the key up in the file's hash index and copy the entry
+// into the cache with its original expiry time; expired entries are dropped when they are found
+// or when the next snapshot is written. Since its answers are served as they are, the file is only
+// mapped when it belongs to the user and nobody else can write it or its directory, and it is
+// written through a temporary file created with mkstemp.
+//
+// Layout (native byte order): SnapshotHeader, the DNS server list the answers came from, the
+// entries, then slotCount entry offsets (0 = empty) indexed by the FNV-1a hash of the key with
+// linear probing. Entry (encodeEntry(), shared with the shared cache's slots): int64 expires (s
+// since the epoch), uint32 ttl, uint16 key length, uint16 response count, the key, then per
+// response: uint16 length and the raw DNS response in wire format, as received.
+
+#define SNAPSHOT_MAGIC "fDNSSNAP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_INTERVAL 300   // s between periodic snapshots, written only when the cache changed
+
+struct SnapshotHeader {
+	char magic[8];
+	fmx::uint32 version;
+	fmx::uint32 serverLength;
+	fmx::uint64 entryCount;
+	fmx::uint64 slotCount;      // power of two
+	fmx::uint64 indexOffset;
+	fmx::uint64 fileSize;
+};
+
+// A mapped snapshot file; stays mapped while a reader or writer holds it
+struct Snapshot {
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+	std::string server;
+	fmx::uint64 entriesOffset = 0;
+	fmx::uint64 indexOffset = 0;
+	fmx::uint64 slotCount = 0;
+
+	~Snapshot()
+	{
+		if (data)
+			munmap(const_cast<unsigned char*>(data), size);
+	}
+};
+
+typedef std::vector<std::pair<std::string, CacheEntry>> SnapshotEntries;
+
+static std::string defaultSnapshotPath()
+{
+	const char* home = getenv("HOME");
+#ifdef __APPLE__
+	if (home && *home)
+		return std::string(home) + "/Library/Caches/fDNS.cache";
+#else
+	const char* cacheHome = getenv("XDG_CACHE_HOME");
+	if (cacheHome && *cacheHome)
+		return std::string(cacheHome) + "/fDNS.cache";
+	if (home && *home)
+		return std::string(home) + "/.cache/fDNS.cache";
+#endif
+	// A directory of its own, as the temporary directory is shared with other users
+	const char* tmp = getenv("TMPDIR");
+	return std::string(tmp && *tmp ? tmp : "/tmp") + "/fDNS-" + std::to_string(geteuid()) + "/fDNS.cache";
+}
+
+// Whether a snapshot in the directory of path can only have been written by this user (or root):
+// the directory is created (0700) if missing, and must not be a symlink or writable by others
+static bool snapshotDirectorySafe(const std::string& path)
+{
+	size_t slash = path.rfind('/');
+	std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	struct stat st;
+	if (lstat(directory.c_str(), &st) != 0) {
+		if (errno != ENOENT || mkdir(directory.c_str(), 0700) != 0 || lstat(directory.c_str(), &st) != 0)
+			return false;
+	}
+	return S_ISDIR(st.st_mode) && (st.st_uid == geteuid() || st.st_uid == 0) && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+// All guarded by g_cacheMutex
+static std::string g_snapshotPath = defaultSnapshotPath(); // "" = snapshots disabled
+static std::shared_ptr<Snapshot> g_snapshot;          // the file loaded by fDNS_Initialize
+static bool g_snapshotActive = false;                 // g_snapshot holds answers of the current DNS server
+static fmx::uint64 g_snapshotGeneration = 0;          // g_cacheGeneration when the last snapshot was taken
+static std::chrono::steady_clock::time_point g_nextSnapshot;
+
+static std::mutex g_snapshotWriterMutex;              // guards g_snapshotWriter
+static std::thread g_snapshotWriter;
+
+template <typename T>
+static bool readValue(const unsigned char*& p, const unsigned char* end, T& value)
+{
+	if (static_cast<size_t>(end - p) < sizeof(T))
+		return false;
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return true;
+}
+
+static bool readBytes(const unsigned char*& p, const unsigned char* end, size_t length, std::string& value)
+{
+	if (static_cast<size_t>(end - p) < length)
+		return false;
+	value.assign(reinterpret_cast<const char*>(p), length);
+	p += length;
+	return true;
+}
+
+template <typename T>
+static void appendValue(std::string& buffer, T value)
+{
+	buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Parses an entry encoded by encodeEntry() from [p, end)
+static bool decodeEntry(const unsigned char*& p, const unsigned char* end, std::string& key, CacheEntry& entry)
+{
+	fmx::int64 expires;
+	fmx::uint16 keyLength, responseCount;
+	if (!readValue(p, end, expires) || !readValue(p, end, entry.ttl) || !readValue(p, end, keyLength) ||
+		!readValue(p, end, responseCount) || !readBytes(p, end, keyLength, key))
+		return false;
+	entry.expires = std::chrono::system_clock::time_point(std::chrono::seconds(expires));
+	entry.responses.clear();
+	entry.responses.reserve(responseCount);
+	for (fmx::uint16 i = 0; i < responseCount; ++i) {
+		fmx::uint16 length;
+		std::string response;
+		if (!readValue(p, end, length) || !readBytes(p, end, length, response))
+			return false;
+		entry.responses.push_back(std::move(response));
+	}
+	return true;
+}
+
+// Parses only the key of an entry encoded by encodeEntry() from [p, end), skipping its responses
+static bool decodeEntryKey(const unsigned char* p, const unsigned char* end, std::string& key)
+{
+	fmx::int64 expires;
+	fmx::uint32 ttl;
+	fmx::uint16 keyLength, responseCount;
+	return readValue(p, end, expires) && readValue(p, end, ttl) && readValue(p, end, keyLength) &&
+		readValue(p, end, responseCount) && readBytes(p, end, keyLength, key);
+}
+
+// Appends the entry to buffer; false when it is too large for the format
+static bool encodeEntry(std::string& buffer, const std::string& key, const CacheEntry& entry)
+{
+	if (key.size() > 0xFFFF || entry.responses.size() > 0xFFFF)
+		return false;
+	for (const auto& response : entry.responses) {
+		if (response.size() > 0xFFFF)
+			return false;
+	}
+	appendValue(buffer, static_cast<fmx::int64>(std::chrono::duration_cast<std::chrono::seconds>(entry.expires.time_since_epoch()).count()));
+	appendValue(buffer, entry.ttl);
+	appendValue(buffer, static_cast<fmx::uint16>(key.size()));
+	appendValue(buffer, static_cast<fmx::uint16>(entry.responses.size()));
+	buffer += key;
+	for (const auto& response : entry.responses) {
+		appendValue(buffer, static_cast<fmx::uint16>(response.size()));
+		buffer += response;
+	}
+	return true;
+}
+
+// Parses the entry at p, which must lie in the entry area of the file
+static bool readSnapshotEntry(const Snapshot& snapshot, const unsigned char*& p, std::string& key, CacheEntry& entry)
+{
+	return decodeEntry(p, snapshot.data + snapshot.indexOffset, key, entry);
+}
+
+// Answers are only loaded from a regular file of this user that nobody else can write, in a
+// directory nobody else can write
+static std::shared_ptr<Snapshot> mapSnapshot(const std::string& path)
+{
+	if (!snapshotDirectorySafe(path))
+		return nullptr;
+	int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return nullptr;
+	struct stat st;
+	void* data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0 &&
+		static_cast<size_t>(st.st_size) >= sizeof(SnapshotHeader))
+		data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return nullptr;
+
+	std::shared_ptr<Snapshot> snapshot(new Snapshot);
+	snapshot->data = static_cast<const unsigned char*>(data);
+	snapshot->size = static_cast<size_t>(st.st_size);
+
+	SnapshotHeader header;
+	memcpy(&header, snapshot->data, sizeof(header));
+	fmx::uint64 entriesOffset = sizeof(header) + header.serverLength;
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION ||
+		header.fileSize != snapshot->size || header.slotCount == 0 || (header.slotCount & (header.slotCount - 1)) != 0 ||
+		header.indexOffset < entriesOffset || header.indexOffset > snapshot->size ||
+		(snapshot->size - header.indexOffset) / sizeof(fmx::uint64) != header.slotCount)
+		return nullptr; // unknown version or damaged
+	snapshot->server.assign(reinterpret_cast<const char*>(snapshot->data + sizeof(header)), header.serverLength);
+	snapshot->entriesOffset = entriesOffset;
+	snapshot->indexOffset = header.indexOffset;
+	snapshot->slotCount = header.slotCount;
+	madvise(const_cast<unsigned char*>(snapshot->data), snapshot->size, MADV_RANDOM);
+	return snapshot;
+}
+
+static bool findInSnapshot(const Snapshot& snapshot, const std::string& key, CacheEntry& entry)
+{
+	const unsigned char* index = snapshot.data + snapshot.indexOffset;
+	fmx::uint64 mask = snapshot.slotCount - 1;
+	for (fmx::uint64 i = 0, slot = hashKey(key) & mask; i < snapshot.slotCount; ++i, slot = (slot + 1) & mask) {
+		fmx::uint64 offset;
+		memcpy(&offset, index + slot * sizeof(offset), sizeof(offset));
+		if (offset == 0)
+			return false;
+		if (offset < snapshot.entriesOffset || offset >= snapshot.indexOffset)
+			return false; // damaged
+		const unsigned char* p = snapshot.data + offset;
+		std::string entryKey;
+		if (!readSnapshotEntry(snapshot, p, entryKey, entry))
+			return false;
+		if (DnsNameEqual()(entryKey, key))
+			return true;
+	}
+	return false;
+}
+
+static CacheMap::iterator promoteFromSnapshot(CacheShard& shard, const std::string& key)
+{
+	if (!g_snapshotActive)
+		return shard.entries.end();
+	CacheEntry entry;
+	if (!findInSnapshot(*g_snapshot, key, entry))
+		return shard.entries.end();
+	if (entry.expires + std::chrono::seconds(g_staleWindowSec) <= std::chrono::system_clock::now())
+		return shard.entries.end(); // expired; not written to the next snapshot either
+	if (g_answerCache.flushedSince(key, fetchedAt(entry)))
+		return shard.entries.end(); // flushed; not written to the next snapshot either
+	g_stats.snapshotHits++;
+	return g_answerCache.insert(shard, key, std::move(entry));
+}
+
+static bool writeSnapshot(const std::string& path, const std::string& server, const SnapshotEntries& entries)
+{
+	fmx::uint64 slotCount = 1;
+	while (slotCount < entries.size() * 2)
+		slotCount <<= 1;
+	std::vector<fmx::uint64> index(static_cast<size_t>(slotCount), 0);
+
+	// The cache directory (e.g. ~/.cache) may not exist yet. The temporary file gets a name
+	// nobody can guess or create first (mode 0600).
+	if (!snapshotDirectorySafe(path))
+		return false;
+	std::string tmpPath = path + ".XXXXXX";
+	int fd = mkstemp(&tmpPath[0]);
+	if (fd < 0)
+		return false;
+	FILE* file = fdopen(fd, "wb");
+	if (!file) {
+		close(fd);
+		unlink(tmpPath.c_str());
+		return false;
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.serverLength = static_cast<fmx::uint32>(server.size());
+	header.slotCount = slotCount;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(server.data(), 1, server.size(), file) == server.size();
+
+	fmx::uint64 offset = sizeof(header) + server.size();
+	std::string buffer;
+	for (const auto& item : entries) {
+		const std::string& key = item.first;
+		const CacheEntry& entry = item.second;
+		if (!ok)
+			break;
+		buffer.clear();
+		if (!encodeEntry(buffer, key, entry))
+			continue;
+		ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+
+		fmx::uint64 slot = hashKey(key) & (slotCount - 1);
+		while (index[static_cast<size_t>(slot)] != 0)
+			slot = (slot + 1) & (slotCount - 1);
+		index[static_cast<size_t>(slot)] = offset;
+		offset += buffer.size();
+		header.entryCount++;
+	}
+
+	header.indexOffset = offset;
+	header.fileSize = offset + slotCount * sizeof(fmx::uint64);
+	ok = ok && fwrite(index.data(), sizeof(fmx::uint64), index.size(), file) == index.size();
+	ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = fclose(file) == 0 && ok;
+	// rename() replaces the file atomically; a mapped previous snapshot stays valid
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+		unlink(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Collects the live cache entries plus the entries of the loaded snapshot that were never used.
+// Entries past their stale window are left out.
+static void writeCacheSnapshot(const std::string& path, const std::string& server, SnapshotEntries entries,
+	std::shared_ptr<Snapshot> previous, std::chrono::system_clock::time_point keepAfter)
+{
+	if (previous && previous->server == server) {
+		std::unordered_set<std::string, DnsNameHash, DnsNameEqual> cached;
+		for (const auto& item : entries)
+			cached.insert(item.first);
+		const unsigned char* p = previous->data + previous->entriesOffset;
+		std::string key;
+		CacheEntry entry;
+		while (p < previous->data + previous->indexOffset && readSnapshotEntry(*previous, p, key, entry)) {
+			if (entry.expires > keepAfter && !cached.count(key) && !g_answerCache.flushedSince(key, fetchedAt(entry)))
+				entries.emplace_back(key, entry);
+		}
+	}
+	writeSnapshot(path, server, entries);
+}
+
+static void joinSnapshotWriter()
+{
+	std::lock_guard<std::mutex> lock(g_snapshotWriterMutex);
+	if (g_snapshotWriter.joinable())
+		g_snapshotWriter.join();
+}
+
+// Takes a snapshot of the cache for server. The file is written on a separate thread
+// unless wait is set (plugin unload).
+static void saveSnapshot(const std::string& server, bool wait)
+{
+	joinSnapshotWriter(); // one writer at a time
+
+	std::string path;
+	SnapshotEntries entries;
+	std::shared_ptr<Snapshot> previous;
+	auto keepAfter = std::chrono::system_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(g_cacheMutex);
+		g_nextSnapshot = std::chrono::steady_clock::now() + std::chrono::seconds(SNAPSHOT_INTERVAL);
+		if (g_snapshotPath.empty() || server.empty() || g_snapshotGeneration == g_cacheGeneration)
+			return;
+		g_snapshotGeneration = g_cacheGeneration;
+		path = g_snapshotPath;
+		previous = g_snapshot;
+		keepAfter -= std::chrono::seconds(g_staleWindowSec);
+		for (size_t i = 0; i < g_answerCache.shardCount(); ++i) {
+			CacheShard& shard = g_answerCache.shard(i);
+			std::shared_lock<std::shared_timed_mutex> shardLock(shard.lock);
+			for (const auto& item : shard.entries) {
+				if (item.second.expires > keepAfter)
+					entries.emplace_back(item.first, item.second);
+			}
+		}
+	}
+
+	if (wait) {
+		writeCacheSnapshot(path, server, std::move(entries), previous, keepAfter);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(g_snapshotWriterMutex);
+	g_snapshotWriter = std::thread(writeCacheSnapshot, path, server, std::move(entries), previous, keepAfter);
+}
+
+// Called from Do_PluginIdle
+static void saveSnapshotPeriodically(const std::string& server)
+{
+	{
+		std::lock_guard<std::mutex> lock(g_cacheMutex);
+		if (std::chrono::steady_clock::now() < g_nextSnapshot)
+			return;
+	}
+	saveSnapshot(server, false);
+}
+
+// Maps the snapshot file at g_snapshotPath; called with g_cacheMutex held
+static void loadSnapshot(const std::string& server)
+{
+	g_snapshot = g_snapshotPath.empty() ? nullptr : mapSnapshot(g_snapshotPath);
+	g_snapshotActive = g_snapshot && !server.empty() && g_snapshot->server == server;
+	g_snapshotGeneration = g_cacheGeneration;
+	g_nextSnapshot = std::chrono::steady_clock::now() + std::chrono::seconds(SNAPSHOT_INTERVAL);
+}
+
+// Shared cache ============================================================================
+//
+// FileMaker Server loads the plugin separately into each of its engines (scripting, WebDirect/CWP,
+// Data API). With a shared cache set, every fDNS instance on the host also reads and fills an
+// open-addressing table of fixed-size slots in a named shared memory segment, so a name resolved
+// by one engine is available to the others right away. Keys include the DNS server list.
+//
+// Each slot is guarded by a seqlock: the lock word holds a sequence number in its upper half and,
+// while the sequence is odd (a write is in progress), the writer's pid in its lower half. Readers
+// never block; they copy the slot and retry when the sequence moved. A slot left locked by a
+// process that died is taken over by the next writer, and a segment whose creator died before it
+// was initialized is initialized by the next process that opens it.
+
+#define SHARED_CACHE_MAGIC "fDNSSHM1"
+#define SHARED_CACHE_VERSION 4
+#define SHARED_SLOT_SIZE 512         // bytes; entries that do not fit are not shared
+#define SHARED_PROBE_LIMIT 8         // slots probed per key
+#define SHARED_READ_RETRIES 4
+#define DEFAULT_SHARED_CACHE_MB 16
+#define MAX_SHARED_CACHE_MB 1024
+
+enum { kSharedUninitialized = 0, kSharedInitializing = 1, kSharedReady = 2 };
+
+struct SharedCacheHeader {
+	char magic[8];
+	fmx::uint32 version;
+	fmx::uint32 slotSize;
+	fmx::uint64 slotCount;
+	std::atomic<fmx::uint64> claim;        // state << 32 | pid of the process initializing the segment
+};
+
+struct SharedSlot {
+	std::atomic<fmx::uint64> lock;         // sequence << 32 | writer pid
+	std::atomic<fmx::uint64> hash;         // 0 = empty
+	std::atomic<fmx::int64> expires;       // s since the epoch
+	fmx::uint32 length;                    // of the encoded entry in data
+	fmx::uint32 reserved;
+	unsigned char data[SHARED_SLOT_SIZE - 32];
+};
+
+static_assert(sizeof(SharedSlot) == SHARED_SLOT_SIZE, "unexpected shared slot layout");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "the shared cache needs lock-free atomics");
+
+struct SharedCache {
+	void* base = nullptr;
+	size_t size = 0;
+	SharedCacheHeader* header = nullptr;
+	SharedSlot* slots = nullptr;
+
+	~SharedCache()
+	{
+		if (base)
+			munmap(base, size);
+	}
+};
+
+// All guarded by g_cacheMutex
+static std::string g_sharedCacheName;                 // "" = no shared cache
+static int g_sharedCacheSizeMB = DEFAULT_SHARED_CACHE_MB;
+static std::unique_ptr<SharedCache> g_sharedCache;
+
+static bool processAlive(fmx::uint32 pid)
+{
+	return pid != 0 && (kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH);
+}
+
+static fmx::uint64 sequenceOf(fmx::uint64 lock) { return lock >> 32; }
+static fmx::uint32 ownerOf(fmx::uint64 lock) { return static_cast<fmx::uint32>(lock); }
+
+// Opens (creating it if needed) the shared memory segment "/fDNS.<name>" of sizeMB megabytes.
+// An existing segment keeps its size.
+static std::unique_ptr<SharedCache> openSharedCache(const std::string& name, int sizeMB)
+{
+	std::string shmName = "/fDNS." + name;
+	if (shmName.size() > 30) // PSHMNAMLEN on macOS
+		return nullptr;
+	int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return nullptr;
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+		(st.st_size == 0 && (ftruncate(fd, static_cast<off_t>(sizeMB) * 1024 * 1024) != 0 || fstat(fd, &st) != 0)) ||
+		static_cast<size_t>(st.st_size) < sizeof(SharedCacheHeader) + SHARED_SLOT_SIZE) {
+		close(fd);
+		return nullptr;
+	}
+	void* base = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return nullptr;
+
+	std::unique_ptr<SharedCache> cache(new SharedCache);
+	cache->base = base;
+	cache->size = static_cast<size_t>(st.st_size);
+	cache->header = static_cast<SharedCacheHeader*>(base);
+	cache->slots = reinterpret_cast<SharedSlot*>(static_cast<unsigned char*>(base) + SHARED_SLOT_SIZE);
+	SharedCacheHeader* header = cache->header;
+
+	// New segments are zero-filled; the first process to claim one initializes it. The claim
+	// carries the initializer's pid, so the others can tell a slow initializer from a dead one.
+	fmx::uint64 initializing = (static_cast<fmx::uint64>(kSharedInitializing) << 32) | static_cast<fmx::uint32>(getpid());
+	for (int waited = 0;; ++waited) {
+		fmx::uint64 claim = header->claim.load(std::memory_order_acquire);
+		if (sequenceOf(claim) == kSharedReady)
+			break;
+		bool claimed = false;
+		if (sequenceOf(claim) == kSharedUninitialized || waited > 1000 || !processAlive(ownerOf(claim)))
+			claimed = header->claim.compare_exchange_strong(claim, initializing); // new, or its creator died
+		if (claimed) {
+			memset(static_cast<void*>(cache->slots), 0, cache->size - SHARED_SLOT_SIZE);
+			memcpy(header->magic, SHARED_CACHE_MAGIC, sizeof(header->magic));
+			header->version = SHARED_CACHE_VERSION;
+			header->slotSize = SHARED_SLOT_SIZE;
+			header->slotCount = (cache->size - SHARED_SLOT_SIZE) / SHARED_SLOT_SIZE;
+			header->claim.store(static_cast<fmx::uint64>(kSharedReady) << 32, std::memory_order_release);
+			break;
+		}
+		usleep(1000);
+	}
+
+	if (memcmp(header->magic, SHARED_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != SHARED_CACHE_VERSION ||
+		header->slotSize != SHARED_SLOT_SIZE || header->slotCount == 0 ||
+		header->slotCount > (cache->size - SHARED_SLOT_SIZE) / SHARED_SLOT_SIZE)
+		return nullptr; // made by an incompatible version
+	return cache;
+}
+
+// Copies a consistent view of slot into the caller's buffers; false while a write is in progress
+static bool readSharedSlot(const SharedSlot& slot, fmx::uint64& hash, std::string& data)
+{
+	for (int attempt = 0; attempt < SHARED_READ_RETRIES; ++attempt) {
+		fmx::uint64 before = slot.lock.load(std::memory_order_acquire);
+		if (sequenceOf(before) & 1)
+			return false;
+		hash = slot.hash.load(std::memory_order_relaxed);
+		fmx::uint32 length = std::min<fmx::uint32>(slot.length, sizeof(slot.data));
+		data.assign(reinterpret_cast<const char*>(slot.data), length);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.lock.load(std::memory_order_relaxed) == before)
+			return true;
+	}
+	return false;
+}
+
+// Locks slot for writing; takes the slot over when its writer died
+static bool lockSharedSlot(SharedSlot& slot, fmx::uint64& locked)
+{
+	fmx::uint64 pid = static_cast<fmx::uint32>(getpid());
+	fmx::uint64 current = slot.lock.load(std::memory_order_relaxed);
+	fmx::uint64 sequence = sequenceOf(current);
+	if ((sequence & 1) && processAlive(ownerOf(current)))
+		return false; // being written; the other writer's answer will do
+	locked = ((sequence + ((sequence & 1) ? 2 : 1)) << 32) | pid;
+	if (!slot.lock.compare_exchange_strong(current, locked, std::memory_order_acq_rel))
+		return false;
+	// Readers must see the odd sequence before any of the slot's new contents
+	std::atomic_thread_fence(std::memory_order_release);
+	return true;
+}
+
+static std::string sharedKey(const std::string& key)
+{
+	return g_cacheServer + "#" + key;
+}
+
+static CacheMap::iterator promoteFromSharedCache(CacheShard& shard, const std::string& key)
+{
+	if (!g_sharedCache || g_cacheServer.empty())
+		return shard.entries.end();
+	std::string qualifiedKey = sharedKey(key);
+	fmx::uint64 hash = hashKey(qualifiedKey) | 1;
+	fmx::uint64 slotCount = g_sharedCache->header->slotCount;
+	auto now = std::chrono::system_clock::now();
+	std::string data, entryKey;
+	for (fmx::uint64 i = 0; i < SHARED_PROBE_LIMIT && i < slotCount; ++i) {
+		SharedSlot& slot = g_sharedCache->slots[(hash + i) % slotCount];
+		if (slot.hash.load(std::memory_order_relaxed) != hash)
+			continue;
+		fmx::uint64 slotHash;
+		CacheEntry entry;
+		if (!readSharedSlot(slot, slotHash, data) || slotHash != hash)
+			continue;
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+		if (!decodeEntry(p, p + data.size(), entryKey, entry) || !DnsNameEqual()(entryKey, qualifiedKey))
+			continue;
+		if (entry.expires + std::chrono::seconds(g_staleWindowSec) <= now || g_answerCache.flushedSince(key, fetchedAt(entry)))
+			return shard.entries.end();
+		g_stats.sharedHits++;
+		return g_answerCache.insert(shard, key, std::move(entry));
+	}
+	return shard.entries.end();
+}
+
+static void storeInSharedCache(const std::string& key, const CacheEntry& entry)
+{
+	if (!g_sharedCache || g_cacheServer.empty())
+		return;
+	std::string qualifiedKey = sharedKey(key);
+	std::string data;
+	if (!encodeEntry(data, qualifiedKey, entry) || data.size() > sizeof(SharedSlot::data))
+		return;
+	fmx::uint64 hash = hashKey(qualifiedKey) | 1;
+	fmx::int64 expires = std::chrono::duration_cast<std::chrono::seconds>(entry.expires.time_since_epoch()).count();
+	fmx::int64 now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	// Same key, else an empty or expired slot, else the one that expires first
+	fmx::uint64 slotCount = g_sharedCache->header->slotCount;
+	SharedSlot* victim = nullptr;
+	for (fmx::uint64 i = 0; i < SHARED_PROBE_LIMIT && i < slotCount; ++i) {
+		SharedSlot& slot = g_sharedCache->slots[(hash + i) % slotCount];
+		fmx::uint64 slotHash = slot.hash.load(std::memory_order_relaxed);
+		if (slotHash == hash) {
+			victim = &slot;
+			break;
+		}
+		fmx::int64 slotExpires = slot.expires.load(std::memory_order_relaxed);
+		if (slotHash == 0 || slotExpires <= now) {
+			if (!victim || victim->hash.load(std::memory_order_relaxed) != 0)
+				victim = &slot;
+		} else if (!victim || (victim->hash.load(std::memory_order_relaxed) != 0 && victim->expires.load(std::memory_order_relaxed) > now &&
+			slotExpires < victim->expires.load(std::memory_order_relaxed))) {
+			victim = &slot;
+		}
+	}
+
+	fmx::uint64 locked;
+	if (!victim || !lockSharedSlot(*victim, locked))
+		return;
+	victim->hash.store(hash, std::memory_order_relaxed);
+	victim->expires.store(expires, std::memory_order_relaxed);
+	victim->length = static_cast<fmx::uint32>(data.size());
+	memcpy(victim->data, data.data(), data.size());
+	victim->lock.store((sequenceOf(locked) + 1) << 32, std::memory_order_release);
+}
+
+// Cache management ========================================================================
+//
+// Flushing, pinning and listing cached answers, e.g. right after DNS records were changed.
+// A flush also removes the name from the shared cache and keeps it from coming back from
+// the snapshot. Names given as an IP address stand for their reverse (PTR) name.
+
+static std::string managedName(const std::string& name)
+{
+	std::string arpaName = reverseName(name);
+	return reversedName(arpaName.empty() ? name : arpaName);
+}
+
+static const char* segmentName(CacheSegment segment)
+{
+	switch (segment) {
+	case kSegmentWindow: return "window";
+	case kSegmentProbation: return "probation";
+	case kSegmentProtected: return "protected";
+	default: return "pinned";
+	}
+}
+
+// Empties the shared cache slots of name (reversed), and of its subdomains if asked. This is a
+// scan of every slot: the segment is indexed by key hash only, and an index of names would have
+// to be shared and kept consistent by all the processes that write to it. Only the key of each
+// used slot is parsed, so a flush of a 16 MB table reads about 32,000 keys.
+static void removeFromSharedCache(const std::string& name, bool subdomains)
+{
+	if (!g_sharedCache || g_cacheServer.empty())
+		return;
+	std::string serverPrefix = sharedKey("");
+	std::string subdomainPrefix = name + ".";
+	std::string data, key;
+	for (fmx::uint64 i = 0; i < g_sharedCache->header->slotCount; ++i) {
+		SharedSlot& slot = g_sharedCache->slots[i];
+		if (slot.hash.load(std::memory_order_relaxed) == 0)
+			continue;
+		fmx::uint64 hash;
+		if (!readSharedSlot(slot, hash, data))
+			continue;
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+		if (!decodeEntryKey(p, p + data.size(), key) || key.compare(0, serverPrefix.size(), serverPrefix) != 0)
+			continue;
+		std::string entryName = reversedName(key.substr(serverPrefix.size()));
+		if (entryName != name && !(subdomains && entryName.compare(0, subdomainPrefix.size(), subdomainPrefix) == 0))
+			continue;
+		fmx::uint64 locked;
+		if (!lockSharedSlot(slot, locked))
+			continue;
+		if (slot.hash.load(std::memory_order_relaxed) == hash) {
+			slot.hash.store(0, std::memory_order_relaxed);
+			slot.expires.store(0, std::memory_order_relaxed);
+			slot.length = 0;
+		}
+		slot.lock.store((sequenceOf(locked) + 1) << 32, std::memory_order_release);
+	}
+}
+
+static fmx::errcode fDNS_Cache_Flush(const std::string& name, bool includeSubdomains, size_t& flushed)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	std::string reversed = managedName(name);
+	if (reversed.empty())
+		return 956;
+	std::lock_guard<std::mutex> lock(g_cacheMutex);
+	flushed = g_answerCache.flush(reversed, includeSubdomains, std::chrono::seconds(MAX_CACHE_TTL + g_staleWindowSec));
+	removeFromSharedCache(reversed, includeSubdomains);
+	g_cacheGeneration++; // the next snapshot leaves the flushed entries out
+	return 0;
+}
+
+static fmx::errcode fDNS_Cache_Pin(const std::string& name, bool pinned)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	std::string reversed = managedName(name);
+	if (reversed.empty())
+		return 956;
+	g_answerCache.pin(reversed, pinned);
+	return 0;
+}
+
+// The entries of the in-memory cache as a JSON array; entries only in the snapshot are not listed
+static std::string fDNS_Cache_Dump()
+{
+	std::string json = "[";
+	auto now = std::chrono::system_clock::now();
+	for (size_t i = 0; i < g_answerCache.shardCount(); ++i) {
+		CacheShard& shard = g_answerCache.shard(i);
+		std::shared_lock<std::shared_timed_mutex> lock(shard.lock);
+		for (const auto& item : shard.entries) {
+			const CacheEntry& entry = item.second;
+			size_t separator = item.first.find('|');
+			size_t at = item.first.find('@');
+			if (at > separator)
+				at = separator;
+			fmx::int64 remaining = std::chrono::duration_cast<std::chrono::seconds>(entry.expires - now).count();
+			if (json.size() > 1)
+				json += ",";
+			json += "{\"name\":\"" + item.first.substr(separator + 1) + "\"";
+			json += ",\"kind\":\"" + item.first.substr(0, at) + "\"";
+			if (at < separator)
+				json += ",\"server\":\"" + item.first.substr(at + 1, separator - at - 1) + "\""; // of its route
+			json += ",\"ttl\":" + std::to_string(std::max<fmx::int64>(remaining, 0));
+			json += ",\"stale\":";
+			json += entry.expires <= now ? "true" : "false";
+			json += ",\"segment\":\"" + std::string(segmentName(entry.segment)) + "\"";
+			json += ",\"hits\":" + std::to_string(entry.hits.load());
+			json += ",\"bytes\":" + std::to_string(entry.bytes);
+			json += ",\"records\":" + DNSRecordsToJsonArray(decodeResponses(entry.responses)) + "}";
+		}
+	}
+	json += "]";
+	return json;
+}
+
+// Cache benchmark =========================================================================
+//
+// Measures the hit throughput of a private, pre-filled cache with 1, 2, 4 ... maxThreads threads,
+// both sharded and with a single shard (the equivalent of one global lock), to show how the cache
+// scales on the host. The plugin's own cache is not touched. A development tool, so it is only
+// built with FDNS_BENCHMARKS defined.
+
+#ifdef FDNS_BENCHMARKS
+
+#define BENCHMARK_NAMES 10000
+#define DEFAULT_BENCHMARK_DURATION 250 // ms per measurement
+#define MAX_BENCHMARK_THREADS 64
+
+struct alignas(64) BenchmarkCounter {
+	fmx::uint64 lookups = 0;
+};
+
+static double measureCacheHits(AnswerCache& cache, const std::vector<std::string>& keys, const std::vector<fmx::uint64>& hashes, int threads, int durationMs)
+{
+	std::atomic<bool> running{true};
+	std::vector<BenchmarkCounter> counters(static_cast<size_t>(threads));
+	std::vector<std::thread> workers;
+	auto started = std::chrono::steady_clock::now();
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t]() {
+			std::string rendered;
+			size_t i = static_cast<size_t>(t) * 7919 % keys.size();
+			fmx::uint64 lookups = 0;
+			while (running.load(std::memory_order_relaxed)) {
+				cache.findFresh(keys[i], hashes[i], rendered);
+				i = (i + 101) % keys.size();
+				lookups++;
+			}
+			counters[static_cast<size_t>(t)].lookups = lookups;
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(durationMs));
+	running = false;
+	for (auto& worker : workers)
+		worker.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	fmx::uint64 total = 0;
+	for (const auto& counter : counters)
+		total += counter.lookups;
+	return total / seconds;
+}
+
+static std::string fDNS_Benchmark_Cache(int maxThreads, int durationMs)
+{
+	std::vector<std::string> keys;
+	std::vector<fmx::uint64> hashes;
+	AnswerCache sharded, single(1);
+	for (int i = 0; i < BENCHMARK_NAMES; ++i) {
+		keys.push_back(cacheKey("A", "host" + std::to_string(i) + ".benchmark.example"));
+		hashes.push_back(hashKey(keys.back()));
+		for (AnswerCache* cache : {&sharded, &single}) {
+			CacheEntry entry;
+			entry.rendered = "192.0.2." + std::to_string(i % 256);
+			entry.expires = std::chrono::system_clock::now() + std::chrono::hours(1);
+			entry.ttl = 3600;
+			CacheShard& shard = cache->shardFor(hashes.back());
+			std::lock_guard<std::shared_timed_mutex> lock(shard.lock);
+			cache->insert(shard, keys.back(), std::move(entry));
+		}
+	}
+
+	std::string json = "{\"shards\":" + std::to_string(sharded.shardCount()) + ",\"names\":" + std::to_string(BENCHMARK_NAMES) + ",\"results\":[";
+	for (int threads = 1; threads <= maxThreads; threads = threads < maxThreads && threads * 2 > maxThreads ? maxThreads : threads * 2) {
+		if (threads > 1)
+			json += ",";
+		json += "{\"threads\":" + std::to_string(threads);
+		json += ",\"lookupsPerSecond\":" + std::to_string(static_cast<fmx::uint64>(measureCacheHits(sharded, keys, hashes, threads, durationMs)));
+		json += ",\"singleLockLookupsPerSecond\":" + std::to_string(static_cast<fmx::uint64>(measureCacheHits(single, keys, hashes, threads, durationMs)));
+		json += "}";
+		if (threads == maxThreads)
+			break;
+	}
+	json += "]}";
+	return json;
+}
+#endif
+
+// TCP benchmark ===========================================================================
+//
+// Sends queries to a server over TCP (or TLS for a "tls://" server, HTTPS for an "https://" one)
+// three ways: a new connection for every query (what a truncated UDP response used to cost; TLS
+// connections resume the first session), one reused connection waiting for each answer, and one
+// connection with up to depth queries in flight (pipelining, or HTTP/2 streams). The upstreams
+// are not touched. Like the cache benchmark it is only built with FDNS_BENCHMARKS defined, and
+// the queries are capped, as they go to whatever server the caller names.
+
+#ifdef FDNS_BENCHMARKS
+#define DEFAULT_TCP_BENCHMARK_QUERIES 1000
+#define MAX_TCP_BENCHMARK_QUERIES 10000  // per mode
+#define DEFAULT_TCP_BENCHMARK_DEPTH 32
+#define MAX_TCP_BENCHMARK_DEPTH 1000
+#define TCP_BENCHMARK_TIMEOUT 2000 // ms to wait for an answer
+
+struct TcpBenchmarkResult {
+	int answered = 0;
+	int failed = 0;              // errors and timeouts
+	double seconds = 0;
+};
+
+// connect creates a connection to the server
+static TcpBenchmarkResult measureTcpQueries(const std::function<QueryConnection*()>& connect, int queries, int depth, bool newConnections)
+{
+	TcpBenchmarkResult result;
+	std::unique_ptr<QueryConnection> connection;
+	std::vector<std::pair<StreamQueryPtr, std::chrono::steady_clock::time_point>> inFlight;
+	int sent = 0;
+	auto started = std::chrono::steady_clock::now();
+	while (sent < queries || !inFlight.empty()) {
+		while (sent < queries && inFlight.size() < static_cast<size_t>(depth)) {
+			if (newConnections || !connection)
+				connection.reset(connect());
+			StreamQueryPtr query = makeStreamQuery("host" + std::to_string(sent++) + ".benchmark.example", ns_t_a);
+			if (query->message.empty() || !connection->send(query)) {
+				result.failed++;
+				continue;
+			}
+			inFlight.emplace_back(query, std::chrono::steady_clock::now() + std::chrono::milliseconds(TCP_BENCHMARK_TIMEOUT));
+		}
+		if (inFlight.empty())
+			continue;
+
+		std::vector<struct pollfd> pollFds;
+		connection->addPollFds(pollFds);
+		int waitMs = 10;
+		connection->timeout(waitMs);
+		if (poll(pollFds.data(), pollFds.size(), waitMs) < 0 && errno != EINTR)
+			break;
+		connection->process();
+
+		auto now = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < inFlight.size();) {
+			const StreamQuery& query = *inFlight[i].first;
+			bool done = query.done.load(std::memory_order_acquire);
+			if (!done && now < inFlight[i].second) {
+				++i;
+				continue;
+			}
+			if (done && !query.response.empty())
+				result.answered++;
+			else
+				result.failed++;
+			inFlight.erase(inFlight.begin() + static_cast<std::ptrdiff_t>(i));
+		}
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	return result;
+}
+
+static fmx::errcode fDNS_Benchmark_TCP(const std::string& server, int queries, int depth, std::string& json)
+{
+	Transport transport;
+	std::string endpoint, authName;
+	struct sockaddr_storage address;
+	socklen_t length = 0;
+	if (!parseServer(server, transport, endpoint, authName) ||
+		(transport != kTransportHttps && !parseEndpoint(endpoint, defaultPort(transport), address, length)))
+		return 956;
+	std::shared_ptr<TlsContext> tls;
+	if (transport == kTransportTls)
+		tls = std::make_shared<TlsContext>(authName);
+	std::function<QueryConnection*()> connect = [&]() -> QueryConnection* {
+		if (transport == kTransportHttps)
+			return new HttpsConnection(endpoint);
+		return new StreamConnection(address, length, tls);
+	};
+	static const char* const transportNames[] = { "tcp", "tcp", "tls", "https" };
+
+	static const struct {
+		const char* mode;
+		bool newConnections;
+		bool pipelined;
+	} modes[] = { { "newConnection", true, false }, { "reused", false, false }, { "pipelined", false, true } };
+
+	json = "{\"server\":\"" + endpoint + "\",\"transport\":\"" + transportNames[transport] + "\",\"queries\":" + std::to_string(queries) + ",\"results\":[";
+	for (const auto& mode : modes) {
+		int modeDepth = mode.pipelined ? depth : 1;
+		TcpBenchmarkResult result = measureTcpQueries(connect, queries, modeDepth, mode.newConnections);
+		if (&mode != modes)
+			json += ",";
+		json += "{\"mode\":\"" + std::string(mode.mode) + "\",\"depth\":" + std::to_string(modeDepth);
+		json += ",\"answered\":" + std::to_string(result.answered) + ",\"failed\":" + std::to_string(result.failed);
+		json += ",\"durationMs\":" + std::to_string(static_cast<fmx::uint64>(result.seconds * 1000));
+		json += ",\"queriesPerSecond\":" + std::to_string(static_cast<fmx::uint64>(result.seconds > 0 ? result.answered / result.seconds : 0));
+		json += "}";
+	}
+	json += "]}";
+	return 0;
+}
+#endif
+
+// Bulk resolution =========================================================================
+//
+// fDNS_Resolve_Bulk resolves a file of names (one per line) for data-cleansing runs over hundreds
+// of thousands of domains, bypassing the per-lookup machinery: no channel, cache or Lookup per
+// name. The queries are encoded into preallocated buffers and spread over a few connected UDP
+// sockets per server, sent and received through io_uring where the kernel has it, else in batches
+// with sendmmsg/recvmmsg (one send or recv per datagram on systems without them). A reply is
+// matched through the slot table of its socket, indexed by query ID, and checked against the
+// question; IDs are handed out in a shuffled order and reused only after every other ID of the
+// socket. Unanswered queries are retransmitted, to the next server if there is one, after the
+// configured timeout; their timers are kept in a timer wheel, and the loop sleeps until a reply
+// arrives or the next timer fires. Each result is appended to the output file as
+// "name<TAB>status<TAB>records", and the file is flushed every BULK_FLUSH_INTERVAL so the progress
+// of a long run can be followed.
+//
+// How many queries a server gets at once is set by congestion control (AIMD, as in TCP): each
+// server has a window of queries in flight that doubles every round (a window's worth of
+// outcomes) until the first sign of overload, then grows by BULK_WINDOW_INCREASE per round. A
+// round with too many timeouts, SERVFAIL or REFUSED answers, or an average RTT well above the
+// lowest one seen halves the window; queries sent before a cut do not count towards the next
+// round. A query still unanswered after the server's RTO (the smoothed RTT plus four times its
+// variation as in TCP, but at least twice the smoothed RTT, plus BULK_RTT_SLACK) is counted as
+// lost and leaves the window, though it still waits for an answer until the timeout: losses are
+// seen within a few RTTs, and do not hold the window closed. With serverQps configured, a token
+// bucket also caps the queries per second sent to each server.
+
+#define BULK_SOCKETS_PER_SERVER 4
+#define BULK_BATCH 64                 // datagrams per sendmmsg/recvmmsg
+#define BULK_QUERY_SIZE 512
+#define BULK_RESPONSE_SIZE 4096
+#define BULK_EDNS_PAYLOAD 1232        // advertised so that few answers come back truncated
+#define BULK_SOCKET_BUFFER (4 * 1024 * 1024)
+#define BULK_TRIES 3
+#define DEFAULT_BULK_IN_FLIGHT 2048
+#define MAX_BULK_IN_FLIGHT 65536
+#define BULK_FLUSH_INTERVAL 100       // ms
+#define BULK_RING_ENTRIES 4096        // io_uring submission queue entries at most
+#define BULK_RING_COMPLETIONS 16384
+#define BULK_RING_BUFFERS 1024        // provided receive buffers of BULK_RESPONSE_SIZE
+#define BULK_INITIAL_WINDOW 64        // queries in flight per server before anything is known
+#define BULK_MIN_WINDOW 1
+#define BULK_MIN_ROUND 16             // outcomes a round takes at least
+#define BULK_WINDOW_INCREASE 32       // per round, once the window has been cut
+#define BULK_LOSS_PERCENT 5           // of a round's outcomes: timeouts that cut the window
+#define BULK_ERROR_PERCENT 20         // of a round's outcomes: SERVFAIL or REFUSED answers that cut it
+#define BULK_RTT_INFLATION 2          // a round's average RTT this many times the lowest one cuts it,
+#define BULK_RTT_SLACK 5              // plus this many ms for jitter
+#define BULK_QPS_BURST 20             // ms of serverQps that may be sent at once
+
+// Writes a query for name (plain labels, no trailing dot) with an EDNS0 OPT record into buffer;
+// returns its length, or 0 if the name cannot be encoded
+static size_t encodeBulkQuery(const std::string& name, int type, fmx::uint16 id, unsigned char* buffer)
+{
+	if (name.empty() || name.size() > 253)
+		return 0;
+	static const unsigned char header[] = { 0, 0, 0x01, 0, 0, 1, 0, 0, 0, 0, 0, 1 }; // RD, 1 question, 1 additional
+	memcpy(buffer, header, sizeof(header));
+	buffer[0] = static_cast<unsigned char>(id >> 8);
+	buffer[1] = static_cast<unsigned char>(id & 0xff);
+	unsigned char* p = buffer + NS_HFIXEDSZ;
+	for (size_t start = 0; start < name.size();) {
+		size_t dot = name.find('.', start);
+		if (dot == std::string::npos)
+			dot = name.size();
+		size_t length = dot - start;
+		if (length == 0 || length > 63)
+			return 0;
+		*p++ = static_cast<unsigned char>(length);
+		memcpy(p, name.data() + start, length);
+		p += length;
+		start = dot + 1;
+	}
+	*p++ = 0;
+	*p++ = static_cast<unsigned char>(type >> 8);
+	*p++ = static_cast<unsigned char>(type & 0xff);
+	*p++ = 0;
+	*p++ = ns_c_in;
+	const unsigned char opt[] = { 0, 0, ns_t_opt, BULK_EDNS_PAYLOAD >> 8, BULK_EDNS_PAYLOAD & 0xff, 0, 0, 0, 0, 0, 0 };
+	memcpy(p, opt, sizeof(opt));
+	return static_cast<size_t>(p - buffer) + sizeof(opt);
+}
+
+// Sends count datagrams on a connected socket; returns how many were sent, -1 on errors. The
+// system calls made are added to syscalls.
+static int sendDatagrams(int fd, struct iovec* datagrams, int count, size_t& syscalls)
+{
+#ifdef __linux__
+	struct mmsghdr messages[BULK_BATCH];
+	memset(messages, 0, sizeof(messages));
+	for (int i = 0; i < count; ++i) {
+		messages[i].msg_hdr.msg_iov = &datagrams[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	syscalls++;
+	return sendmmsg(fd, messages, static_cast<unsigned int>(count), 0);
+#else
+	int sent = 0;
+	while (sent < count && (syscalls++, send(fd, datagrams[sent].iov_base, datagrams[sent].iov_len, 0) >= 0))
+		++sent;
+	return sent > 0 || errno == EAGAIN || errno == EWOULDBLOCK ? sent : -1;
+#endif
+}
+
+// Receives up to count datagrams without waiting into the buffers; their lengths are stored in
+// lengths. Returns how many were received (0 if none are queued), -1 on errors.
+static int receiveDatagrams(int fd, struct iovec* buffers, size_t* lengths, int count, size_t& syscalls)
+{
+#ifdef __linux__
+	struct mmsghdr messages[BULK_BATCH];
+	memset(messages, 0, sizeof(messages));
+	for (int i = 0; i < count; ++i) {
+		messages[i].msg_hdr.msg_iov = &buffers[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	syscalls++;
+	int received = recvmmsg(fd, messages, static_cast<unsigned int>(count), MSG_DONTWAIT, nullptr);
+	for (int i = 0; i < received; ++i)
+		lengths[i] = messages[i].msg_len;
+	if (received < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	return received;
+#else
+	int received = 0;
+	for (; received < count; ++received) {
+		syscalls++;
+		ssize_t length = recv(fd, buffers[received].iov_base, buffers[received].iov_len, MSG_DONTWAIT);
+		if (length < 0)
+			return received > 0 || errno == EAGAIN || errno == EWOULDBLOCK ? received : -1;
+		lengths[received] = static_cast<size_t>(length);
+	}
+	return received;
+#endif
+}
+
+#ifdef FDNS_IO_URING
+// A minimal io_uring on the raw system calls (no liburing), with what the bulk resolver needs:
+// multishot receives into a registered ring of provided buffers (Linux 6.0), sends on registered
+// sockets, and one io_uring_enter that submits, waits with a timeout and flushes completions.
+// open and the registrations fail where io_uring is missing, too old or disabled (seccomp,
+// kernel.io_uring_disabled); the bulk resolver then stays with sendmmsg/recvmmsg and poll.
+class IoUring {
+public:
+	IoUring() = default;
+	~IoUring() { close(); }
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	bool open(unsigned entries, unsigned completions)
+	{
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = completions;
+		m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (m_fd < 0)
+			return false;
+		const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+		if ((params.features & required) != required)
+			return false;
+		m_ringSize = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+									  params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+		void* ring = mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		if (ring == MAP_FAILED)
+			return false;
+		m_ring = static_cast<char*>(ring);
+		m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+		m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+		m_sqHead = reinterpret_cast<unsigned*>(m_ring + params.sq_off.head);
+		m_sqTail = reinterpret_cast<unsigned*>(m_ring + params.sq_off.tail);
+		m_sqArray = reinterpret_cast<unsigned*>(m_ring + params.sq_off.array);
+		m_sqMask = *reinterpret_cast<unsigned*>(m_ring + params.sq_off.ring_mask);
+		m_sqEntries = params.sq_entries;
+		m_cqHead = reinterpret_cast<unsigned*>(m_ring + params.cq_off.head);
+		m_cqTail = reinterpret_cast<unsigned*>(m_ring + params.cq_off.tail);
+		m_cqMask = *reinterpret_cast<unsigned*>(m_ring + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<struct io_uring_cqe*>(m_ring + params.cq_off.cqes);
+		m_sqLocalTail = *m_sqTail;
+		return true;
+	}
+
+	// The sockets are then addressed by their index, with IOSQE_FIXED_FILE
+	bool registerFiles(const std::vector<int>& fds)
+	{
+		return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_FILES, fds.data(), static_cast<unsigned>(fds.size())) == 0;
+	}
+
+	// Registers count (a power of 2) receive buffers of size bytes as buffer group 0
+	bool provideBuffers(unsigned count, unsigned size)
+	{
+		m_bufferRingSize = count * sizeof(struct io_uring_buf);
+		void* ring = mmap(nullptr, m_bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ring == MAP_FAILED)
+			return false;
+		m_bufferRing = static_cast<struct io_uring_buf*>(ring);
+		struct io_uring_buf_reg registration;
+		memset(&registration, 0, sizeof(registration));
+		registration.ring_addr = reinterpret_cast<uintptr_t>(ring);
+		registration.ring_entries = count;
+		registration.bgid = 0;
+		if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0)
+			return false;
+		m_buffers.resize(static_cast<size_t>(count) * size);
+		m_bufferSize = size;
+		m_bufferMask = count - 1;
+		for (unsigned id = 0; id < count; ++id)
+			recycle(static_cast<fmx::uint16>(id));
+		return true;
+	}
+
+	const unsigned char* buffer(fmx::uint16 id) const { return &m_buffers[static_cast<size_t>(id) * m_bufferSize]; }
+
+	// Hands a receive buffer back to the kernel
+	void recycle(fmx::uint16 id)
+	{
+		struct io_uring_buf& entry = m_bufferRing[m_bufferTail & m_bufferMask];
+		entry.addr = reinterpret_cast<uintptr_t>(buffer(id));
+		entry.len = m_bufferSize;
+		entry.bid = id;
+		m_bufferTail++;
+		// The tail overlays the first entry's resv field (struct io_uring_buf_ring, whose flexible
+		// array member is laid out differently by C++ compilers)
+		__atomic_store_n(&m_bufferRing[0].resv, m_bufferTail, __ATOMIC_RELEASE);
+	}
+
+	// A cleared submission entry, nullptr if the queue is still full after submitting it
+	struct io_uring_sqe* next()
+	{
+		if (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+			if (!enter(0, 0) || m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+				return nullptr;
+		}
+		unsigned index = m_sqLocalTail & m_sqMask;
+		struct io_uring_sqe* sqe = &m_sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		m_sqArray[index] = index;
+		m_sqLocalTail++;
+		return sqe;
+	}
+
+	// Submits the queued entries and, with waitMs > 0, waits up to waitMs for a completion
+	bool enter(unsigned waitFor, int waitMs)
+	{
+		__atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+		struct __kernel_timespec timeout;
+		timeout.tv_sec = waitMs / 1000;
+		timeout.tv_nsec = (waitMs % 1000) * 1000000LL;
+		struct io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = reinterpret_cast<uintptr_t>(&timeout);
+		unsigned pending = m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+		m_enters++;
+		// GETEVENTS also moves completions the kernel kept back while the queue was full
+		long result = syscall(__NR_io_uring_enter, m_fd, pending, waitMs > 0 ? waitFor : 0,
+							  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		return result >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY;
+	}
+
+	// Calls handle for every completion posted so far
+	template <typename Handler>
+	void reap(Handler handle)
+	{
+		unsigned head = *m_cqHead;
+		unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head)
+			handle(m_cqes[head & m_cqMask]);
+		__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	size_t enters() const { return m_enters; }
+
+private:
+	void close()
+	{
+		if (m_sqes)
+			munmap(m_sqes, m_sqesSize);
+		if (m_ring)
+			munmap(m_ring, m_ringSize);
+		if (m_fd >= 0)
+			::close(m_fd);
+		if (m_bufferRing)
+			munmap(m_bufferRing, m_bufferRingSize);
+		m_sqes = nullptr;
+		m_ring = nullptr;
+		m_bufferRing = nullptr;
+		m_fd = -1;
+	}
+
+	int m_fd = -1;
+	char* m_ring = nullptr;
+	size_t m_ringSize = 0;
+	struct io_uring_sqe* m_sqes = nullptr;
+	size_t m_sqesSize = 0;
+	unsigned* m_sqHead = nullptr;
+	unsigned* m_sqTail = nullptr;
+	unsigned* m_sqArray = nullptr;
+	unsigned m_sqMask = 0;
+	unsigned m_sqEntries = 0;
+	unsigned m_sqLocalTail = 0;       // entries queued, published to m_sqTail by enter
+	unsigned* m_cqHead = nullptr;
+	unsigned* m_cqTail = nullptr;
+	unsigned m_cqMask = 0;
+	struct io_uring_cqe* m_cqes = nullptr;
+	struct io_uring_buf* m_bufferRing = nullptr;
+	size_t m_bufferRingSize = 0;
+	std::vector<unsigned char> m_buffers;
+	unsigned m_bufferSize = 0;
+	unsigned m_bufferMask = 0;
+	fmx::uint16 m_bufferTail = 0;
+	size_t m_enters = 0;
+};
+#endif
+
+static const char* rcodeName(int rcode)
+{
+	switch (rcode) {
+	case ns_r_noerror: return "NOERROR";
+	case ns_r_formerr: return "FORMERR";
+	case ns_r_servfail: return "SERVFAIL";
+	case ns_r_nxdomain: return "NXDOMAIN";
+	case ns_r_notimpl: return "NOTIMP";
+	case ns_r_refused: return "REFUSED";
+	default: return "ERROR";
+	}
+}
+
+struct BulkResult {
+	size_t names = 0;
+	size_t answered = 0;          // names that got a response (of any rcode)
+	size_t timeouts = 0;
+	size_t invalid = 0;           // names that cannot be queried
+	size_t retransmits = 0;
+	size_t queries = 0;           // datagrams sent, retransmissions included
+	size_t syscalls = 0;          // made by the event loop
+	const char* backend = "";
+	double seconds = 0;
+
+	struct Server {
+		size_t queries = 0;
+		size_t timeouts = 0;
+		size_t errors = 0;        // SERVFAIL and REFUSED answers
+		size_t window = 0;        // at the end
+		size_t peakWindow = 0;
+		size_t cuts = 0;          // times the window was halved
+		double srttMs = 0;
+		double minRttMs = 0;
+	};
+	std::vector<Server> servers;
+};
+
+// Resolves names of one type through UDP servers (given as socket addresses), keeping up to
+// maxInFlight queries outstanding; timeoutMs is the retransmit timeout
+class BulkResolver {
+public:
+	BulkResolver(const std::vector<std::pair<struct sockaddr_storage, socklen_t>>& servers, int type, size_t maxInFlight, int timeoutMs,
+				 BulkJob& job)
+		: m_type(type), m_maxInFlight(maxInFlight), m_timeout(std::chrono::milliseconds(timeoutMs)), m_job(job),
+		  m_receiveBuffers(BULK_BATCH * BULK_RESPONSE_SIZE)
+	{
+		std::shared_ptr<const ChannelOptions> options = channelOptions();
+		int sendBuffer = options->socketSendBuffer > 0 ? options->socketSendBuffer : BULK_SOCKET_BUFFER;
+		int receiveBuffer = options->socketReceiveBuffer > 0 ? options->socketReceiveBuffer : BULK_SOCKET_BUFFER;
+		for (size_t server = 0; server < servers.size(); ++server) {
+			for (int i = 0; i < BULK_SOCKETS_PER_SERVER; ++i) {
+				int fd = socket(servers[server].first.ss_family, SOCK_DGRAM, 0);
+				if (fd < 0)
+					continue;
+				setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+				setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+				if (!setNonBlocking(fd) || connect(fd, reinterpret_cast<const struct sockaddr*>(&servers[server].first), servers[server].second) != 0) {
+					close(fd);
+					continue;
+				}
+				m_sockets.emplace_back(new Socket);
+				Socket& added = *m_sockets.back();
+				added.fd = fd;
+				added.index = m_sockets.size() - 1;
+				added.server = server;
+			}
+		}
+		// The sockets of a server hold maxInFlight queries between them, as the queries in flight
+		// may all go to one server
+		std::vector<size_t> socketCount(servers.size());
+		for (const auto& socket : m_sockets)
+			socketCount[socket->server]++;
+		for (const auto& socket : m_sockets) {
+			size_t capacity = BULK_BATCH;
+			while (capacity < 65536 && capacity * socketCount[socket->server] < maxInFlight)
+				capacity <<= 1;
+			socket->slots.resize(capacity);
+			socket->freeIds.resize(capacity);
+			socket->freeCount = static_cast<fmx::uint32>(capacity);
+			socket->mask = static_cast<fmx::uint16>(capacity - 1);
+			for (size_t index = 0; index < capacity; ++index)
+				socket->freeIds[index] = randomId(*socket, static_cast<fmx::uint16>(index));
+			std::shuffle(socket->freeIds.begin(), socket->freeIds.end(), m_random);
+		}
+		// Servers none of whose sockets could be opened (an IPv6 server on a host without IPv6)
+		// get no retransmissions either
+		std::vector<bool> reachable(servers.size());
+		for (const auto& socket : m_sockets)
+			reachable[socket->server] = true;
+		m_serverCount = static_cast<size_t>(std::count(reachable.begin(), reachable.end(), true));
+		m_servers.resize(servers.size());
+		m_qps = options->serverQps;
+		for (Server& server : m_servers)
+			server.window = static_cast<double>(std::min<size_t>(BULK_INITIAL_WINDOW, maxInFlight));
+#ifdef FDNS_IO_URING
+		if (options->ioUring && !m_sockets.empty())
+			startRing();
+#endif
+	}
+
+	~BulkResolver()
+	{
+		for (auto& socket : m_sockets)
+			close(socket->fd);
+	}
+
+	BulkResolver(const BulkResolver&) = delete;
+	BulkResolver& operator=(const BulkResolver&) = delete;
+
+	// Writes one line per name to output; false if no socket could be opened
+	bool run(const std::vector<std::string>& names, FILE* output, BulkResult& result)
+	{
+		if (m_sockets.empty())
+			return false;
+		m_names = &names;
+		m_output = output;
+		m_result = &result;
+		result.names = names.size();
+#if defined(FDNS_IO_URING)
+		result.backend = m_ring ? "io_uring" : "sendmmsg";
+#elif defined(__linux__)
+		result.backend = "sendmmsg";
+#else
+		result.backend = "send";
+#endif
+		result.servers.resize(m_servers.size());
+		auto started = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < m_servers.size(); ++i) {
+			m_servers[i].result = &result.servers[i];
+			m_servers[i].tokens = burst();
+			m_servers[i].refilled = started;
+			result.servers[i].window = result.servers[i].peakWindow = static_cast<size_t>(m_servers[i].window);
+		}
+		publishWindow();
+		m_timers.schedule(m_flushTimer, started + std::chrono::milliseconds(BULK_FLUSH_INTERVAL));
+		size_t completed = 0;
+		m_completed = &completed;
+
+		while (completed < names.size()) {
+			auto now = std::chrono::steady_clock::now();
+			m_timers.advance(now, [this](TimerWheel::Timer& timer) { expire(timer); });
+			// What the scheduler leaves this job next to the interactive calls and other sessions
+			size_t queued = names.size() - m_nextName + m_retry.size();
+			m_job.queued = queued;
+			m_job.inFlight = m_inFlight;
+			m_job.demand = std::min(std::min(m_maxInFlight, m_window), m_inFlight + queued);
+			size_t share = g_scheduler.bulkShare(m_job);
+			m_limit = share != 0 ? std::min(share, m_maxInFlight) : m_maxInFlight;
+			bool sent = false;
+			for (size_t i = 0; i < m_sockets.size(); ++i)
+				sent |= fill(*m_sockets[(m_nextSocket + i) % m_sockets.size()], now);
+			m_nextSocket = (m_nextSocket + 1) % m_sockets.size();
+
+			// Wait for replies, or until the next timer fires. Queued retransmissions that found no
+			// room (all slots or socket buffers in use) are tried again after a millisecond.
+			int waitMs = 0;
+			if (!sent) {
+				waitMs = 1;
+				if (m_retry.empty()) {
+					auto due = m_timers.nextExpiry() - now;
+					waitMs = static_cast<int>(std::max<fmx::int64>(0, std::chrono::duration_cast<std::chrono::milliseconds>(due).count() + 1));
+				}
+			}
+			if (!wait(waitMs))
+				return false;
+		}
+		m_timers.cancel(m_flushTimer);
+		for (Server& server : m_servers) {
+			m_timers.cancel(server.refill);
+			server.result->srttMs = server.srttMs;
+			server.result->minRttMs = server.minRttMs;
+		}
+		fflush(output);
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+#ifdef FDNS_IO_URING
+		if (m_ring)
+			result.syscalls += m_ring->enters();
+#endif
+		return true;
+	}
+
+private:
+	enum TimerKind { kQueryTimer, kRefillTimer, kFlushTimer };
+
+	// A timer of m_timers that tells expire() what it is for
+	struct BulkTimer : TimerWheel::Timer {
+		TimerKind kind;
+		explicit BulkTimer(TimerKind timerKind = kQueryTimer) : kind(timerKind) {}
+	};
+
+	// A query in flight, found by its socket and ID; the timer fires when it is retransmitted
+	struct Slot : BulkTimer {
+		fmx::uint32 name = 0;
+		fmx::uint32 socket = 0;    // index in m_sockets
+		fmx::uint16 id = 0;        // of the query
+		fmx::uchar tries = 0;
+		bool used = false;
+		bool overdue = false;      // counted as lost and taken out of its server's window
+		std::chrono::steady_clock::time_point sent;
+	};
+
+	struct Socket {
+		int fd = -1;
+		size_t index = 0;          // in m_sockets, and among the files registered with m_ring
+		size_t server = 0;
+		// A query's ID selects its slot by its low bits, the others are random. The tables are sized
+		// for maxInFlight rather than for all 65536 IDs.
+		std::vector<Slot> slots;
+		std::vector<fmx::uint16> freeIds; // ring buffer
+		fmx::uint16 mask = 0;      // slots.size() - 1
+		fmx::uint32 freeHead = 0;
+		fmx::uint32 freeCount = 0;
+		std::vector<unsigned char> sendBuffers = std::vector<unsigned char>(BULK_BATCH * BULK_QUERY_SIZE);
+		int pendingSends = 0;      // io_uring sends from sendBuffers not completed yet
+		size_t inFlight = 0;       // slots used
+
+		Slot& slot(fmx::uint16 id) { return slots[id & mask]; }
+	};
+
+	// A query ID for the slot at index, with random upper bits
+	fmx::uint16 randomId(const Socket& socket, fmx::uint16 index)
+	{
+		return static_cast<fmx::uint16>((m_random() & ~static_cast<fmx::uint32>(socket.mask)) | index);
+	}
+
+	// Congestion control of one server; a round ends after a window's worth of outcomes
+	struct Server {
+		double window = BULK_INITIAL_WINDOW;  // queries in flight at most
+		bool slowStart = true;         // the window doubles every round until it is first cut
+		bool windowFull = false;       // sends waited for the window during this round
+		size_t inFlight = 0;           // not overdue
+		std::chrono::steady_clock::time_point cut; // when the window was last cut
+		size_t outcomes = 0;           // of the round: replies and timeouts
+		size_t timeouts = 0;
+		size_t errors = 0;
+		size_t rttSamples = 0;
+		double rttSumMs = 0;
+		double srttMs = 0;
+		double rttvarMs = 0;
+		double minRttMs = 0;
+		double tokens = 0;             // serverQps token bucket
+		std::chrono::steady_clock::time_point refilled;
+		BulkTimer refill { kRefillTimer }; // wakes the loop when the bucket has tokens for a batch again
+		BulkResult::Server* result = nullptr;
+	};
+
+	struct Retry {
+		fmx::uint32 name;
+		fmx::uchar tries;
+		size_t server;             // the server that timed out, m_servers.size() for none
+	};
+
+	void release(Socket& socket, fmx::uint16 id)
+	{
+		Slot& slot = socket.slot(id);
+		m_timers.cancel(slot);
+		if (!slot.overdue)
+			m_servers[socket.server].inFlight--;
+		slot.used = false;
+		slot.overdue = false;
+		socket.freeIds[(socket.freeHead + socket.freeCount) & socket.mask] = randomId(socket, id & socket.mask);
+		socket.freeCount++;
+		socket.inFlight--;
+		m_inFlight--;
+	}
+
+	// Counts the outcome of a query sent to the server at sent (answered after rttMs, -1 if it was
+	// not) and, at the end of a round, halves the window if the server showed signs of overload, or
+	// else grows it if it was the limit
+	void account(size_t index, std::chrono::steady_clock::time_point sent, bool timedOut, bool error, double rttMs = -1)
+	{
+		Server& server = m_servers[index];
+		server.result->timeouts += timedOut ? 1 : 0;
+		server.result->errors += error ? 1 : 0;
+		if (sent < server.cut)
+			return; // the window it was sent with has been cut already, and so was its RTT
+		server.outcomes++;
+		server.timeouts += timedOut ? 1 : 0;
+		server.errors += error ? 1 : 0;
+		if (rttMs >= 0) {
+			server.rttSamples++;
+			server.rttSumMs += rttMs;
+		}
+		if (server.outcomes < std::max<double>(server.window, BULK_MIN_ROUND))
+			return;
+		double averageMs = server.rttSamples ? server.rttSumMs / server.rttSamples : 0;
+		bool overloaded = server.timeouts * 100 > server.outcomes * BULK_LOSS_PERCENT ||
+						  server.errors * 100 > server.outcomes * BULK_ERROR_PERCENT ||
+						  (server.rttSamples && averageMs > server.minRttMs * BULK_RTT_INFLATION + BULK_RTT_SLACK);
+		if (overloaded) {
+			server.window = std::max<double>(server.window / 2, BULK_MIN_WINDOW);
+			server.slowStart = false;
+			server.cut = std::chrono::steady_clock::now();
+			server.result->cuts++;
+		} else if (server.windowFull) {
+			server.window = std::min<double>(server.slowStart ? server.window * 2 : server.window + BULK_WINDOW_INCREASE, m_maxInFlight);
+		}
+		server.outcomes = server.timeouts = server.errors = server.rttSamples = 0;
+		server.rttSumMs = 0;
+		server.windowFull = false;
+		server.result->window = static_cast<size_t>(server.window);
+		server.result->peakWindow = std::max(server.result->peakWindow, server.result->window);
+		publishWindow();
+	}
+
+	void publishWindow()
+	{
+		double window = 0;
+		for (const Server& server : m_servers)
+			window += server.window;
+		m_window = static_cast<size_t>(window);
+		m_job.window = m_window;
+	}
+
+	// Queries the serverQps token bucket may send at once
+	double burst() const
+	{
+		return std::max(1.0, m_qps * BULK_QPS_BURST / 1000.0);
+	}
+
+	void complete(fmx::uint32 name, const char* status, const std::string& records)
+	{
+		fprintf(m_output, "%s\t%s\t%s\n", (*m_names)[name].c_str(), status, records.c_str());
+		(*m_completed)++;
+	}
+
+	// Queues a retransmission of a query that got no answer; one out of tries times out
+	void fail(Socket& socket, fmx::uint16 id)
+	{
+		Slot& slot = socket.slot(id);
+		fmx::uint32 name = slot.name;
+		fmx::uchar tries = slot.tries;
+		auto sent = slot.sent;
+		bool counted = slot.overdue;
+		release(socket, id);
+		if (!counted)
+			account(socket.server, sent, true, false);
+		if (tries >= BULK_TRIES) {
+			m_result->timeouts++;
+			complete(name, "TIMEOUT", std::string());
+		} else {
+			m_result->retransmits++;
+			m_retry.push_back({ name, tries, socket.server });
+		}
+	}
+
+	void expire(TimerWheel::Timer& timer)
+	{
+		switch (static_cast<BulkTimer&>(timer).kind) {
+		case kFlushTimer:
+			fflush(m_output);
+			m_timers.schedule(m_flushTimer, std::chrono::steady_clock::now() + std::chrono::milliseconds(BULK_FLUSH_INTERVAL));
+			return;
+		case kRefillTimer:
+			return; // the next fill() takes the new tokens
+		case kQueryTimer:
+			break;
+		}
+		Slot& slot = static_cast<Slot&>(timer);
+		Socket& socket = *m_sockets[slot.socket];
+		auto timeout = slot.sent + m_timeout;
+		if (!slot.overdue && std::chrono::steady_clock::now() < timeout) {
+			slot.overdue = true;
+			m_servers[socket.server].inFlight--;
+			account(socket.server, slot.sent, true, false);
+			m_timers.schedule(slot, timeout);
+			return;
+		}
+		fail(socket, slot.id);
+	}
+
+	// Sends a batch of retransmissions and new names on the socket; true if anything was sent
+	bool fill(Socket& socket, std::chrono::steady_clock::time_point now)
+	{
+		if (socket.pendingSends > 0)
+			return false; // the buffers of the last batch are still in use
+		struct iovec datagrams[BULK_BATCH];
+		fmx::uint16 ids[BULK_BATCH];
+		int count = 0;
+		bool retriesElsewhere = false; // all queued retransmissions are for other servers
+		Server& server = m_servers[socket.server];
+		if (m_qps > 0) {
+			server.tokens = std::min(burst(), server.tokens + std::chrono::duration<double>(now - server.refilled).count() * m_qps);
+			server.refilled = now;
+		}
+		while (count < BULK_BATCH && m_inFlight < m_limit && socket.freeCount > 0) {
+			if (server.inFlight >= server.window) {
+				server.windowFull = true;
+				break;
+			}
+			if (m_qps > 0 && server.tokens < count + 1) {
+				// Woken when there are tokens for a batch again
+				if (!server.refill.scheduled()) {
+					double wanted = std::min<double>(burst(), BULK_BATCH) - server.tokens;
+					m_timers.schedule(server.refill, now + std::chrono::microseconds(static_cast<fmx::int64>(wanted * 1000000 / m_qps)));
+				}
+				break;
+			}
+			fmx::uint32 name;
+			fmx::uchar tries = 0;
+			auto retry = m_retry.end();
+			if (!retriesElsewhere) {
+				retry = std::find_if(m_retry.begin(), m_retry.end(), [this, &socket](const Retry& r) {
+					return m_serverCount < 2 || r.server != socket.server;
+				});
+				retriesElsewhere = retry == m_retry.end();
+			}
+			if (retry != m_retry.end()) {
+				name = retry->name;
+				tries = retry->tries;
+				m_retry.erase(retry);
+			} else if (m_nextName < m_names->size()) {
+				name = static_cast<fmx::uint32>(m_nextName++);
+			} else {
+				break;
+			}
+			fmx::uint16 id = socket.freeIds[socket.freeHead];
+			socket.freeHead = (socket.freeHead + 1) & socket.mask;
+			socket.freeCount--;
+			unsigned char* buffer = &socket.sendBuffers[static_cast<size_t>(count) * BULK_QUERY_SIZE];
+			size_t length = encodeBulkQuery((*m_names)[name], m_type, id, buffer);
+			if (length == 0) {
+				socket.freeHead = (socket.freeHead - 1) & socket.mask;
+				socket.freeCount++;
+				m_result->invalid++;
+				complete(name, "INVALID", std::string());
+				continue;
+			}
+			Slot& slot = socket.slot(id);
+			slot.id = id;
+			slot.name = name;
+			slot.socket = static_cast<fmx::uint32>(socket.index);
+			slot.tries = static_cast<fmx::uchar>(tries + 1);
+			slot.used = true;
+			slot.sent = now;
+			socket.inFlight++;
+			server.inFlight++;
+			m_inFlight++;
+			datagrams[count].iov_base = buffer;
+			datagrams[count].iov_len = length;
+			ids[count++] = id;
+		}
+		if (count == 0)
+			return false;
+
+		int sent = transmit(socket, datagrams, count, ids);
+		std::chrono::steady_clock::duration overdueAfter = m_timeout;
+		if (server.srttMs > 0)
+			overdueAfter = std::min(overdueAfter, std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double, std::milli>(std::max(server.srttMs + 4 * server.rttvarMs, 2 * server.srttMs) + BULK_RTT_SLACK)));
+		// A closed port on the server (reported for an earlier datagram) fails the batch at once
+		bool refused = sent < 0 && errno == ECONNREFUSED;
+		if (sent < 0 && !refused && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+			sent = count; // the queries time out and go to the next server
+		m_result->queries += static_cast<size_t>(std::max(sent, 0));
+		server.result->queries += static_cast<size_t>(std::max(sent, 0));
+		server.tokens -= std::max(sent, 0);
+		for (int i = 0; i < count; ++i) {
+			Slot& slot = socket.slot(ids[i]);
+			if (refused) {
+				fail(socket, ids[i]);
+			} else if (i < sent) {
+				m_timers.schedule(slot, now + overdueAfter);
+			} else {
+				// The socket buffer is full: send it again later, without using up a try
+				m_retry.push_front({ slot.name, static_cast<fmx::uchar>(slot.tries - 1), m_servers.size() });
+				release(socket, ids[i]);
+			}
+		}
+		return sent > 0 || refused;
+	}
+
+	// Sends the datagrams (queries with the IDs ids), or queues them on m_ring; returns how many
+	// were sent, -1 on errors
+	int transmit(Socket& socket, struct iovec* datagrams, int count, const fmx::uint16* ids)
+	{
+#ifdef FDNS_IO_URING
+		if (m_ring) {
+			int queued = 0;
+			for (; queued < count; ++queued) {
+				struct io_uring_sqe* sqe = m_ring->next();
+				if (!sqe)
+					break;
+				sqe->opcode = IORING_OP_SEND;
+				sqe->fd = static_cast<__s32>(socket.index);
+				sqe->flags = IOSQE_FIXED_FILE;
+				sqe->addr = reinterpret_cast<uintptr_t>(datagrams[queued].iov_base);
+				sqe->len = static_cast<__u32>(datagrams[queued].iov_len);
+				sqe->user_data = static_cast<__u64>(ids[queued]) << 32 | socket.index << 1 | 1;
+				socket.pendingSends++;
+			}
+			return queued;
+		}
+#endif
+		return sendDatagrams(socket.fd, datagrams, count, m_result->syscalls);
+	}
+
+	// Waits up to waitMs for replies and handles them
+	bool wait(int waitMs)
+	{
+#ifdef FDNS_IO_URING
+		if (m_ring) {
+			// One system call submits the queued sends, waits and hands back the replies
+			if (!m_ring->enter(1, waitMs))
+				return false;
+			m_ring->reap([this](const struct io_uring_cqe& completion) { handleCompletion(completion); });
+			return true;
+		}
+#endif
+		std::vector<struct pollfd> pollFds;
+		for (auto& socket : m_sockets)
+			pollFds.push_back({ socket->fd, POLLIN, 0 });
+		m_result->syscalls++;
+		if (poll(pollFds.data(), pollFds.size(), waitMs) < 0 && errno != EINTR)
+			return false;
+		// Reading also clears a socket error (an ICMP port unreachable), which poll keeps reporting
+		for (size_t i = 0; i < m_sockets.size(); ++i) {
+			if (pollFds[i].revents & (POLLIN | POLLERR))
+				drain(*m_sockets[i]);
+		}
+		return true;
+	}
+
+#ifdef FDNS_IO_URING
+	// Moves the sockets to io_uring if the kernel has multishot receives and provided buffer rings
+	void startRing()
+	{
+		unsigned entries = 1;
+		while (entries < std::min<size_t>(m_sockets.size() * (BULK_BATCH + 1), BULK_RING_ENTRIES))
+			entries <<= 1;
+		std::unique_ptr<IoUring> ring(new IoUring);
+		std::vector<int> fds;
+		for (const auto& socket : m_sockets)
+			fds.push_back(socket->fd);
+		if (!ring->open(entries, BULK_RING_COMPLETIONS) || !ring->registerFiles(fds) ||
+			!ring->provideBuffers(BULK_RING_BUFFERS, BULK_RESPONSE_SIZE))
+			return;
+		for (const auto& socket : m_sockets) {
+			if (!armReceive(*ring, *socket))
+				return;
+		}
+		// Kernels without multishot receives reject them at once
+		bool supported = ring->enter(0, 0);
+		ring->reap([&supported](const struct io_uring_cqe& completion) {
+			if (completion.res == -EINVAL)
+				supported = false;
+		});
+		if (supported)
+			m_ring = std::move(ring);
+	}
+
+	bool armReceive(IoUring& ring, const Socket& socket)
+	{
+		struct io_uring_sqe* sqe = ring.next();
+		if (!sqe)
+			return false;
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = static_cast<__s32>(socket.index);
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->buf_group = 0;
+		sqe->user_data = socket.index << 1;
+		return true;
+	}
+
+	void handleCompletion(const struct io_uring_cqe& completion)
+	{
+		Socket& socket = *m_sockets[(completion.user_data & 0xffffffff) >> 1];
+		if (completion.user_data & 1) {
+			// Other failed sends time out and are sent again
+			socket.pendingSends--;
+			fmx::uint16 id = static_cast<fmx::uint16>(completion.user_data >> 32);
+			if (completion.res == -ECONNREFUSED && socket.slot(id).used && socket.slot(id).id == id)
+				fail(socket, id);
+			return;
+		}
+		if (completion.flags & IORING_CQE_F_BUFFER) {
+			fmx::uint16 id = static_cast<fmx::uint16>(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+			if (completion.res > 0)
+				handleReply(socket, m_ring->buffer(id), static_cast<size_t>(completion.res));
+			m_ring->recycle(id);
+		}
+		if (completion.res == -ECONNREFUSED)
+			refuse(socket);
+		// The receive stops on errors, e.g. when it ran out of buffers
+		if (!(completion.flags & IORING_CQE_F_MORE))
+			armReceive(*m_ring, socket);
+	}
+#endif
+
+	// The server's port is closed (an ICMP port unreachable came back): the queries waiting on the
+	// socket go to the next server at once
+	void refuse(Socket& socket)
+	{
+		for (size_t index = 0; index < socket.slots.size() && socket.inFlight > 0; ++index) {
+			if (socket.slots[index].used)
+				fail(socket, socket.slots[index].id);
+		}
+	}
+
+	// Reads the replies queued on the socket and completes their queries
+	void drain(Socket& socket)
+	{
+		struct iovec buffers[BULK_BATCH];
+		size_t lengths[BULK_BATCH];
+		for (int i = 0; i < BULK_BATCH; ++i) {
+			buffers[i].iov_base = &m_receiveBuffers[static_cast<size_t>(i) * BULK_RESPONSE_SIZE];
+			buffers[i].iov_len = BULK_RESPONSE_SIZE;
+		}
+		int received;
+		while ((received = receiveDatagrams(socket.fd, buffers, lengths, BULK_BATCH, m_result->syscalls)) != 0) {
+			if (received < 0) {
+				if (errno == ECONNREFUSED)
+					refuse(socket);
+				break;
+			}
+			for (int i = 0; i < received; ++i)
+				handleReply(socket, static_cast<const unsigned char*>(buffers[i].iov_base), lengths[i]);
+			if (received < BULK_BATCH)
+				break;
+		}
+	}
+
+	void handleReply(Socket& socket, const unsigned char* reply, size_t length)
+	{
+		if (length < NS_HFIXEDSZ || !(reply[2] & 0x80))
+			return;
+		fmx::uint16 id = static_cast<fmx::uint16>(reply[0] << 8 | reply[1]);
+		Slot& slot = socket.slot(id);
+		if (!slot.used || slot.id != id)
+			return;
+		unsigned char query[BULK_QUERY_SIZE];
+		size_t queryLength = encodeBulkQuery((*m_names)[slot.name], m_type, id, query);
+		std::string response(reinterpret_cast<const char*>(reply), length);
+		// The question, without the OPT record
+		if (!sameQuestion(std::string(reinterpret_cast<const char*>(query), queryLength - 11), response))
+			return;
+		fmx::uint32 name = slot.name;
+		Server& server = m_servers[socket.server];
+		double rttMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - slot.sent).count();
+		if (server.srttMs == 0) {
+			server.srttMs = rttMs;
+			server.rttvarMs = rttMs / 2;
+		} else {
+			server.rttvarMs += (std::fabs(rttMs - server.srttMs) - server.rttvarMs) / 4;
+			server.srttMs += (rttMs - server.srttMs) / 8;
+		}
+		server.minRttMs = server.minRttMs == 0 ? rttMs : std::min(server.minRttMs, rttMs);
+		auto sent = slot.sent;
+		bool counted = slot.overdue; // as lost, when it took longer than the RTO
+		release(socket, id);
+		int rcode = reply[3] & 0x0f;
+		if (!counted)
+			account(socket.server, sent, false, rcode == ns_r_servfail || rcode == ns_r_refused, rttMs);
+		m_result->answered++;
+		DNSRecords records;
+		decodeResponse(response, records);
+		std::vector<std::string> values;
+		for (auto& record : records) {
+			std::replace(record.second.begin(), record.second.end(), '\t', ' ');
+			std::replace(record.second.begin(), record.second.end(), '\n', ' ');
+			values.push_back(record.second);
+		}
+		complete(name, (reply[2] & 0x02) && values.empty() ? "TRUNCATED" : rcodeName(rcode), joinValues(values));
+	}
+
+	const int m_type;
+	const size_t m_maxInFlight;
+	const std::chrono::milliseconds m_timeout;
+	BulkJob& m_job;
+	size_t m_limit = 0;               // queries in flight at most: m_maxInFlight or the scheduler's share
+	size_t m_window = 0;              // the servers' windows together
+	std::vector<std::unique_ptr<Socket>> m_sockets;
+	size_t m_serverCount = 0;         // servers with at least one open socket
+	size_t m_nextSocket = 0;
+	std::mt19937 m_random { std::random_device{}() }; // query IDs
+	std::vector<unsigned char> m_receiveBuffers;
+	TimerWheel m_timers;              // the retransmission timers of the slots, and m_flushTimer
+	BulkTimer m_flushTimer { kFlushTimer }; // flushes the output file every BULK_FLUSH_INTERVAL
+	std::deque<Retry> m_retry;
+	std::vector<Server> m_servers;
+	int m_qps = 0;                    // serverQps, 0 = no limit
+	const std::vector<std::string>* m_names = nullptr;
+	size_t m_nextName = 0;
+	size_t m_inFlight = 0;
+	FILE* m_output = nullptr;
+	BulkResult* m_result = nullptr;
+	size_t* m_completed = nullptr;
+#ifdef FDNS_IO_URING
+	std::unique_ptr<IoUring> m_ring;  // nullptr: sendmmsg/recvmmsg and poll
+#endif
+};
+
+// CPU time used by the calling thread (the whole process where threads are not measured)
+static double threadCpuSeconds()
+{
+	struct rusage usage;
+#ifdef RUSAGE_THREAD
+	if (getrusage(RUSAGE_THREAD, &usage) != 0)
+#else
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+#endif
+		return 0;
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Resolves the names in inputPath (one per line; blank lines and lines starting with '#' are
+// skipped) through dnsServer's UDP servers and writes the results to outputPath
+static fmx::errcode resolveBulk(const std::string& dnsServer, const std::string& inputPath, const std::string& outputPath,
+								int type, int maxInFlight, fmx::ptrtype owner, std::string& json)
+{
+	std::vector<std::pair<struct sockaddr_storage, socklen_t>> servers;
+	std::vector<std::string> serverNames;
+	for (const auto& server : splitServerList(dnsServer)) {
+		Transport transport;
+		std::string endpoint, authName;
+		std::pair<struct sockaddr_storage, socklen_t> address;
+		if (parseServer(server, transport, endpoint, authName) && transport == kTransportUdp &&
+			parseEndpoint(endpoint, DNS_PORT, address.first, address.second)) {
+			servers.push_back(address);
+			serverNames.push_back(server);
+		}
+	}
+	if (servers.empty())
+		return 1;
+
+	std::vector<std::string> names;
+	FILE* input = fopen(inputPath.c_str(), "r");
+	if (!input)
+		return 1;
+	// Whole lines, however long: a name longer than 253 characters stays one name and is reported
+	// as INVALID instead of being split into several
+	char* line = nullptr;
+	size_t capacity = 0;
+	ssize_t length;
+	while ((length = getline(&line, &capacity, input)) >= 0) {
+		std::string name(line, static_cast<size_t>(length));
+		name.erase(name.find_last_not_of(" \t\r\n") + 1);
+		name.erase(0, name.find_first_not_of(" \t"));
+		if (name.empty() || name[0] == '#')
+			continue;
+		if (name.size() > 1 && name.back() == '.')
+			name.pop_back();
+		names.push_back(name);
+	}
+	free(line);
+	fclose(input);
+
+	FILE* output = fopen(outputPath.c_str(), "w");
+	if (!output)
+		return 1;
+	setvbuf(output, nullptr, _IOFBF, 1 << 20);
+	int timeoutMs = channelOptions()->timeoutMs > 0 ? channelOptions()->timeoutMs : static_cast<int>(INITIAL_RTO);
+	std::shared_ptr<BulkJob> job = g_scheduler.startBulk(owner);
+	BulkResolver resolver(servers, type, static_cast<size_t>(maxInFlight), timeoutMs, *job);
+	BulkResult result;
+	double cpuStarted = threadCpuSeconds();
+	bool ok = resolver.run(names, output, result);
+	g_scheduler.finishBulk(job);
+	double cpuSeconds = threadCpuSeconds() - cpuStarted;
+	fclose(output);
+	if (!ok)
+		return 1;
+
+	json = "{\"names\":" + std::to_string(result.names) + ",\"answered\":" + std::to_string(result.answered);
+	json += ",\"timeouts\":" + std::to_string(result.timeouts) + ",\"invalid\":" + std::to_string(result.invalid);
+	json += ",\"retransmits\":" + std::to_string(result.retransmits);
+	json += ",\"durationMs\":" + std::to_string(static_cast<fmx::uint64>(result.seconds * 1000));
+	json += ",\"queriesPerSecond\":" + std::to_string(static_cast<fmx::uint64>(result.seconds > 0 ? (result.names - result.invalid) / result.seconds : 0));
+	// What the event loop cost, to compare the io_uring and sendmmsg backends
+	char cost[96];
+	snprintf(cost, sizeof(cost), ",\"syscallsPerQuery\":%.3f,\"cpuMsPer10kQueries\":%.1f",
+			 result.queries ? static_cast<double>(result.syscalls) / result.queries : 0.0,
+			 result.queries ? cpuSeconds * 1000 * 10000 / result.queries : 0.0);
+	json += std::string(",\"backend\":\"") + result.backend + "\",\"queries\":" + std::to_string(result.queries);
+	json += ",\"syscalls\":" + std::to_string(result.syscalls) + cost;
+	// The congestion window each server settled at
+	json += ",\"servers\":[";
+	for (size_t i = 0; i < result.servers.size(); ++i) {
+		const BulkResult::Server& server = result.servers[i];
+		char rtt[64];
+		snprintf(rtt, sizeof(rtt), ",\"srttMs\":%.2f,\"minRttMs\":%.2f", server.srttMs, server.minRttMs);
+		json += std::string(i ? "," : "") + "{\"server\":\"" + serverNames[i] + "\"";
+		json += ",\"queries\":" + std::to_string(server.queries) + ",\"timeouts\":" + std::to_string(server.timeouts);
+		json += ",\"errors\":" + std::to_string(server.errors) + ",\"window\":" + std::to_string(server.window);
+		json += ",\"peakWindow\":" + std::to_string(server.peakWindow) + ",\"windowCuts\":" + std::to_string(server.cuts);
+		json += std::string(rtt) + "}";
+	}
+	json += "]}";
+	return 0;
+}
+
+// Local zone ==============================================================================
+//
+// Fixed names (printers, PLCs, lab hosts) answered from a file before any network path, so they
+// resolve even when DNS is down. The file may mix hosts-format lines ("10.1.2.3 printer1 p1")
+// and zone-format records ("printer1 3600 IN A 10.1.2.3", with $ORIGIN and $TTL); hosts lines
+// also give their address a reverse (PTR) name. The names are compiled into a minimal perfect
+// hash (CHD: hash, displace and compress) with every answer rendered in advance, so a lookup
+// costs one hash, one displacement and one name comparison. The file is checked for changes
+// from Do_PluginIdle and the table is replaced as a whole.
+
+#define LOCAL_ZONE_BUCKET_SIZE 4           // average names per CHD bucket
+#define LOCAL_ZONE_MAX_DISPLACEMENT (1 << 24)
+#define LOCAL_ZONE_CHECK_INTERVAL 2000     // ms between checks of the file for changes
+#define MAX_LOCAL_CNAME_CHAIN 8
+
+struct LocalName {
+	std::string name;                  // lowercased, without the trailing dot
+	DNSRecords records;
+	std::string ipv4, ipv6, addresses; // A, AAAA and both, joined as by fDNS_Resolve(...; allAddresses)
+	std::string cname;                 // target of the CNAME record
+	std::string ptr;                   // first PTR record
+	std::string json;                  // records array of fDNS_Resolve_Extended
+};
+
+// Spreads the bits of a name hash, so that the bucket does not depend on the slot hash
+static fmx::uint64 mixHash(fmx::uint64 hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	return hash ^ (hash >> 33);
+}
+
+class LocalZone {
+public:
+	// Compiles the names into the table; false if no displacement fits a bucket
+	bool build(std::vector<LocalName>&& names)
+	{
+		size_t n = names.size();
+		if (n == 0)
+			return true;
+		size_t bucketCount = n / LOCAL_ZONE_BUCKET_SIZE + 1;
+		std::vector<std::vector<size_t>> buckets(bucketCount);
+		std::vector<fmx::uint64> hashes(n);
+		for (size_t i = 0; i < n; ++i) {
+			hashes[i] = hashKey(names[i].name);
+			buckets[reduce(mixHash(hashes[i]), bucketCount)].push_back(i);
+		}
+		std::vector<size_t> order(bucketCount);
+		for (size_t b = 0; b < bucketCount; ++b)
+			order[b] = b;
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+		// Largest buckets first: find a displacement that puts all of a bucket's names into free slots
+		std::vector<bool> taken(n, false);
+		std::vector<size_t> slotOf(n);
+		m_displacements.assign(bucketCount, 0);
+		std::vector<size_t> slots;
+		for (size_t b : order) {
+			if (buckets[b].empty())
+				break;
+			fmx::uint32 displacement = 0;
+			for (; displacement < LOCAL_ZONE_MAX_DISPLACEMENT; ++displacement) {
+				slots.clear();
+				for (size_t i : buckets[b]) {
+					size_t slot = slotFor(hashes[i], displacement, n);
+					if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end())
+						break;
+					slots.push_back(slot);
+				}
+				if (slots.size() == buckets[b].size())
+					break;
+			}
+			if (displacement == LOCAL_ZONE_MAX_DISPLACEMENT)
+				return false;
+			m_displacements[b] = displacement;
+			for (size_t k = 0; k < slots.size(); ++k) {
+				taken[slots[k]] = true;
+				slotOf[buckets[b][k]] = slots[k];
+			}
+		}
+
+		m_names.resize(n);
+		m_hashes.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			m_names[slotOf[i]] = std::move(names[i]);
+			m_hashes[slotOf[i]] = hashes[i];
+		}
+		return true;
+	}
+
+	// The entry of name (any case, trailing dot allowed), nullptr if it is not in the zone
+	const LocalName* find(const std::string& name) const
+	{
+		if (m_names.empty())
+			return nullptr;
+		size_t length = name.size() > 1 && name.back() == '.' ? name.size() - 1 : name.size();
+		fmx::uint64 hash = 14695981039346656037ULL; // hashKey() of the name without the dot
+		for (size_t i = 0; i < length; ++i) {
+			hash ^= asciiLower(name[i]);
+			hash *= 1099511628211ULL;
+		}
+		fmx::uint32 displacement = m_displacements[reduce(mixHash(hash), m_displacements.size())];
+		size_t slot = slotFor(hash, displacement, m_names.size());
+		// Other names land on some slot too: the hash rejects them without touching the entry
+		if (m_hashes[slot] != hash)
+			return nullptr;
+		const LocalName& entry = m_names[slot];
+		if (entry.name.size() != length || !std::equal(entry.name.begin(), entry.name.end(), name.begin(), [](char x, char y) {
+				return x == asciiLower(y);
+			}))
+			return nullptr;
+		return &entry;
+	}
+
+	size_t size() const { return m_names.size(); }
+
+private:
+	// The displacement d = d0 * n + d1 moves a name to (f1 + d0 * f2 + d1) mod n
+	// Names are lowercased as by tolower() in the "C" locale, without a call per character
+	static unsigned char asciiLower(char c)
+	{
+		unsigned char u = static_cast<unsigned char>(c);
+		return u >= 'A' && u <= 'Z' ? static_cast<unsigned char>(u + ('a' - 'A')) : u;
+	}
+
+	// Maps the upper 32 bits of hash onto [0, n) with a multiplication instead of a division
+	static size_t reduce(fmx::uint64 hash, size_t n)
+	{
+		return static_cast<size_t>(((hash >> 32) * static_cast<fmx::uint64>(n)) >> 32);
+	}
+
+	// Slot of a name for a displacement of its bucket: the two halves of the hash
+	// give an odd step, so successive displacements visit different positions
+	static size_t slotFor(fmx::uint64 hash, fmx::uint32 displacement, size_t n)
+	{
+		fmx::uint32 f1 = static_cast<fmx::uint32>(hash);
+		fmx::uint32 f2 = static_cast<fmx::uint32>(hash >> 32) | 1;
+		return reduce(static_cast<fmx::uint64>(f1 + displacement * f2) << 32, n);
+	}
+
+	std::vector<LocalName> m_names;             // by slot
+	std::vector<fmx::uint64> m_hashes;          // hashKey() of the name in each slot
+	std::vector<fmx::uint32> m_displacements;   // by bucket
+};
+
+static std::mutex g_localZoneMutex;             // guards the path and file state below
+static std::string g_localZonePath;             // "" = no local zone
+static struct stat g_localZoneFile;             // when it was loaded
+static struct stat g_localZoneChanged;          // as last seen changed, not loaded yet
+static std::chrono::steady_clock::time_point g_nextLocalZoneCheck;
+static std::shared_ptr<const LocalZone> g_localZone; // replaced with std::atomic_store on reload
+
+// "@" is the origin, names without a trailing dot are relative to it
+static std::string absoluteName(const std::string& name, const std::string& origin)
+{
+	if (name == "@")
+		return origin;
+	if (!name.empty() && name.back() == '.')
+		return name.substr(0, name.size() - 1);
+	return origin.empty() ? name : name + "." + origin;
+}
+
+// Splits the logical lines of a hosts or zone file into tokens. Comments (";" or "#") are
+// dropped, "quoted strings" are one token, and records in parentheses may span lines.
+// The first token of a line that starts with white space is "" (the previous owner).
+static std::vector<std::vector<std::string>> zoneLines(const std::string& text)
+{
+	std::vector<std::vector<std::string>> lines;
+	std::vector<std::string> tokens;
+	std::string token;
+	bool quoted = false, comment = false, quotedToken = false;
+	int parentheses = 0;
+	for (size_t i = 0; i <= text.size(); ++i) {
+		char c = i < text.size() ? text[i] : '\n';
+		if (c == '\n' || c == '\r') {
+			if (!token.empty() || quotedToken)
+				tokens.push_back(token);
+			token.clear();
+			quoted = comment = quotedToken = false;
+			if (parentheses > 0)
+				continue;
+			if (tokens.size() > 1 || (tokens.size() == 1 && !tokens[0].empty()))
+				lines.push_back(tokens);
+			tokens.clear();
+			continue;
+		}
+		if (comment)
+			continue;
+		if (quoted) {
+			if (c == '"')
+				quoted = false;
+			else
+				token += c;
+			continue;
+		}
+		if (c == ';' || c == '#') {
+			comment = true;
+		} else if (c == '"') {
+			quoted = quotedToken = true;
+		} else if (c == '(' || c == ')' || isspace(static_cast<unsigned char>(c))) {
+			if (!token.empty() || quotedToken)
+				tokens.push_back(token);
+			else if (tokens.empty() && parentheses == 0)
+				tokens.push_back(""); // line starts with white space
+			token.clear();
+			quotedToken = false;
+			parentheses += c == '(' ? 1 : c == ')' ? -1 : 0;
+			parentheses = std::max(parentheses, 0);
+		} else {
+			token += c;
+		}
+	}
+	return lines;
+}
+
+// Reads a hosts or zone file into names and its state before the read into loaded; false if it
+// cannot be read, or was written to while it was read
+static bool readLocalZone(const std::string& path, std::vector<LocalName>& names, struct stat& loaded)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	std::string text;
+	char buffer[65536];
+	size_t length;
+	struct stat after;
+	bool read = fstat(fileno(file), &loaded) == 0;
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		text.append(buffer, length);
+	read = read && !ferror(file) && fstat(fileno(file), &after) == 0 && after.st_size == loaded.st_size &&
+		modifiedNs(after) == modifiedNs(loaded) && text.size() == static_cast<size_t>(loaded.st_size);
+	fclose(file);
+	if (!read)
+		return false;
+
+	std::unordered_map<std::string, size_t> index;
+	auto add = [&](const std::string& owner, const char* type, const std::string& value) {
+		std::string name = lowercase(owner);
+		if (name.empty() || value.empty())
+			return;
+		auto it = index.find(name);
+		if (it == index.end()) {
+			it = index.emplace(name, names.size()).first;
+			names.push_back(LocalName());
+			names.back().name = name;
+		}
+		DNSRecords& records = names[it->second].records;
+		std::pair<std::string, std::string> record(type, value);
+		if (std::find(records.begin(), records.end(), record) == records.end())
+			records.push_back(record);
+	};
+	auto address = [](const std::string& literal, int family) {
+		unsigned char addr[16];
+		char ip[INET6_ADDRSTRLEN] = {0};
+		if (inet_pton(family, literal.c_str(), addr) == 1)
+			inet_ntop(family, addr, ip, sizeof(ip));
+		return std::string(ip);
+	};
+
+	std::string origin, owner;
+	for (const auto& tokens : zoneLines(text)) {
+		if (tokens[0] == "$ORIGIN" && tokens.size() > 1) {
+			origin = lowercase(absoluteName(tokens[1], ""));
+			continue;
+		}
+		if (!tokens[0].empty() && tokens[0][0] == '$')
+			continue; // $TTL: local answers are not cached; $INCLUDE is not supported
+
+		// Hosts format: address followed by its names, the first one being the canonical name
+		std::string ipv4 = address(tokens[0], AF_INET), ipv6 = ipv4.empty() ? address(tokens[0], AF_INET6) : "";
+		if (!ipv4.empty() || !ipv6.empty()) {
+			for (size_t i = 1; i < tokens.size(); ++i)
+				add(absoluteName(tokens[i], ""), ipv4.empty() ? "AAAA" : "A", ipv4.empty() ? ipv6 : ipv4);
+			if (tokens.size() > 1)
+				add(reverseName(tokens[0]), "PTR", absoluteName(tokens[1], ""));
+			continue;
+		}
+
+		// Zone format: [owner] [ttl] [class] type rdata
+		if (!tokens[0].empty())
+			owner = absoluteName(tokens[0], origin);
+		size_t i = 1;
+		while (i < tokens.size() && i < 3 && (isdigit(static_cast<unsigned char>(tokens[i][0])) || lowercase(tokens[i]) == "in"))
+			i++;
+		if (i + 1 >= tokens.size())
+			continue;
+		std::string type = lowercase(tokens[i]);
+		std::vector<std::string> rdata(tokens.begin() + i + 1, tokens.end());
+		if (type == "a") {
+			add(owner, "A", address(rdata[0], AF_INET));
+		} else if (type == "aaaa") {
+			add(owner, "AAAA", address(rdata[0], AF_INET6));
+		} else if (type == "cname" || type == "ns" || type == "ptr") {
+			add(owner, type == "cname" ? "CNAME" : type == "ns" ? "NS" : "PTR", absoluteName(rdata[0], origin));
+		} else if (type == "mx" && rdata.size() > 1) {
+			add(owner, "MX", rdata[0] + " " + absoluteName(rdata[1], origin));
+		} else if (type == "srv" && rdata.size() > 3) {
+			add(owner, "SRV", rdata[0] + " " + rdata[1] + " " + rdata[2] + " " + absoluteName(rdata[3], origin));
+		} else if (type == "txt") {
+			add(owner, "TXT", rdata[0]);
+		}
+	}
+
+	// Render every answer now, lookups only copy them
+	for (auto& entry : names) {
+		std::vector<std::string> ipv4s, ipv6s;
+		for (const auto& record : entry.records) {
+			if (record.first == "A")
+				ipv4s.push_back(record.second);
+			else if (record.first == "AAAA")
+				ipv6s.push_back(record.second);
+			else if (record.first == "CNAME" && entry.cname.empty())
+				entry.cname = record.second;
+			else if (record.first == "PTR" && entry.ptr.empty())
+				entry.ptr = record.second;
+		}
+		entry.ipv4 = joinValues(ipv4s);
+		entry.ipv6 = joinValues(ipv6s);
+		ipv4s.insert(ipv4s.end(), ipv6s.begin(), ipv6s.end());
+		entry.addresses = joinValues(ipv4s);
+		entry.json = DNSRecordsToJsonArray(entry.records);
+	}
+	return true;
+}
+
+static bool sameFileState(const struct stat& a, const struct stat& b)
+{
+	return a.st_ino == b.st_ino && a.st_size == b.st_size && modifiedNs(a) == modifiedNs(b);
+}
+
+// (Re)loads the local zone from g_localZonePath into a new table; called with g_localZoneMutex held.
+// When the file cannot be read (or changes while it is read), the first load leaves no local zone
+// and a reload keeps the current one; either way it is tried again at the next change.
+static bool loadLocalZone(bool reload = false)
+{
+	std::shared_ptr<LocalZone> zone;
+	std::vector<LocalName> names;
+	struct stat file;
+	memset(&file, 0, sizeof(file));
+	bool loaded = !g_localZonePath.empty() && readLocalZone(g_localZonePath, names, file);
+	if (loaded) {
+		zone = std::make_shared<LocalZone>();
+		loaded = zone->build(std::move(names));
+	}
+	if (loaded || !reload) {
+		std::atomic_store(&g_localZone, std::shared_ptr<const LocalZone>(loaded ? zone : nullptr));
+		g_localZoneFile = file;
+	}
+	g_localZoneChanged = g_localZoneFile;
+	g_nextLocalZoneCheck = std::chrono::steady_clock::now() + std::chrono::milliseconds(LOCAL_ZONE_CHECK_INTERVAL);
+	return loaded;
+}
+
+// Reloads the local zone when its file changed. An editor or script may still be writing it, so
+// it is only reloaded once it stayed the same from one check to the next. Called from Do_PluginIdle.
+static void checkLocalZone()
+{
+	std::lock_guard<std::mutex> lock(g_localZoneMutex);
+	if (g_localZonePath.empty() || std::chrono::steady_clock::now() < g_nextLocalZoneCheck)
+		return;
+	struct stat file;
+	memset(&file, 0, sizeof(file));
+	stat(g_localZonePath.c_str(), &file);
+	if (!sameFileState(file, g_localZoneFile) && sameFileState(file, g_localZoneChanged)) {
+		loadLocalZone(true);
+		return;
+	}
+	g_localZoneChanged = file;
+	g_nextLocalZoneCheck = std::chrono::steady_clock::now() + std::chrono::milliseconds(LOCAL_ZONE_CHECK_INTERVAL);
+}
+
+// Answers fDNS_Resolve from the local zone, following CNAMEs inside it. A name in the zone without
+// addresses of the family resolves to nothing ("?"). Returns false when hostname is not in the
+// zone; hostname is then the target of a CNAME that leads out of it, if any.
+static bool resolveLocally(std::string& hostname, int family, bool allAddresses, std::string& result)
+{
+	std::shared_ptr<const LocalZone> zone = std::atomic_load(&g_localZone);
+	if (!zone)
+		return false;
+	for (int depth = 0; depth < MAX_LOCAL_CNAME_CHAIN; ++depth) {
+		const LocalName* entry = zone->find(hostname);
+		if (!entry)
+			return false;
+		const std::string& addresses = family == AF_INET ? entry->ipv4 : family == AF_INET6 ? entry->ipv6 : entry->addresses;
+		if (addresses.empty() && !entry->cname.empty()) {
+			hostname = entry->cname;
+			continue;
+		}
+		result = addresses.empty() ? "?" : allAddresses ? addresses : addresses.substr(0, addresses.find(", "));
+		g_stats.localAnswers++;
+		return true;
+	}
+	result = "?"; // CNAME loop
+	g_stats.localAnswers++;
+	return true;
+}
+
+// System configuration ====================================================================
+//
+// The system's DNS servers, search list and ndots are read from resolv.conf once and cached, so
+// fDNS_Get_Systems_Server does not build a channel on every call. resolv.conf is checked from
+// Do_PluginIdle: on Linux an inotify watch on its directory (VPN clients and NetworkManager replace
+// the file by renaming) triggers the check right away, elsewhere and for changes behind a symlink
+// the file is polled. The default channel is only rebuilt when the servers or search settings changed.
+
+#define SYSTEM_CONFIG_PATH "/etc/resolv.conf"
+#define SYSTEM_CONFIG_DIR "/etc"
+#define SYSTEM_CONFIG_NAME "resolv.conf"
+#define SYSTEM_CONFIG_CHECK_INTERVAL 2000 // ms between polls of resolv.conf
+
+static std::string g_systemServers;             // "" until read; protected by g_dnsMutex, as the state below
+static struct stat g_systemConfigFile;          // when it was read
+static std::chrono::steady_clock::time_point g_nextSystemConfigCheck;
+#ifdef __linux__
+static int g_systemConfigWatch = -1;            // inotify descriptor, -1 = poll only
+#endif
+
+// The servers of a channel, joined as by joinValues(); "?" if they cannot be read
+static std::string channelServers(ares_channel channel)
+{
+	struct ares_addr_node* servers = nullptr;
+	if (ares_get_servers(channel, &servers) != ARES_SUCCESS)
+		return "?";
+	std::vector<std::string> addresses;
+	char ip[INET6_ADDRSTRLEN];
+	for (struct ares_addr_node* node = servers; node != nullptr; node = node->next) {
+		memset(ip, 0, sizeof(ip));
+		if (node->family == AF_INET)
+			inet_ntop(AF_INET, &node->addr.addr4, ip, sizeof(ip));
+		else if (node->family == AF_INET6)
+			inet_ntop(AF_INET6, &node->addr.addr6, ip, sizeof(ip));
+		addresses.push_back(ip);
+	}
+	ares_free_data(servers);
+	return joinValues(addresses);
+}
+
+// Reads the system's servers, search list and ndots; true if they differ from the cached ones.
+// Called with g_dnsMutex held.
+static bool readSystemConfig()
+{
+	memset(&g_systemConfigFile, 0, sizeof(g_systemConfigFile));
+	stat(SYSTEM_CONFIG_PATH, &g_systemConfigFile);
+	g_nextSystemConfigCheck = std::chrono::steady_clock::now() + std::chrono::milliseconds(SYSTEM_CONFIG_CHECK_INTERVAL);
+
+	ares_channel channel;
+	if (ares_init(&channel) != ARES_SUCCESS)
+		return false;
+	std::string servers = channelServers(channel);
+	std::vector<std::string> domains = g_systemSearchDomains;
+	int ndots = g_systemNdots;
+	readSystemSearch(channel);
+	ares_destroy(channel);
+
+	bool changed = servers != g_systemServers || domains != g_systemSearchDomains || ndots != g_systemNdots;
+	g_systemServers = servers;
+	return changed;
+}
+
+// (Re)creates the default channel for g_currentDnsServer. Called with g_dnsMutex held.
+static fmx::errcode createDefaultChannel()
+{
+	if (g_channel) {
+		ares_destroy(g_channel);
+		g_channel = nullptr;
+	}
+	if (g_currentDnsServer.empty()) {
+		if (ares_init(&g_channel) != ARES_SUCCESS)
+			return 1;
+	} else if (create_channel(g_currentDnsServer, &g_channel) != 0) {
+		return 1;
+	}
+	return 0;
+}
+
+static void watchSystemConfig()
+{
+#ifdef __linux__
+	if (g_systemConfigWatch >= 0)
+		return;
+	g_systemConfigWatch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_systemConfigWatch >= 0 &&
+		inotify_add_watch(g_systemConfigWatch, SYSTEM_CONFIG_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+		close(g_systemConfigWatch);
+		g_systemConfigWatch = -1;
+	}
+#endif
+}
+
+static void unwatchSystemConfig()
+{
+#ifdef __linux__
+	if (g_systemConfigWatch >= 0) {
+		close(g_systemConfigWatch);
+		g_systemConfigWatch = -1;
+	}
+#endif
+}
+
+// True if the inotify watch saw resolv.conf change since the last call
+static bool systemConfigNotified()
+{
+	bool notified = false;
+#ifdef __linux__
+	if (g_systemConfigWatch < 0)
+		return false;
+	alignas(struct inotify_event) char buffer[4096];
+	ssize_t length;
+	while ((length = read(g_systemConfigWatch, buffer, sizeof(buffer))) > 0) {
+		for (char* p = buffer; p < buffer + length;) {
+			const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+			if (event->len > 0 && strcmp(event->name, SYSTEM_CONFIG_NAME) == 0)
+				notified = true;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#endif
+	return notified;
+}
+
+// Rereads the system configuration when resolv.conf changed. Called from Do_PluginIdle.
+static void checkSystemConfig()
+{
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return;
+	bool notified = systemConfigNotified();
+	if (!notified) {
+		if (std::chrono::steady_clock::now() < g_nextSystemConfigCheck)
+			return;
+		struct stat file;
+		memset(&file, 0, sizeof(file));
+		stat(SYSTEM_CONFIG_PATH, &file);
+		if (file.st_ino == g_systemConfigFile.st_ino && file.st_size == g_systemConfigFile.st_size &&
+			modifiedNs(file) == modifiedNs(g_systemConfigFile)) {
+			g_nextSystemConfigCheck = std::chrono::steady_clock::now() + std::chrono::milliseconds(SYSTEM_CONFIG_CHECK_INTERVAL);
+			return;
+		}
+	}
+	if (readSystemConfig())
+		g_stats.systemConfigChanges++;
+}
+
+// DNS State Management ====================================================================
+
+static std::string fDNS_Get_Current_Server()
+{
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	return g_currentDnsServer;
+}
+
+static fmx::errcode fDNS_Initialize()
+{
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized) {
+		if (ares_library_init(ARES_LIB_INIT_ALL) != ARES_SUCCESS)
+			return 1;
+		if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+			ares_library_cleanup();
+			return 1;
+		}
+		g_currentDnsServer.clear(); // use system default
+		g_upstreams.clear();
+		g_dnsInitialized = true;
+
+		std::lock_guard<std::mutex> cacheLock(g_cacheMutex);
+		g_cacheServer = g_currentDnsServer;
+		loadSnapshot(g_currentDnsServer);
+		if (!g_sharedCacheName.empty())
+			g_sharedCache = openSharedCache(g_sharedCacheName, g_sharedCacheSizeMB);
+
+		std::lock_guard<std::mutex> zoneLock(g_localZoneMutex);
+		loadLocalZone();
+
+		watchSystemConfig();
+		readSystemConfig();
+	}
+	// (Re)create the channel for the current DNS server (should be default at init)
+	return createDefaultChannel();
+}
+
+static fmx::errcode fDNS_Uninitialize()
+{
+	destroyProbes();
+	destroyBackgroundLookups();
+	saveSnapshot(fDNS_Get_Current_Server(), true);
+	// Held until the flag is cleared, so no setter brings back what is torn down here
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	cacheClear();
+	{
+		std::lock_guard<std::mutex> cacheLock(g_cacheMutex);
+		g_snapshot = nullptr;
+		g_snapshotActive = false;
+		g_sharedCache = nullptr;
+	}
+	if (g_channel) {
+		ares_destroy(g_channel);
+		g_channel = nullptr;
+	}
+	if (g_dnsInitialized) {
+		ares_library_cleanup();
+		g_dnsInitialized = false;
+		g_currentDnsServer.clear();
+		g_upstreams.clear();
+		g_routes.children.clear();
+		g_systemServers.clear();
+		unwatchSystemConfig();
+		curl_global_cleanup(); // after the HTTPS connections of the upstreams are gone
+	}
+	return 0;
+}
+
+static fmx::errcode fDNS_Set_Server(const std::string& dnsServer)
+{
+	// "" goes back to the system's servers; a list without any server (",", " ") is a mistake
+	if (!dnsServer.empty() && splitServerList(dnsServer).empty())
+		return 956;
+
+	// Refreshes in flight and cached answers belong to the previous server(s). The answers are
+	// dropped after the swap, with the lock held, so none for the old servers outlives it.
+	destroyBackgroundLookups();
+
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return 1;
+	g_currentDnsServer = dnsServer;
+	g_upstreams = buildUpstreams(g_currentDnsServer, allUpstreams());
+	cacheClear();
+	{
+		std::lock_guard<std::mutex> cacheLock(g_cacheMutex);
+		g_cacheServer = dnsServer;
+		g_snapshotActive = g_snapshot && !dnsServer.empty() && g_snapshot->server == dnsServer;
+	}
+	// Recreate the channel with the new server
+	return createDefaultChannel();
+}
+
+// Splits a flat JSON object into its members, keeping each value as written (a number, true, false
+// or null). False if json is not such an object.
+static bool parseFlatJsonObject(const std::string& json, std::vector<std::pair<std::string, std::string>>& members)
+{
+	size_t pos = 0;
+	auto skipSpace = [&]() {
+		while (pos < json.size() && isspace(static_cast<unsigned char>(json[pos])))
+			++pos;
+	};
+	skipSpace();
+	if (pos >= json.size() || json[pos++] != '{')
+		return false;
+	skipSpace();
+	if (pos < json.size() && json[pos] == '}') {
+		++pos;
+	} else {
+		for (;;) {
+			skipSpace();
+			if (pos >= json.size() || json[pos++] != '"')
+				return false;
+			size_t end = json.find('"', pos);
+			if (end == std::string::npos || json.find('\\', pos) < end)
+				return false;
+			std::string key = json.substr(pos, end - pos);
+			pos = end + 1;
+			skipSpace();
+			if (pos >= json.size() || json[pos++] != ':')
+				return false;
+			skipSpace();
+			size_t start = pos;
+			while (pos < json.size() && (isalnum(static_cast<unsigned char>(json[pos])) || json[pos] == '-' || json[pos] == '+' || json[pos] == '.'))
+				++pos;
+			if (pos == start)
+				return false;
+			members.emplace_back(key, json.substr(start, pos - start));
+			skipSpace();
+			if (pos < json.size() && json[pos] == ',') {
+				++pos;
+				continue;
+			}
+			if (pos >= json.size() || json[pos++] != '}')
+				return false;
+			break;
+		}
+	}
+	skipSpace();
+	return pos == json.size();
+}
+
+// The integer options of fDNS_Configure and their ranges; 0 (or null) always restores the default
+static const struct {
+	const char* name;
+	int ChannelOptions::*field;
+	int min;
+	int max;
+} kIntegerChannelOptions[] = {
+	{ "timeoutMs", &ChannelOptions::timeoutMs, static_cast<int>(MIN_RTO), static_cast<int>(MAX_RTO) },
+	{ "tries", &ChannelOptions::tries, 1, MAX_TRIES },
+	{ "ednsPayloadSize", &ChannelOptions::ednsPayloadSize, 512, 4096 },
+	{ "udpMaxQueries", &ChannelOptions::udpMaxQueries, 1, 65535 },
+	{ "socketSendBuffer", &ChannelOptions::socketSendBuffer, 4096, 16 * 1024 * 1024 },
+	{ "socketReceiveBuffer", &ChannelOptions::socketReceiveBuffer, 4096, 16 * 1024 * 1024 },
+	{ "serverQps", &ChannelOptions::serverQps, 1, 10000000 },
+	{ "interactiveP99Ms", &ChannelOptions::interactiveP99Ms, 1, 60000 },
+};
+
+// Applies the options of a JSON object such as {"timeoutMs": 200, "tries": 3, "rotate": true}.
+// Options not in the object keep their value. Every option is checked before any is applied, and
+// the default channel is rebuilt with them; if that fails the previous options stay in effect.
+static fmx::errcode fDNS_Configure(const std::string& json)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	std::vector<std::pair<std::string, std::string>> members;
+	if (!parseFlatJsonObject(json, members))
+		return 956;
+
+	ChannelOptions options = *channelOptions();
+	for (const auto& member : members) {
+		const std::string& value = member.second;
+		if (member.first == "rotate" || member.first == "ioUring") {
+			if (value != "true" && value != "false" && value != "null")
+				return 956;
+			bool ChannelOptions::*field = member.first == "rotate" ? &ChannelOptions::rotate : &ChannelOptions::ioUring;
+			options.*field = value == "null" ? ChannelOptions().*field : value == "true";
+			continue;
+		}
+		auto option = std::find_if(std::begin(kIntegerChannelOptions), std::end(kIntegerChannelOptions), [&member](const decltype(kIntegerChannelOptions[0])& o) {
+			return member.first == o.name;
+		});
+		if (option == std::end(kIntegerChannelOptions))
+			return 956; // unknown option
+		long number = 0;
+		if (value != "null") {
+			char* end = nullptr;
+			number = strtol(value.c_str(), &end, 10);
+			if (*end != '\0' || (number != 0 && (number < option->min || number > option->max)))
+				return 956;
+		}
+#ifndef ARES_OPT_UDP_MAX_QUERIES
+		if (option->field == &ChannelOptions::udpMaxQueries && number != 0)
+			return 956; // not supported by this c-ares
+#endif
+		options.*(option->field) = static_cast<int>(number);
+	}
+
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return 1;
+	std::shared_ptr<const ChannelOptions> previous = channelOptions();
+	std::atomic_store(&g_channelOptions, std::make_shared<const ChannelOptions>(options));
+	if (createDefaultChannel() != 0) {
+		std::atomic_store(&g_channelOptions, previous);
+		createDefaultChannel();
+		return 1;
+	}
+	// Servers whose RTT was not measured yet start from the new timeout
+	for (const auto& upstream : allUpstreams()) {
+		std::lock_guard<std::mutex> upstreamLock(upstream->lock);
+		if (upstream->srttMs == 0)
+			upstream->rtoMs = options.timeoutMs > 0 ? options.timeoutMs : INITIAL_RTO;
+	}
+	return 0;
+}
+
+// The options in effect as a JSON object, with the defaults filled in
+static std::string fDNS_Get_Configuration()
+{
+	std::shared_ptr<const ChannelOptions> options = channelOptions();
+	std::string json = "{\"timeoutMs\":" + std::to_string(options->timeoutMs > 0 ? options->timeoutMs : static_cast<int>(INITIAL_RTO));
+	json += ",\"tries\":" + std::to_string(options->tries > 0 ? options->tries : MAX_TRIES);
+	json += std::string(",\"rotate\":") + (options->rotate ? "true" : "false");
+	json += ",\"ednsPayloadSize\":" + std::to_string(options->ednsPayloadSize);
+	json += ",\"udpMaxQueries\":" + std::to_string(options->udpMaxQueries);
+	json += ",\"socketSendBuffer\":" + std::to_string(options->socketSendBuffer);
+	json += ",\"socketReceiveBuffer\":" + std::to_string(options->socketReceiveBuffer);
+	json += std::string(",\"ioUring\":") + (options->ioUring ? "true" : "false");
+	json += ",\"serverQps\":" + std::to_string(options->serverQps);
+	json += ",\"interactiveP99Ms\":" + std::to_string(options->interactiveP99Ms);
+	json += "}";
+	return json;
+}
+
+// Sends the names under suffix to dnsServer (a list as for fDNS_Set_Server); dnsServer = "" removes the route.
+// Cached answers under the suffix came from other servers and are flushed.
+static fmx::errcode fDNS_Set_Route(const std::string& suffix, const std::string& dnsServer)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	std::string lowered = lowercase(suffix);
+	if (!lowered.empty() && lowered.back() == '.')
+		lowered.pop_back();
+	if (lowered.empty() || lowered.front() == '.' || lowered.find("..") != std::string::npos ||
+		lowered.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789-_.") != std::string::npos)
+		return 956;
+	if (!dnsServer.empty() && splitServerList(dnsServer).empty())
+		return 956;
+	if (!dnsServer.empty()) {
+		ares_channel channel = nullptr;
+		if (create_channel(dnsServer, &channel) != 0)
+			return 1;
+		ares_destroy(channel);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_dnsMutex);
+		if (!g_dnsInitialized)
+			return 1;
+		RouteNode* node = &g_routes;
+		forEachLabelFromRight(lowered, [&node](const std::string& label) {
+			std::unique_ptr<RouteNode>& child = node->children[label];
+			if (!child)
+				child.reset(new RouteNode);
+			node = child.get();
+			return true;
+		});
+		if (dnsServer.empty()) {
+			node->route = nullptr;
+		} else {
+			std::shared_ptr<Route> route = std::make_shared<Route>();
+			route->suffix = lowered;
+			route->dnsServer = dnsServer;
+			route->upstreams = buildUpstreams(dnsServer, allUpstreams());
+			node->route = route;
+		}
+	}
+	size_t flushed = 0;
+	return fDNS_Cache_Flush(lowered, true, flushed);
+}
+
+// The routes as a JSON array of {"suffix", "servers"}; a suffix is listed before the longer ones under it
+static std::string fDNS_Get_Routes()
+{
+	std::vector<std::shared_ptr<const Route>> routes;
+	{
+		std::lock_guard<std::mutex> lock(g_dnsMutex);
+		collectRoutes(g_routes, routes);
+	}
+	std::string json = "[";
+	for (const auto& route : routes) {
+		if (json.size() > 1)
+			json += ",";
+		json += "{\"suffix\":\"" + route->suffix + "\",\"servers\":\"" + route->dnsServer + "\"}";
+	}
+	json += "]";
+	return json;
+}
+
+// domains is a comma-separated search list, "" looks names up only as given and "*" uses the
+// system's list (default). ndots < 0 uses the system's ndots. Cached answers of searched names
+// may come from another list, so the cache is cleared as by fDNS_Set_Server.
+static fmx::errcode fDNS_Set_Search(const std::string& domains, int ndots)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	std::vector<std::string> list;
+	if (domains != "*") {
+		for (auto domain : splitServerList(domains)) {
+			while (!domain.empty() && domain.back() == '.')
+				domain.pop_back();
+			if (domain.empty() || domain.front() == '.' || domain.find_first_of(" \t\"") != std::string::npos)
+				return 956;
+			list.push_back(domain);
+		}
+	}
+
+	// Answers of relative names depend on the list; they are dropped with the lock held, so no
+	// lookup sees the new list while answers for the old one are still cached
+	destroyBackgroundLookups();
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return 1;
+	g_searchSystem = domains == "*";
+	g_searchDomains = list;
+	g_searchNdots = std::min(ndots, MAX_NDOTS);
+	cacheClear();
+	return 0;
+}
+
+// delayMs = 0 hedges after the current upstream's observed p90 latency
+static fmx::errcode fDNS_Set_Hedging(bool enabled, int delayMs)
+{
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return 1;
+	g_hedgingEnabled = enabled;
+	g_hedgeDelayMs = delayMs > 0 ? delayMs : 0;
+	return 0;
+}
+
+// Formats milliseconds with microsecond precision for the JSON statistics
+static std::string formatMs(double ms)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.3f", ms);
+	return buffer;
+}
+
+static std::string fDNS_Get_Server_Stats()
+{
+	std::vector<UpstreamPtr> upstreams;
+	{
+		std::lock_guard<std::mutex> lock(g_dnsMutex);
+		upstreams = allUpstreams();
+	}
+	std::string json = "[";
+	for (const auto& upstream : upstreams) {
+		int p90 = rttPercentile90(*upstream);
+		std::lock_guard<std::mutex> lock(upstream->lock);
+		if (json.size() > 1)
+			json += ",";
+		json += "{\"server\":\"" + upstream->address + "\"";
+		json += ",\"srttMs\":" + formatMs(upstream->srttMs);
+		json += ",\"rttvarMs\":" + formatMs(upstream->rttvarMs);
+		json += ",\"rtoMs\":" + formatMs(upstream->rtoMs);
+		json += ",\"p90Ms\":" + (p90 >= 0 ? formatMs(p90 / 1000.0) : std::string("null"));
+		json += ",\"samples\":" + std::to_string(upstream->rttSamples.size());
+		json += ",\"attempts\":" + std::to_string(upstream->attempts);
+		json += ",\"answers\":" + std::to_string(upstream->answers);
+		json += ",\"timeouts\":" + std::to_string(upstream->timeouts);
+		json += ",\"errors\":" + std::to_string(upstream->errors);
+		json += ",\"retransmits\":" + std::to_string(upstream->retransmits);
+		json += ",\"circuit\":\"" + std::string(circuitName(upstream->circuit)) + "\"";
+		json += ",\"consecutiveFailures\":" + std::to_string(upstream->consecutiveFailures);
+		json += ",\"errorRate\":" + formatMs(upstream->errorRate);
+		json += "}";
+	}
+	json += "]";
+	return json;
+}
+
+// windowSec = 0 disables serve-stale; clientTimeoutMs <= 0 keeps the current client response timer
+static fmx::errcode fDNS_Set_Stale(int windowSec, int clientTimeoutMs)
+{
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return 1;
+	std::lock_guard<std::mutex> cacheLock(g_cacheMutex);
+	g_staleWindowSec = std::max(windowSec, 0);
+	if (clientTimeoutMs > 0)
+		g_clientTimeoutMs = clientTimeoutMs;
+	return 0;
+}
+
+// path = "" disables the snapshot; the file at path is loaded right away
+static fmx::errcode fDNS_Set_Snapshot(const std::string& path)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	joinSnapshotWriter();
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return 1;
+	std::lock_guard<std::mutex> cacheLock(g_cacheMutex);
+	g_snapshotPath = path;
+	loadSnapshot(g_currentDnsServer);
+	return 0;
+}
+
+// name = "" turns the shared cache off; sizeMB only applies when the segment is created
+static fmx::errcode fDNS_Set_Shared_Cache(const std::string& name, int sizeMB)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	for (char c : name) {
+		if (!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-')
+			return 956;
+	}
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return 1;
+	std::lock_guard<std::mutex> cacheLock(g_cacheMutex);
+	g_sharedCache = nullptr;
+	g_sharedCacheName = name;
+	g_sharedCacheSizeMB = sizeMB;
+	if (name.empty())
+		return 0;
+	g_sharedCache = openSharedCache(name, sizeMB);
+	return g_sharedCache ? 0 : 1;
+}
+
+// path = "" removes the local zone; the file is loaded right away and reloaded when it changes
+static fmx::errcode fDNS_Set_Local_Zone(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(g_dnsMutex);
+	if (!g_dnsInitialized)
+		return 1;
+	std::lock_guard<std::mutex> zoneLock(g_localZoneMutex);
+	g_localZonePath = path;
+	return loadLocalZone() || path.empty() ? 0 : 1;
+}
+
+// Sets the answer cache's memory budget; 0 turns caching off
+static fmx::errcode fDNS_Set_Cache_Size(int kilobytes)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	g_answerCache.setBudget(static_cast<size_t>(kilobytes) * 1024);
+	return 0;
+}
+
+static std::string fDNS_Get_Stats()
+{
+	std::string json = "{";
+	json += "\"lookups\":" + std::to_string(g_stats.lookups.load());
+	json += ",\"failovers\":" + std::to_string(g_stats.failovers.load());
+	json += ",\"hedges\":" + std::to_string(g_stats.hedges.load());
+	json += ",\"hedgeWins\":" + std::to_string(g_stats.hedgeWins.load());
+	json += ",\"circuitOpens\":" + std::to_string(g_stats.circuitOpens.load());
+	json += ",\"circuitSkips\":" + std::to_string(g_stats.circuitSkips.load());
+	json += ",\"probes\":" + std::to_string(g_stats.probes.load());
+	json += ",\"cacheHits\":" + std::to_string(g_stats.cacheHits.load());
+	json += ",\"cacheMisses\":" + std::to_string(g_stats.cacheMisses.load());
+	fmx::uint64 hits = g_stats.cacheHits.load(), misses = g_stats.cacheMisses.load();
+	json += ",\"cacheHitRatio\":" + formatMs(hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0);
+	CacheUsage usage = g_answerCache.usage();
+	json += ",\"cacheEntries\":" + std::to_string(usage.entries);
+	json += ",\"cacheBytes\":" + std::to_string(usage.windowBytes + usage.probationBytes + usage.protectedBytes + usage.pinnedBytes);
+	json += ",\"cacheBudget\":" + std::to_string(usage.budget);
+	json += ",\"cacheEvictions\":" + std::to_string(usage.evictions);
+	json += ",\"cacheRejections\":" + std::to_string(usage.rejections);
+	json += ",\"staleAnswers\":" + std::to_string(g_stats.staleAnswers.load());
+	json += ",\"backgroundRefreshes\":" + std::to_string(g_stats.backgroundRefreshes.load());
+	json += ",\"prefetches\":" + std::to_string(g_stats.prefetches.load());
+	json += ",\"snapshotHits\":" + std::to_string(g_stats.snapshotHits.load());
+	json += ",\"sharedHits\":" + std::to_string(g_stats.sharedHits.load());
+	std::shared_ptr<const LocalZone> zone = std::atomic_load(&g_localZone);
+	json += ",\"localNames\":" + std::to_string(zone ? zone->size() : 0);
+	json += ",\"localAnswers\":" + std::to_string(g_stats.localAnswers.load());
+	json += ",\"searchQueries\":" + std::to_string(g_stats.searchQueries.load());
+	json += ",\"systemConfigChanges\":" + std::to_string(g_stats.systemConfigChanges.load());
+	json += ",\"tcpConnections\":" + std::to_string(g_streamStats.connections.load());
+	json += ",\"tcpQueries\":" + std::to_string(g_streamStats.queries.load());
+	json += ",\"tcpReusedQueries\":" + std::to_string(g_streamStats.reused.load());
+	json += ",\"tcpResent\":" + std::to_string(g_streamStats.resent.load());
+	json += ",\"tcpFallbacks\":" + std::to_string(g_stats.tcpFallbacks.load());
+	json += ",\"tlsHandshakes\":" + std::to_string(g_streamStats.tlsHandshakes.load());
+	json += ",\"tlsResumed\":" + std::to_string(g_streamStats.tlsResumed.load());
+	json += ",\"dohConnections\":" + std::to_string(g_streamStats.httpsConnections.load());
+	json += ",\"dohQueries\":" + std::to_string(g_streamStats.httpsQueries.load());
+	json += ",\"dohReusedQueries\":" + std::to_string(g_streamStats.httpsReused.load());
+	// The bulk jobs' congestion windows, and the queue depths per scheduling class
+	SchedulerStats scheduler = g_scheduler.stats();
+	json += ",\"bulkWindow\":" + std::to_string(scheduler.bulkWindow);
+	size_t background;
+	{
+		std::lock_guard<std::mutex> lock(g_backgroundMutex);
+		background = g_backgroundLookups.size();
+	}
+	json += ",\"interactiveQueue\":" + std::to_string(scheduler.interactive);
+	json += ",\"backgroundQueue\":" + std::to_string(background);
+	json += ",\"bulkJobs\":" + std::to_string(scheduler.bulkJobs);
+	json += ",\"bulkQueue\":" + std::to_string(scheduler.bulkQueued);
+	json += ",\"bulkInFlight\":" + std::to_string(scheduler.bulkInFlight);
+	json += ",\"bulkBudget\":" + std::to_string(scheduler.bulkBudget);
+	json += ",\"interactiveP99Ms\":" + formatMs(scheduler.interactiveP99Ms);
+	json += "}";
+	return json;
+}
+
+// Cached while initialized and reread when resolv.conf changes (see checkSystemConfig)
+static std::string fDNS_Get_Systems_Server()
+{
+	{
+		std::lock_guard<std::mutex> lock(g_dnsMutex);
+		if (!g_systemServers.empty())
+			return g_systemServers;
+	}
+	ares_channel channel;
+	if (ares_init(&channel) != ARES_SUCCESS)
+		return "?";
+	std::string serverList = channelServers(channel);
+	ares_destroy(channel);
+	return serverList;
+}
+
+// Resolves a file of names through the UDP servers set with fDNS_Set_Server, or the system's
+// servers; the cache, the local zone, routes and the search list are not used. owner is the
+// session (or file) the scheduler shares the bulk budget by.
+static fmx::errcode fDNS_Resolve_Bulk(const std::string& inputPath, const std::string& outputPath, const std::string& typeName,
+									  int maxInFlight, fmx::ptrtype owner, std::string& json)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	int type = -1;
+	for (int candidate : { ns_t_a, ns_t_aaaa, ns_t_cname, ns_t_mx, ns_t_txt, ns_t_ns, ns_t_srv, ns_t_ptr }) {
+		if (strcasecmp(typeName.c_str(), recordTypeName(candidate)) == 0)
+			type = candidate;
+	}
+	if (type < 0 || inputPath.empty() || outputPath.empty())
+		return 956;
+	std::string dnsServer = fDNS_Get_Current_Server();
+	if (dnsServer.empty())
+		dnsServer = fDNS_Get_Systems_Server();
+	return resolveBulk(dnsServer, inputPath, outputPath, type, maxInFlight, owner, json);
+}
+
+// DNS_Resolve: hostname, timeoutMs, family, allAddresses
+static FMX_PROC(fmx::errcode) fDNS_Resolve(short /*funcId*/, const fmx::ExprEnv& /*env*/, const fmx::DataVect& dataVect, fmx::Data& results)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	InteractiveCall interactive;
+	if (dataVect.Size() < 1) return 956;
+
+	const fmx::Data& inputData = dataVect.At(0);
+	std::string hostname = getString(inputData.GetAsText());
+	if (hostname.empty())
+		return 956;
+
+	int timeoutMs = DEFAULT_TIMEOUT;
+	if (dataVect.Size() > 1) {
+		timeoutMs = GetIntFromDataVect(dataVect, 1);
+		if (timeoutMs < 0) timeoutMs = DEFAULT_TIMEOUT;
+	}
+
+	int family = AF_INET;
+	if (!GetFamilyFromDataVect(dataVect, 2, family))
+		return 956;
 
-		if (!callbackData.done)
-			callbackData.ip = "?";  // Timed out
-		ares_destroy(channel);
+	bool allAddresses = false;
+	if (dataVect.Size() > 3)
+		allAddresses = GetIntFromDataVect(dataVect, 3) != 0;
+
+	std::string result_ip = "?";
+	bool local = resolveLocally(hostname, family, allAddresses, result_ip);
+
+	// Routed by the name that is looked up, which may be a CNAME target leading out of the local zone
+	std::string dnsServer;
+	std::vector<UpstreamPtr> upstreams;
+	bool routed = serversFor(hostname, dnsServer, upstreams);
+	unsigned char literal[16];
+	bool isIPv4 = inet_pton(AF_INET, hostname.c_str(), literal) == 1;
+	bool isIPv6 = !isIPv4 && inet_pton(AF_INET6, hostname.c_str(), literal) == 1;
+	std::vector<std::string> hostsAddresses;
+	if (local) {
+		// Answered from the local zone, before any network path
+	} else if (dnsServer.empty()) {
+		// Use system resolver for default DNS
+		std::vector<std::string> addresses = resolve_with_system(hostname, family);
+		if (!addresses.empty())
+			result_ip = allAddresses ? joinValues(addresses) : addresses[0];
+	} else if (isIPv4 || isIPv6) {
+		// Like getaddrinfo, an address of the requested family resolves to itself
+		if ((isIPv4 && family != AF_INET6) || (isIPv6 && family != AF_INET))
+			result_ip = hostname;
+	} else if (!(hostsAddresses = resolve_with_hosts_file(hostname, family)).empty()) {
+		// The hosts file comes before the DNS servers, as with the system resolver
+		result_ip = allAddresses ? joinValues(hostsAddresses) : hostsAddresses[0];
+	} else {
+		// For "any" the A and AAAA queries are sent at the same time, so a dual-stack lookup
+		// costs the slower of the two rather than their sum. The search list is applied as
+		// getaddrinfo does; a name with a trailing dot is sent as it is.
+		std::string kind = family == AF_INET ? "A" : family == AF_INET6 ? "AAAA" : "ADDR";
+		std::vector<std::string> names = searchNames(hostname);
+		CachedAnswer answer = cachedLookup(cacheKey(kind, hostname, routed ? dnsServer : std::string()), upstreams, timeoutMs, [names, family](Attempt& attempt) {
+			if (family != AF_INET6)
+				searchQuery(attempt, names, ns_t_a);
+			if (family != AF_INET)
+				searchQuery(attempt, names, ns_t_aaaa);
+		}, [](const DNSRecords& records) {
+			std::vector<std::string> addresses;
+			for (const auto& record : records)
+				addresses.push_back(record.second);
+			return joinValues(addresses);
+		});
 
-		result_ip = callbackData.ip;
+		if (answer.answered && !answer.rendered.empty())
+			result_ip = allAddresses ? answer.rendered : answer.rendered.substr(0, answer.rendered.find(", "));
 	}
 
 	fmx::TextUniquePtr outText;
@@ -347,6 +7270,7 @@ static FMX_PROC(fmx::errcode) fDNS_Reverse(short /*funcId*/, const fmx::ExprEnv&
 {
 	if (!g_dnsInitialized)
 		return 1;
+	InteractiveCall interactive;
 	if (dataVect.Size() < 1) return 956;
 
 	std::string ipAddress = getString(dataVect.At(0).GetAsText());
@@ -359,106 +7283,34 @@ static FMX_PROC(fmx::errcode) fDNS_Reverse(short /*funcId*/, const fmx::ExprEnv&
 	}
 
 	std::string dnsServer;
-	{
-		std::lock_guard<std::mutex> lock(g_dnsMutex);
-		dnsServer = g_currentDnsServer;
-	}
+	std::vector<UpstreamPtr> upstreams;
+	bool routed = serversFor(reverseName(ipAddress), dnsServer, upstreams);
 
 	std::string result_hostname;
-	if (dnsServer.empty()) {
+	std::shared_ptr<const LocalZone> zone = std::atomic_load(&g_localZone);
+	const LocalName* local = zone ? zone->find(reverseName(ipAddress)) : nullptr;
+	if (local && !local->ptr.empty()) {
+		g_stats.localAnswers++;
+		result_hostname = local->ptr;
+	} else if (dnsServer.empty()) {
 		// Use system resolver for default DNS (reverse)
 		result_hostname = reverse_with_system(ipAddress);
 	} else {
-		ares_channel channel;
-		struct ares_options options;
-		int optmask = 0;
-
-		if (!dnsServer.empty())
-		{
-			memset(&options, 0, sizeof(options));
-			if (ares_init_options(&channel, &options, optmask) != ARES_SUCCESS)
-				return 1;
-			if (ares_set_servers_ports_csv(channel, dnsServer.c_str()) != ARES_SUCCESS)
-			{
-				ares_destroy(channel);
-				return 1;
-			}
-		}
-		else
-		{
-			if (ares_init(&channel) != ARES_SUCCESS)
-				return 1;
-		}
-
-		struct sockaddr_in sa;
-		memset(&sa, 0, sizeof(sa));
-		sa.sin_family = AF_INET;
-
-		if (inet_pton(AF_INET, ipAddress.c_str(), &sa.sin_addr) != 1)
-		{
-			ares_destroy(channel);
+		// PTR query for the in-addr.arpa / ip6.arpa name, which also gives the TTL for the cache
+		std::string arpaName = reverseName(ipAddress);
+		if (arpaName.empty())
 			return 956;
-		}
-
-		struct CallbackData {
-			bool done = false;
-			std::string hostname;
-		} callbackData;
-
-		auto callback = [](void* arg, int status, int /*timeouts*/, struct hostent* host) {
-			auto* data = static_cast<CallbackData*>(arg);
-			if (status == ARES_SUCCESS && host && host->h_name)
-			{
-				data->hostname = host->h_name;
-			}
-			else
-			{
-				data->hostname = "?";
-			}
-			data->done = true;
-		};
-
-		ares_gethostbyaddr(channel, &sa.sin_addr, sizeof(sa.sin_addr), AF_INET, callback, &callbackData);
-
-		int totalWaitMs = 0;
-
-		while (!callbackData.done && totalWaitMs < timeoutMs)
-		{
-			fd_set read_fds, write_fds;
-			int nfds;
-			struct timeval tv, *tvp;
-
-			FD_ZERO(&read_fds);
-			FD_ZERO(&write_fds);
-			nfds = ares_fds(channel, &read_fds, &write_fds);
-			if (nfds == 0)
-				break;
 
-			tvp = ares_timeout(channel, nullptr, &tv);
+		CachedAnswer answer = cachedLookup(cacheKey("PTR", arpaName, routed ? dnsServer : std::string()), upstreams, timeoutMs, [arpaName](Attempt& attempt) {
+			sendQuery(attempt, arpaName, ns_t_ptr);
+		}, [](const DNSRecords& records) {
+			return records.empty() ? std::string() : records[0].second;
+		});
 
-			int waitMs = (tvp->tv_sec * 1000) + (tvp->tv_usec / 1000);
-			if (waitMs > (timeoutMs - totalWaitMs))
-				waitMs = timeoutMs - totalWaitMs;
-
-			struct timeval tv_limit = { waitMs / 1000, (waitMs % 1000) * 1000 };
-
-			int waited = select(nfds, &read_fds, &write_fds, nullptr, &tv_limit);
-			if (waited >= 0)
-			{
-				ares_process(channel, &read_fds, &write_fds);
-				totalWaitMs += waitMs;
-			}
-			else
-			{
-				break; // select error
-			}
-		}
-
-		if (!callbackData.done)
-			callbackData.hostname = "?";  // Timed out
-		ares_destroy(channel);
-
-		result_hostname = callbackData.hostname;
+		if (answer.answered && !answer.rendered.empty())
+			result_hostname = answer.rendered;
+		else
+			result_hostname = "?";  // Timed out or not found
 	}
 
 	fmx::TextUniquePtr outText;
@@ -473,6 +7325,7 @@ static FMX_PROC(fmx::errcode) fDNS_Resolve_Extended(short /*funcId*/, const fmx:
 {
 	if (!g_dnsInitialized)
 		return 1;
+	InteractiveCall interactive;
 	if (dataVect.Size() < 1) return 956;
 
 	std::string hostname = getString(dataVect.At(0).GetAsText());
@@ -485,15 +7338,19 @@ static FMX_PROC(fmx::errcode) fDNS_Resolve_Extended(short /*funcId*/, const fmx:
 	}
 
 	std::string dnsServer;
-	{
-		std::lock_guard<std::mutex> lock(g_dnsMutex);
-		dnsServer = g_currentDnsServer;
-	}
+	std::vector<UpstreamPtr> upstreams;
+	bool routed = serversFor(hostname, dnsServer, upstreams);
 
-	std::vector<std::pair<std::string, std::string>> records;
+	std::string jsonResult;
+	std::shared_ptr<const LocalZone> zone = std::atomic_load(&g_localZone);
+	const LocalName* local = zone ? zone->find(hostname) : nullptr;
 
-	if (dnsServer.empty()) {
+	if (local) {
+		g_stats.localAnswers++;
+		jsonResult = DNSRecordsToJson(hostname, local->json);
+	} else if (dnsServer.empty()) {
 		// --- System resolver ---
+		DNSRecords records;
 		// A records
 		struct hostent* he = gethostbyname(hostname.c_str());
 		if (he && he->h_addrtype == AF_INET) {
@@ -519,151 +7376,20 @@ static FMX_PROC(fmx::errcode) fDNS_Resolve_Extended(short /*funcId*/, const fmx:
 			records.emplace_back("CNAME", he->h_name);
 		}
 		// NOTE: System resolver does not provide MX, TXT, NS, etc.
+		jsonResult = DNSRecordsToJson(hostname, records);
 	} else {
 		// --- c-ares resolver ---
-		ares_channel channel;
-		struct ares_options options;
-		int optmask = 0;
-		memset(&options, 0, sizeof(options));
-		if (ares_init_options(&channel, &options, optmask) != ARES_SUCCESS)
-			return 1;
-		if (ares_set_servers_ports_csv(channel, dnsServer.c_str()) != ARES_SUCCESS) {
-			ares_destroy(channel);
-			return 1;
-		}
-
-		struct QueryType {
-			const char* type;
-			int dns_type;
-		};
-		QueryType queryTypes[] = {
-			{"A", ns_t_a},
-			{"AAAA", ns_t_aaaa},
-			{"CNAME", ns_t_cname},
-			{"MX", ns_t_mx},
-			{"TXT", ns_t_txt},
-			{"NS", ns_t_ns},
-			{"SRV", ns_t_srv},
-			{"PTR", ns_t_ptr}
-		};
-
-		struct CallbackData {
-			std::vector<std::pair<std::string, std::string>>* records;
-			std::string type;
-			bool done;
-		};
-
-		int outstanding = sizeof(queryTypes)/sizeof(QueryType);
-		std::vector<CallbackData> callbacks(outstanding);
-
-		auto callback = [](void* arg, int status, int timeouts, unsigned char* abuf, int alen) {
-			CallbackData* cb = static_cast<CallbackData*>(arg);
-			if (status == ARES_SUCCESS) {
-				// Parse DNS response
-				ns_msg handle;
-				if (ns_initparse(abuf, alen, &handle) == 0) {
-					int count = ns_msg_count(handle, ns_s_an);
-					for (int i = 0; i < count; ++i) {
-						ns_rr rr;
-						if (ns_parserr(&handle, ns_s_an, i, &rr) == 0) {
-							std::string value;
-							if (cb->type == "A" && ns_rr_type(rr) == ns_t_a) {
-								char ip[INET_ADDRSTRLEN];
-								inet_ntop(AF_INET, ns_rr_rdata(rr), ip, sizeof(ip));
-								value = ip;
-							} else if (cb->type == "AAAA" && ns_rr_type(rr) == ns_t_aaaa) {
-								char ip[INET6_ADDRSTRLEN];
-								inet_ntop(AF_INET6, ns_rr_rdata(rr), ip, sizeof(ip));
-								value = ip;
-							} else if (cb->type == "CNAME" && ns_rr_type(rr) == ns_t_cname) {
-								char cname[256];
-								dn_expand(abuf, abuf + alen, ns_rr_rdata(rr), cname, sizeof(cname));
-								value = cname;
-							} else if (cb->type == "MX" && ns_rr_type(rr) == ns_t_mx) {
-								uint16_t preference = (ns_rr_rdata(rr)[0] << 8) | ns_rr_rdata(rr)[1];
-								char mx[256];
-								dn_expand(abuf, abuf + alen, ns_rr_rdata(rr) + 2, mx, sizeof(mx));
-								value = std::to_string(preference) + " " + mx;
-							} else if (cb->type == "TXT" && ns_rr_type(rr) == ns_t_txt) {
-								const unsigned char* txt = ns_rr_rdata(rr);
-								int txt_len = *txt;
-								std::string txt_str(reinterpret_cast<const char*>(txt + 1), txt_len);
-								value = txt_str;
-							} else if (cb->type == "NS" && ns_rr_type(rr) == ns_t_ns) {
-								char nsdname[256];
-								dn_expand(abuf, abuf + alen, ns_rr_rdata(rr), nsdname, sizeof(nsdname));
-								value = nsdname;
-							} else if (cb->type == "SRV" && ns_rr_type(rr) == ns_t_srv) {
-								uint16_t priority = (ns_rr_rdata(rr)[0] << 8) | ns_rr_rdata(rr)[1];
-								uint16_t weight = (ns_rr_rdata(rr)[2] << 8) | ns_rr_rdata(rr)[3];
-								uint16_t port = (ns_rr_rdata(rr)[4] << 8) | ns_rr_rdata(rr)[5];
-								char target[256];
-								dn_expand(abuf, abuf + alen, ns_rr_rdata(rr) + 6, target, sizeof(target));
-								value = std::to_string(priority) + " " + std::to_string(weight) + " " + std::to_string(port) + " " + target;
-							} else if (cb->type == "PTR" && ns_rr_type(rr) == ns_t_ptr) {
-								char ptrdname[256];
-								dn_expand(abuf, abuf + alen, ns_rr_rdata(rr), ptrdname, sizeof(ptrdname));
-								value = ptrdname;
-							}
-							if (!value.empty())
-								cb->records->emplace_back(cb->type, value);
-						}
-					}
-				}
-			}
-			cb->done = true;
-		};
-
-		for (int i = 0; i < outstanding; ++i) {
-			callbacks[i].records = &records;
-			callbacks[i].type = queryTypes[i].type;
-			callbacks[i].done = false;
-			ares_query(channel, hostname.c_str(), ns_c_in, queryTypes[i].dns_type, callback, &callbacks[i]);
-		}
-
-		int totalWaitMs = 0;
-		while (true) {
-			bool all_done = true;
-			for (int i = 0; i < outstanding; ++i) {
-				if (!callbacks[i].done) {
-					all_done = false;
-					break;
-				}
-			}
-			if (all_done || totalWaitMs >= timeoutMs)
-				break;
-
-			fd_set read_fds, write_fds;
-			int nfds;
-			struct timeval tv, *tvp;
-
-			FD_ZERO(&read_fds);
-			FD_ZERO(&write_fds);
-			nfds = ares_fds(channel, &read_fds, &write_fds);
-			if (nfds == 0)
-				break;
-
-			tvp = ares_timeout(channel, nullptr, &tv);
-
-			int waitMs = (tvp->tv_sec * 1000) + (tvp->tv_usec / 1000);
-			if (waitMs > (timeoutMs - totalWaitMs))
-				waitMs = timeoutMs - totalWaitMs;
+		static const int queryTypes[] = { ns_t_a, ns_t_aaaa, ns_t_cname, ns_t_mx, ns_t_txt, ns_t_ns, ns_t_srv, ns_t_ptr };
 
-			struct timeval tv_limit = { waitMs / 1000, (waitMs % 1000) * 1000 };
-
-			int waited = select(nfds, &read_fds, &write_fds, nullptr, &tv_limit);
-			if (waited >= 0) {
-				ares_process(channel, &read_fds, &write_fds);
-				totalWaitMs += waitMs;
-			} else {
-				break; // select error
-			}
-		}
-		ares_destroy(channel);
+		// All record types go to the same upstream; a failing type fails the attempt over as a whole.
+		// The cache keeps the records array, so a hit only fills in the hostname and stale flag.
+		CachedAnswer answer = cachedLookup(cacheKey("EXT", hostname, routed ? dnsServer : std::string()), upstreams, timeoutMs, [hostname](Attempt& attempt) {
+			for (int queryType : queryTypes)
+				sendQuery(attempt, hostname, queryType);
+		}, DNSRecordsToJsonArray);
+		jsonResult = DNSRecordsToJson(hostname, answer.rendered, answer.stale);
 	}
 
-	std::string jsonResult = DNSRecordsToJson(hostname, records);
-
 	fmx::TextUniquePtr outText;
 	outText->Assign(jsonResult.c_str(), fmx::Text::kEncoding_UTF8);
 	results.SetAsText(*outText, dataVect.At(0).GetLocale());
@@ -682,12 +7408,31 @@ enum {
 	kfDNS_DNSInitID = 303,
 	kfDNS_DNSUninitID = 304,
 	kfDNS_DNSGetSysServerID = 305,
-	kfDNS_DNSGetCurServerID = 306
+	kfDNS_DNSGetCurServerID = 306,
+	kfDNS_DNSSetHedgingID = 308,
+	kfDNS_DNSGetStatsID = 309,
+	kfDNS_DNSGetServerStatsID = 310,
+	kfDNS_DNSSetStaleID = 311,
+	kfDNS_DNSSetSnapshotID = 312,
+	kfDNS_DNSSetSharedCacheID = 313,
+	kfDNS_DNSSetCacheSizeID = 314,
+	kfDNS_DNSBenchmarkCacheID = 315,
+	kfDNS_DNSCacheFlushID = 316,
+	kfDNS_DNSCachePinID = 317,
+	kfDNS_DNSCacheDumpID = 318,
+	kfDNS_DNSSetLocalZoneID = 319,
+	kfDNS_DNSSetRouteID = 320,
+	kfDNS_DNSGetRoutesID = 321,
+	kfDNS_DNSSetSearchID = 322,
+	kfDNS_DNSBenchmarkTCPID = 323,
+	kfDNS_DNSConfigureID = 324,
+	kfDNS_DNSGetConfigurationID = 325,
+	kfDNS_DNSResolveBulkID = 326
 };
 
 static const char* kfDNS_DNSResolveName = "fDNS_Resolve";
-static const char* kfDNS_DNSResolveDefinition = "fDNS_Resolve(hostname {; timeoutMs})";
-static const char* kfDNS_DNSResolveDescription = "Resolves a hostname to an IPv4 address using the current DNS server";
+static const char* kfDNS_DNSResolveDefinition = "fDNS_Resolve(hostname {; timeoutMs; family; allAddresses})";
+static const char* kfDNS_DNSResolveDescription = "Resolves a hostname to an IPv4 and/or IPv6 address (family 4, 6 or any) using the current DNS server";
 
 static const char* kfDNS_DNSResolveExtendedName = "fDNS_Resolve_Extended";
 static const char* kfDNS_DNSResolveExtendedDefinition = "fDNS_Resolve_Extended(hostname {; timeoutMs})";
@@ -717,6 +7462,86 @@ static const char* kfDNS_DNSGetCurServerName = "fDNS_Get_Current_Server";
 static const char* kfDNS_DNSGetCurServerDefinition = "fDNS_Get_Current_Server";
 static const char* kfDNS_DNSGetCurServerDescription = "Returns the DNS server currently set in the plugin";
 
+static const char* kfDNS_DNSSetHedgingName = "fDNS_Set_Hedging";
+static const char* kfDNS_DNSSetHedgingDefinition = "fDNS_Set_Hedging(enabled {; delayMs})";
+static const char* kfDNS_DNSSetHedgingDescription = "Also queries the next DNS server when the current one has not answered within delayMs (default: its observed p90 latency)";
+
+static const char* kfDNS_DNSGetStatsName = "fDNS_Get_Stats";
+static const char* kfDNS_DNSGetStatsDefinition = "fDNS_Get_Stats";
+static const char* kfDNS_DNSGetStatsDescription = "Returns the plugin's lookup statistics as a JSON string";
+
+static const char* kfDNS_DNSGetServerStatsName = "fDNS_Get_Server_Stats";
+static const char* kfDNS_DNSGetServerStatsDefinition = "fDNS_Get_Server_Stats";
+static const char* kfDNS_DNSGetServerStatsDescription = "Returns RTT statistics and retransmit timeouts of each DNS server as a JSON array";
+
+static const char* kfDNS_DNSSetStaleName = "fDNS_Set_Stale";
+static const char* kfDNS_DNSSetStaleDefinition = "fDNS_Set_Stale(windowSeconds {; clientTimeoutMs})";
+static const char* kfDNS_DNSSetStaleDescription = "Serves expired cached answers for up to windowSeconds when the DNS servers fail or are slower than clientTimeoutMs (0 disables)";
+
+static const char* kfDNS_DNSSetSnapshotName = "fDNS_Set_Snapshot";
+static const char* kfDNS_DNSSetSnapshotDefinition = "fDNS_Set_Snapshot(path)";
+static const char* kfDNS_DNSSetSnapshotDescription = "Sets the file the answer cache is saved to and restored from across plugin restarts (empty disables)";
+
+static const char* kfDNS_DNSSetSharedCacheName = "fDNS_Set_Shared_Cache";
+static const char* kfDNS_DNSSetSharedCacheDefinition = "fDNS_Set_Shared_Cache(name {; sizeMB})";
+static const char* kfDNS_DNSSetSharedCacheDescription = "Shares cached answers with the other fDNS instances on this host through the named shared memory cache (empty disables)";
+
+static const char* kfDNS_DNSSetCacheSizeName = "fDNS_Set_Cache_Size";
+static const char* kfDNS_DNSSetCacheSizeDefinition = "fDNS_Set_Cache_Size(kilobytes)";
+static const char* kfDNS_DNSSetCacheSizeDescription = "Sets the memory budget of the answer cache in kilobytes (0 disables caching)";
+
+#ifdef FDNS_BENCHMARKS
+static const char* kfDNS_DNSBenchmarkCacheName = "fDNS_Benchmark_Cache";
+static const char* kfDNS_DNSBenchmarkCacheDefinition = "fDNS_Benchmark_Cache({maxThreads; durationMs})";
+static const char* kfDNS_DNSBenchmarkCacheDescription = "Measures cache hit throughput from 1 to maxThreads threads (default 64) and returns the results as JSON";
+#endif
+
+static const char* kfDNS_DNSCacheFlushName = "fDNS_Cache_Flush";
+static const char* kfDNS_DNSCacheFlushDefinition = "fDNS_Cache_Flush(name {; includeSubdomains})";
+static const char* kfDNS_DNSCacheFlushDescription = "Removes the cached answers for a name (and its subdomains) and returns how many were removed";
+
+static const char* kfDNS_DNSCachePinName = "fDNS_Cache_Pin";
+static const char* kfDNS_DNSCachePinDefinition = "fDNS_Cache_Pin(name {; pinned})";
+static const char* kfDNS_DNSCachePinDescription = "Keeps the cached answers for a name from ever being evicted (pinned = 0 releases it)";
+
+static const char* kfDNS_DNSCacheDumpName = "fDNS_Cache_Dump";
+static const char* kfDNS_DNSCacheDumpDefinition = "fDNS_Cache_Dump";
+static const char* kfDNS_DNSCacheDumpDescription = "Returns the entries of the answer cache as a JSON array";
+
+static const char* kfDNS_DNSSetLocalZoneName = "fDNS_Set_Local_Zone";
+static const char* kfDNS_DNSSetLocalZoneDefinition = "fDNS_Set_Local_Zone(path)";
+static const char* kfDNS_DNSSetLocalZoneDescription = "Answers the names in a hosts or zone file before querying DNS; reloaded when the file changes (empty disables)";
+
+static const char* kfDNS_DNSSetRouteName = "fDNS_Set_Route";
+static const char* kfDNS_DNSSetRouteDefinition = "fDNS_Set_Route(suffix; dnsServer)";
+static const char* kfDNS_DNSSetRouteDescription = "Sends the lookups of names under a domain suffix to their own DNS server(s) (empty removes the route)";
+
+static const char* kfDNS_DNSGetRoutesName = "fDNS_Get_Routes";
+static const char* kfDNS_DNSGetRoutesDefinition = "fDNS_Get_Routes";
+static const char* kfDNS_DNSGetRoutesDescription = "Returns the domain suffix routes and their DNS servers as a JSON array";
+
+static const char* kfDNS_DNSSetSearchName = "fDNS_Set_Search";
+static const char* kfDNS_DNSSetSearchDefinition = "fDNS_Set_Search(domains {; ndots})";
+static const char* kfDNS_DNSSetSearchDescription = "Sets the search list and ndots applied to hostnames (\"\" = names as given, \"*\" = system default)";
+
+#ifdef FDNS_BENCHMARKS
+static const char* kfDNS_DNSBenchmarkTCPName = "fDNS_Benchmark_TCP";
+static const char* kfDNS_DNSBenchmarkTCPDefinition = "fDNS_Benchmark_TCP(server {; queries; depth})";
+static const char* kfDNS_DNSBenchmarkTCPDescription = "Measures queries per second to a server over new, reused and pipelined TCP (TLS, HTTPS) connections and returns the results as JSON";
+#endif
+
+static const char* kfDNS_DNSConfigureName = "fDNS_Configure";
+static const char* kfDNS_DNSConfigureDefinition = "fDNS_Configure(json)";
+static const char* kfDNS_DNSConfigureDescription = "Sets timeouts, tries, rotation, EDNS0 payload size, UDP port reuse and socket buffer sizes from a JSON object";
+
+static const char* kfDNS_DNSGetConfigurationName = "fDNS_Get_Configuration";
+static const char* kfDNS_DNSGetConfigurationDefinition = "fDNS_Get_Configuration";
+static const char* kfDNS_DNSGetConfigurationDescription = "Returns the options set with fDNS_Configure, defaults included, as a JSON object";
+
+static const char* kfDNS_DNSResolveBulkName = "fDNS_Resolve_Bulk";
+static const char* kfDNS_DNSResolveBulkDefinition = "fDNS_Resolve_Bulk(inputPath; outputPath {; type; maxInFlight})";
+static const char* kfDNS_DNSResolveBulkDescription = "Resolves the names in a file (one per line) over UDP and writes name, status and records per line to another; returns a JSON summary";
+
 // Plugin Initialization ===================================================================
 
 static FMX_PROC(fmx::errcode) fDNS_Plugin_Initialize(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect&, fmx::Data&)
@@ -757,6 +7582,246 @@ static FMX_PROC(fmx::errcode) fDNS_Plugin_Get_Current_Server(short /*funcId*/, c
 	return 0;
 }
 
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Set_Hedging(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	if (dataVect.Size() < 1)
+		return 956;
+	bool enabled = GetIntFromDataVect(dataVect, 0) != 0;
+	int delayMs = 0;
+	if (dataVect.Size() > 1) {
+		delayMs = GetIntFromDataVect(dataVect, 1);
+		if (delayMs < 0) return 956;
+	}
+	return fDNS_Set_Hedging(enabled, delayMs);
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Get_Stats(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect&, fmx::Data& results)
+{
+	std::string stats = fDNS_Get_Stats();
+	fmx::TextUniquePtr outText;
+	outText->Assign(stats.c_str(), fmx::Text::kEncoding_UTF8);
+	results.SetAsText(*outText, results.GetLocale());
+	return 0;
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Get_Server_Stats(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect&, fmx::Data& results)
+{
+	std::string stats = fDNS_Get_Server_Stats();
+	fmx::TextUniquePtr outText;
+	outText->Assign(stats.c_str(), fmx::Text::kEncoding_UTF8);
+	results.SetAsText(*outText, results.GetLocale());
+	return 0;
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Set_Stale(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	int windowSec = GetIntFromDataVect(dataVect, 0);
+	if (windowSec < 0)
+		return 956;
+	int clientTimeoutMs = 0;
+	if (dataVect.Size() > 1)
+		clientTimeoutMs = GetIntFromDataVect(dataVect, 1);
+	return fDNS_Set_Stale(windowSec, clientTimeoutMs);
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Set_Snapshot(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	return fDNS_Set_Snapshot(getString(dataVect.At(0).GetAsText()));
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Set_Shared_Cache(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	int sizeMB = DEFAULT_SHARED_CACHE_MB;
+	if (dataVect.Size() > 1) {
+		sizeMB = GetIntFromDataVect(dataVect, 1);
+		if (sizeMB < 1 || sizeMB > MAX_SHARED_CACHE_MB)
+			return 956;
+	}
+	return fDNS_Set_Shared_Cache(getString(dataVect.At(0).GetAsText()), sizeMB);
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Set_Cache_Size(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	int kilobytes = GetIntFromDataVect(dataVect, 0);
+	if (kilobytes < 0)
+		return 956;
+	return fDNS_Set_Cache_Size(kilobytes);
+}
+
+#ifdef FDNS_BENCHMARKS
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Benchmark_Cache(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data& results)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	int maxThreads = MAX_BENCHMARK_THREADS;
+	int durationMs = DEFAULT_BENCHMARK_DURATION;
+	if (dataVect.Size() > 0) {
+		maxThreads = GetIntFromDataVect(dataVect, 0);
+		if (maxThreads < 1 || maxThreads > MAX_BENCHMARK_THREADS)
+			return 956;
+	}
+	if (dataVect.Size() > 1) {
+		durationMs = GetIntFromDataVect(dataVect, 1);
+		if (durationMs < 1 || durationMs > 10000)
+			return 956;
+	}
+	std::string benchmark = fDNS_Benchmark_Cache(maxThreads, durationMs);
+	fmx::TextUniquePtr outText;
+	outText->Assign(benchmark.c_str(), fmx::Text::kEncoding_UTF8);
+	results.SetAsText(*outText, results.GetLocale());
+	return 0;
+}
+#endif
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Cache_Flush(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data& results)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	std::string name = getString(dataVect.At(0).GetAsText());
+	bool includeSubdomains = dataVect.Size() > 1 && GetIntFromDataVect(dataVect, 1) != 0;
+	size_t flushed = 0;
+	fmx::errcode err = fDNS_Cache_Flush(name, includeSubdomains, flushed);
+	if (err != 0)
+		return err;
+	fmx::FixPtUniquePtr count;
+	count->AssignInt(static_cast<fmx::int32>(flushed));
+	results.SetAsNumber(*count);
+	return 0;
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Cache_Pin(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	std::string name = getString(dataVect.At(0).GetAsText());
+	bool pinned = dataVect.Size() < 2 || GetIntFromDataVect(dataVect, 1) != 0;
+	return fDNS_Cache_Pin(name, pinned);
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Set_Route(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 2)
+		return 956;
+	return fDNS_Set_Route(getString(dataVect.At(0).GetAsText()), getString(dataVect.At(1).GetAsText()));
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Get_Routes(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect&, fmx::Data& results)
+{
+	std::string json = fDNS_Get_Routes();
+	fmx::TextUniquePtr outText;
+	outText->Assign(json.c_str(), fmx::Text::kEncoding_UTF8);
+	results.SetAsText(*outText, results.GetLocale());
+	return 0;
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Set_Search(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	int ndots = dataVect.Size() > 1 ? GetIntFromDataVect(dataVect, 1) : -1;
+	return fDNS_Set_Search(getString(dataVect.At(0).GetAsText()), ndots);
+}
+
+#ifdef FDNS_BENCHMARKS
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Benchmark_TCP(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data& results)
+{
+	// The connections need OpenSSL and curl set up by fDNS_Initialize
+	if (!g_dnsInitialized)
+		return 1;
+	if (dataVect.Size() < 1)
+		return 956;
+	int queries = DEFAULT_TCP_BENCHMARK_QUERIES;
+	int depth = DEFAULT_TCP_BENCHMARK_DEPTH;
+	if (dataVect.Size() > 1) {
+		queries = GetIntFromDataVect(dataVect, 1);
+		if (queries < 1 || queries > MAX_TCP_BENCHMARK_QUERIES)
+			return 956;
+	}
+	if (dataVect.Size() > 2) {
+		depth = GetIntFromDataVect(dataVect, 2);
+		if (depth < 1 || depth > MAX_TCP_BENCHMARK_DEPTH)
+			return 956;
+	}
+	std::string benchmark;
+	fmx::errcode error = fDNS_Benchmark_TCP(getString(dataVect.At(0).GetAsText()), queries, depth, benchmark);
+	if (error != 0)
+		return error;
+	fmx::TextUniquePtr outText;
+	outText->Assign(benchmark.c_str(), fmx::Text::kEncoding_UTF8);
+	results.SetAsText(*outText, results.GetLocale());
+	return 0;
+}
+#endif
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Configure(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	return fDNS_Configure(getString(dataVect.At(0).GetAsText()));
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Get_Configuration(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect&, fmx::Data& results)
+{
+	std::string json = fDNS_Get_Configuration();
+	fmx::TextUniquePtr outText;
+	outText->Assign(json.c_str(), fmx::Text::kEncoding_UTF8);
+	results.SetAsText(*outText, results.GetLocale());
+	return 0;
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Resolve_Bulk(short /*funcId*/, const fmx::ExprEnv& env, const fmx::DataVect& dataVect, fmx::Data& results)
+{
+	if (dataVect.Size() < 2)
+		return 956;
+	std::string type = dataVect.Size() > 2 ? getString(dataVect.At(2).GetAsText()) : "A";
+	if (type.empty())
+		type = "A";
+	int maxInFlight = DEFAULT_BULK_IN_FLIGHT;
+	if (dataVect.Size() > 3) {
+		maxInFlight = GetIntFromDataVect(dataVect, 3);
+		if (maxInFlight < 1 || maxInFlight > MAX_BULK_IN_FLIGHT)
+			return 956;
+	}
+	std::string summary;
+	fmx::ptrtype owner = env.SessionID() != 0 ? env.SessionID() : env.FileID();
+	fmx::errcode error = fDNS_Resolve_Bulk(getString(dataVect.At(0).GetAsText()), getString(dataVect.At(1).GetAsText()),
+										   type, maxInFlight, owner, summary);
+	if (error != 0)
+		return error;
+	fmx::TextUniquePtr outText;
+	outText->Assign(summary.c_str(), fmx::Text::kEncoding_UTF8);
+	results.SetAsText(*outText, results.GetLocale());
+	return 0;
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Set_Local_Zone(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect& dataVect, fmx::Data&)
+{
+	if (dataVect.Size() < 1)
+		return 956;
+	return fDNS_Set_Local_Zone(getString(dataVect.At(0).GetAsText()));
+}
+
+static FMX_PROC(fmx::errcode) fDNS_Plugin_Cache_Dump(short /*funcId*/, const fmx::ExprEnv&, const fmx::DataVect&, fmx::Data& results)
+{
+	if (!g_dnsInitialized)
+		return 1;
+	std::string dump = fDNS_Cache_Dump();
+	fmx::TextUniquePtr outText;
+	outText->Assign(dump.c_str(), fmx::Text::kEncoding_UTF8);
+	results.SetAsText(*outText, results.GetLocale());
+	return 0;
+}
+
 static fmx::ptrtype Do_PluginInit(fmx::int16 version)
 {
 	fmx::ptrtype result = static_cast<fmx::ptrtype>(kDoNotEnable);
@@ -788,7 +7853,7 @@ static fmx::ptrtype Do_PluginInit(fmx::int16 version)
 		name->Assign(kfDNS_DNSResolveName, fmx::Text::kEncoding_UTF8);
 		definition->Assign(kfDNS_DNSResolveDefinition, fmx::Text::kEncoding_UTF8);
 		description->Assign(kfDNS_DNSResolveDescription, fmx::Text::kEncoding_UTF8);
-		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSResolveID, *name, *definition, *description, 1, 2, flags, fDNS_Resolve) == 0);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSResolveID, *name, *definition, *description, 1, 4, flags, fDNS_Resolve) == 0);
 
 		name->Assign(kfDNS_DNSReverseName, fmx::Text::kEncoding_UTF8);
 		definition->Assign(kfDNS_DNSReverseDefinition, fmx::Text::kEncoding_UTF8);
@@ -809,6 +7874,105 @@ static fmx::ptrtype Do_PluginInit(fmx::int16 version)
 		definition->Assign(kfDNS_DNSGetCurServerDefinition, fmx::Text::kEncoding_UTF8);
 		description->Assign(kfDNS_DNSGetCurServerDescription, fmx::Text::kEncoding_UTF8);
 		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSGetCurServerID, *name, *definition, *description, 0, 0, flags, fDNS_Plugin_Get_Current_Server) == 0);
+
+		name->Assign(kfDNS_DNSSetHedgingName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSSetHedgingDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSSetHedgingDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSSetHedgingID, *name, *definition, *description, 1, 2, flags, fDNS_Plugin_Set_Hedging) == 0);
+
+		name->Assign(kfDNS_DNSGetStatsName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSGetStatsDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSGetStatsDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSGetStatsID, *name, *definition, *description, 0, 0, flags, fDNS_Plugin_Get_Stats) == 0);
+
+		name->Assign(kfDNS_DNSGetServerStatsName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSGetServerStatsDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSGetServerStatsDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSGetServerStatsID, *name, *definition, *description, 0, 0, flags, fDNS_Plugin_Get_Server_Stats) == 0);
+
+		name->Assign(kfDNS_DNSSetStaleName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSSetStaleDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSSetStaleDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSSetStaleID, *name, *definition, *description, 1, 2, flags, fDNS_Plugin_Set_Stale) == 0);
+
+		name->Assign(kfDNS_DNSSetSnapshotName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSSetSnapshotDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSSetSnapshotDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSSetSnapshotID, *name, *definition, *description, 1, 1, flags, fDNS_Plugin_Set_Snapshot) == 0);
+
+		name->Assign(kfDNS_DNSSetSharedCacheName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSSetSharedCacheDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSSetSharedCacheDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSSetSharedCacheID, *name, *definition, *description, 1, 2, flags, fDNS_Plugin_Set_Shared_Cache) == 0);
+
+		name->Assign(kfDNS_DNSSetCacheSizeName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSSetCacheSizeDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSSetCacheSizeDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSSetCacheSizeID, *name, *definition, *description, 1, 1, flags, fDNS_Plugin_Set_Cache_Size) == 0);
+
+#ifdef FDNS_BENCHMARKS
+		name->Assign(kfDNS_DNSBenchmarkCacheName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSBenchmarkCacheDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSBenchmarkCacheDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSBenchmarkCacheID, *name, *definition, *description, 0, 2, flags, fDNS_Plugin_Benchmark_Cache) == 0);
+#endif
+
+		name->Assign(kfDNS_DNSCacheFlushName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSCacheFlushDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSCacheFlushDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSCacheFlushID, *name, *definition, *description, 1, 2, flags, fDNS_Plugin_Cache_Flush) == 0);
+
+		name->Assign(kfDNS_DNSCachePinName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSCachePinDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSCachePinDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSCachePinID, *name, *definition, *description, 1, 2, flags, fDNS_Plugin_Cache_Pin) == 0);
+
+		name->Assign(kfDNS_DNSCacheDumpName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSCacheDumpDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSCacheDumpDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSCacheDumpID, *name, *definition, *description, 0, 0, flags, fDNS_Plugin_Cache_Dump) == 0);
+
+		name->Assign(kfDNS_DNSSetLocalZoneName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSSetLocalZoneDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSSetLocalZoneDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSSetLocalZoneID, *name, *definition, *description, 1, 1, flags, fDNS_Plugin_Set_Local_Zone) == 0);
+
+		name->Assign(kfDNS_DNSSetRouteName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSSetRouteDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSSetRouteDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSSetRouteID, *name, *definition, *description, 2, 2, flags, fDNS_Plugin_Set_Route) == 0);
+
+		name->Assign(kfDNS_DNSGetRoutesName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSGetRoutesDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSGetRoutesDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSGetRoutesID, *name, *definition, *description, 0, 0, flags, fDNS_Plugin_Get_Routes) == 0);
+
+		name->Assign(kfDNS_DNSSetSearchName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSSetSearchDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSSetSearchDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSSetSearchID, *name, *definition, *description, 1, 2, flags, fDNS_Plugin_Set_Search) == 0);
+
+#ifdef FDNS_BENCHMARKS
+		name->Assign(kfDNS_DNSBenchmarkTCPName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSBenchmarkTCPDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSBenchmarkTCPDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSBenchmarkTCPID, *name, *definition, *description, 1, 3, flags, fDNS_Plugin_Benchmark_TCP) == 0);
+#endif
+
+		name->Assign(kfDNS_DNSConfigureName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSConfigureDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSConfigureDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSConfigureID, *name, *definition, *description, 1, 1, flags, fDNS_Plugin_Configure) == 0);
+
+		name->Assign(kfDNS_DNSGetConfigurationName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSGetConfigurationDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSGetConfigurationDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSGetConfigurationID, *name, *definition, *description, 0, 0, flags, fDNS_Plugin_Get_Configuration) == 0);
+
+		name->Assign(kfDNS_DNSResolveBulkName, fmx::Text::kEncoding_UTF8);
+		definition->Assign(kfDNS_DNSResolveBulkDefinition, fmx::Text::kEncoding_UTF8);
+		description->Assign(kfDNS_DNSResolveBulkDescription, fmx::Text::kEncoding_UTF8);
+		ok &= (fmx::ExprEnv::RegisterExternalFunctionEx(*pluginID, kfDNS_DNSResolveBulkID, *name, *definition, *description, 2, 4, flags, fDNS_Plugin_Resolve_Bulk) == 0);
 	}
 
 	if (ok)
@@ -833,7 +7997,35 @@ static void Do_PluginShutdown(fmx::int16 version)
 		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSGetSysServerID);
 		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSGetCurServerID);
 		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSResolveExtendedID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSSetHedgingID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSGetStatsID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSGetServerStatsID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSSetStaleID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSSetSnapshotID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSSetSharedCacheID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSSetCacheSizeID);
+#ifdef FDNS_BENCHMARKS
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSBenchmarkCacheID);
+#endif
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSCacheFlushID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSCachePinID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSCacheDumpID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSSetLocalZoneID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSSetRouteID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSGetRoutesID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSSetSearchID);
+#ifdef FDNS_BENCHMARKS
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSBenchmarkTCPID);
+#endif
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSConfigureID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSGetConfigurationID);
+		fmx::ExprEnv::UnRegisterExternalFunction(*pluginID, kfDNS_DNSResolveBulkID);
 	}
+
+	// Keep the answer cache for the next start when FileMaker quits without fDNS_Uninitialize
+	if (g_dnsInitialized)
+		saveSnapshot(fDNS_Get_Current_Server(), true);
+	joinSnapshotWriter();
 }
 
 // Get String Handler ======================================================================
@@ -863,7 +8055,7 @@ static void Do_GetString(fmx::uint32 whichString, fmx::uint32 /*winLangID*/, fmx
 			outBuffer[5] = 'n';  // No config dialog
 			outBuffer[6] = 'n';
 			outBuffer[7] = 'Y';  // Register init/shutdown
-			outBuffer[8] = 'n';
+			outBuffer[8] = 'Y';  // Idle callbacks (background probes, refreshes, prefetching and cache snapshots)
 			outBuffer[9] = 'n';
 			outBuffer[10] = 'n';
 			outBuffer[11] = 0;
@@ -877,9 +8069,38 @@ static void Do_GetString(fmx::uint32 whichString, fmx::uint32 /*winLangID*/, fmx
 	}
 }
 
+// Idle Processing =========================================================================
+
+static void Do_PluginIdle(FMX_IdleLevel idleLevel, fmx::ptrtype)
+{
+	if (idleLevel == kFMXT_Unsafe)
+		return;
+
+	std::vector<UpstreamPtr> upstreams;
+	std::string dnsServer;
+	{
+		std::lock_guard<std::mutex> lock(g_dnsMutex);
+		if (!g_dnsInitialized)
+			return;
+		upstreams = allUpstreams();
+		dnsServer = g_currentDnsServer;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_probeMutex);
+		startProbes(upstreams);
+		pumpProbes();
+	}
+	pumpStreams(upstreams);
+	startPrefetches();
+	pumpBackgroundLookups();
+	saveSnapshotPeriodically(dnsServer);
+	checkLocalZone();
+	checkSystemConfig();
+}
+
 // Unused Callbacks ========================================================================
 
-static void Do_PluginIdle(FMX_IdleLevel, fmx::ptrtype) {}
 static void Do_PluginPrefs(void) {}
 static void Do_SessionNotifications(fmx::uint64) {}
 static void Do_FileNotifications(fmx::uint64, fmx::uint64) {}
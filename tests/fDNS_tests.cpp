@@ -0,0 +1,606 @@
+//
+//  fDNS_tests.cpp
+//  fDNS
+//
+//  Unit tests of the parsers, the local zone, the timer wheel, the answer cache, the response
+//  decoder, the bulk engine and the TCP benchmark. The plugin source is compiled into the test
+//  program, so its static functions can be called directly; the bulk engine and the benchmark
+//  run against a small DNS server on the loopback interface. Build and run with "make test".
+//
+
+#include "../fDNS/fDNS.cpp"
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <thread>
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+			g_failures++; \
+		} \
+	} while (0)
+
+// Test server ==============================================================================
+//
+// Answers every A query over UDP and TCP with 10.1.2.3, on ports picked by the system
+
+class TestServer {
+public:
+	TestServer()
+	{
+		m_udp = bindLoopback(SOCK_DGRAM, m_udpPort);
+		m_listener = bindLoopback(SOCK_STREAM, m_tcpPort);
+		listen(m_listener, 64);
+		m_thread = std::thread([this] { serve(); });
+	}
+
+	~TestServer()
+	{
+		m_stop = true;
+		m_thread.join();
+		for (const auto& client : m_clients)
+			close(client.first);
+		close(m_udp);
+		close(m_listener);
+	}
+
+	std::string udpServer() const { return "127.0.0.1:" + std::to_string(m_udpPort); }
+
+	void tcpAddress(struct sockaddr_storage& address, socklen_t& length) const
+	{
+		parseEndpoint("127.0.0.1:" + std::to_string(m_tcpPort), DNS_PORT, address, length);
+	}
+
+	static std::string answer(const std::string& query)
+	{
+		size_t end = NS_HFIXEDSZ;
+		while (end < query.size() && query[end] != 0)
+			end += 1 + static_cast<unsigned char>(query[end]);
+		end += 1 + NS_QFIXEDSZ;
+		if (query.size() < NS_HFIXEDSZ || end > query.size())
+			return std::string();
+		std::string response = query.substr(0, 2) + std::string("\x81\x80\x00\x01\x00\x01\x00\x00\x00\x00", 10);
+		response += query.substr(NS_HFIXEDSZ, end - NS_HFIXEDSZ);
+		response += std::string("\xc0\x0c\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04\x0a\x01\x02\x03", 16);
+		return response;
+	}
+
+private:
+	static int bindLoopback(int type, int& port)
+	{
+		int fd = socket(AF_INET, type, 0);
+		// Room for a whole bulk window of queries
+		int bufferSize = 8 * 1024 * 1024;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+		struct sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t length = sizeof(address);
+		bind(fd, reinterpret_cast<struct sockaddr*>(&address), length);
+		getsockname(fd, reinterpret_cast<struct sockaddr*>(&address), &length);
+		port = ntohs(address.sin_port);
+		return fd;
+	}
+
+	void serve()
+	{
+		char buffer[4096];
+		while (!m_stop) {
+			std::vector<struct pollfd> fds = { { m_udp, POLLIN, 0 }, { m_listener, POLLIN, 0 } };
+			for (const auto& client : m_clients)
+				fds.push_back({ client.first, POLLIN, 0 });
+			if (poll(fds.data(), fds.size(), 50) <= 0)
+				continue;
+			if (fds[0].revents & POLLIN) {
+				struct sockaddr_storage from;
+				socklen_t fromLength = sizeof(from);
+				ssize_t received;
+				while ((received = recvfrom(m_udp, buffer, sizeof(buffer), MSG_DONTWAIT, reinterpret_cast<struct sockaddr*>(&from), &fromLength)) > 0) {
+					std::string response = answer(std::string(buffer, static_cast<size_t>(received)));
+					sendto(m_udp, response.data(), response.size(), 0, reinterpret_cast<struct sockaddr*>(&from), fromLength);
+					fromLength = sizeof(from);
+				}
+			}
+			if (fds[1].revents & POLLIN) {
+				int client = accept(m_listener, nullptr, nullptr);
+				if (client >= 0)
+					m_clients[client];
+			}
+			for (size_t i = 2; i < fds.size(); ++i) {
+				if (!fds[i].revents)
+					continue;
+				ssize_t received = recv(fds[i].fd, buffer, sizeof(buffer), 0);
+				if (received <= 0) {
+					close(fds[i].fd);
+					m_clients.erase(fds[i].fd);
+					continue;
+				}
+				std::string& pending = m_clients[fds[i].fd];
+				pending.append(buffer, static_cast<size_t>(received));
+				while (pending.size() >= 2) {
+					size_t length = (static_cast<unsigned char>(pending[0]) << 8) | static_cast<unsigned char>(pending[1]);
+					if (pending.size() < 2 + length)
+						break;
+					std::string response = answer(pending.substr(2, length));
+					pending.erase(0, 2 + length);
+					std::string framed = { static_cast<char>(response.size() >> 8), static_cast<char>(response.size() & 0xff) };
+					framed += response;
+					send(fds[i].fd, framed.data(), framed.size(), MSG_NOSIGNAL);
+				}
+			}
+		}
+	}
+
+	int m_udp = -1;
+	int m_listener = -1;
+	int m_udpPort = 0;
+	int m_tcpPort = 0;
+	std::map<int, std::string> m_clients; // TCP connections and the bytes read from them
+	std::atomic<bool> m_stop { false };
+	std::thread m_thread;
+};
+
+// Zone files ===============================================================================
+
+static void testZoneLines()
+{
+	auto lines = zoneLines("$ORIGIN example.com.\n"
+						   "; a comment line\n"
+						   "www 3600 IN A 10.0.0.1 # trailing comment\n"
+						   "   IN AAAA ::1\n"
+						   "txt IN TXT \"two words\" \"\"\n"
+						   "@ IN SOA ns hostmaster (\n"
+						   "    1 ; serial\n"
+						   "    7200 3600 )\n"
+						   "\n");
+	CHECK(lines.size() == 5);
+	if (lines.size() != 5)
+		return;
+	CHECK((lines[0] == std::vector<std::string> { "$ORIGIN", "example.com." }));
+	CHECK((lines[1] == std::vector<std::string> { "www", "3600", "IN", "A", "10.0.0.1" }));
+	// A line starting with white space belongs to the previous owner
+	CHECK((lines[2] == std::vector<std::string> { "", "IN", "AAAA", "::1" }));
+	CHECK((lines[3] == std::vector<std::string> { "txt", "IN", "TXT", "two words", "" }));
+	CHECK((lines[4] == std::vector<std::string> { "@", "IN", "SOA", "ns", "hostmaster", "1", "7200", "3600" }));
+
+	CHECK(zoneLines("").empty());
+	CHECK(zoneLines("# only a comment\n\n   \n").empty());
+}
+
+static void testLocalZone()
+{
+	LocalZone empty;
+	CHECK(empty.build(std::vector<LocalName>()));
+	CHECK(empty.find("printer1") == nullptr);
+
+	std::vector<LocalName> names;
+	for (int i = 0; i < 5000; ++i) {
+		LocalName name;
+		name.name = "host" + std::to_string(i) + ".lab.example";
+		name.ipv4 = "10.0." + std::to_string(i / 256) + "." + std::to_string(i % 256);
+		names.push_back(name);
+	}
+	LocalZone zone;
+	CHECK(zone.build(std::move(names)));
+	CHECK(zone.size() == 5000);
+	bool allFound = true;
+	for (int i = 0; i < 5000; ++i) {
+		const LocalName* name = zone.find("host" + std::to_string(i) + ".lab.example");
+		allFound = allFound && name && name->ipv4 == "10.0." + std::to_string(i / 256) + "." + std::to_string(i % 256);
+	}
+	CHECK(allFound);
+	// Names compare without case and without the trailing dot
+	const LocalName* name = zone.find("HOST42.Lab.Example.");
+	CHECK(name && name->name == "host42.lab.example");
+	CHECK(zone.find("host5000.lab.example") == nullptr);
+	CHECK(zone.find("host42.lab.exampl") == nullptr);
+	CHECK(zone.find("host42.lab.example.com") == nullptr);
+	CHECK(zone.find("") == nullptr);
+	CHECK(zone.find(".") == nullptr);
+}
+
+// Options ==================================================================================
+
+static void testParseFlatJsonObject()
+{
+	std::vector<std::pair<std::string, std::string>> members;
+	CHECK(parseFlatJsonObject(" { \"timeoutMs\" : 200, \"rotate\":true,\"tries\":-3 } ", members));
+	CHECK((members == std::vector<std::pair<std::string, std::string>> { { "timeoutMs", "200" }, { "rotate", "true" }, { "tries", "-3" } }));
+
+	members.clear();
+	CHECK(parseFlatJsonObject("{}", members));
+	CHECK(members.empty());
+
+	const char* const invalid[] = {
+		"",
+		"[]",
+		"{",
+		"{\"a\":}",
+		"{\"a\" 1}",
+		"{\"a\":1,}",
+		"{\"a\":1} x",
+		"{\"a\":\"text\"}",
+		"{\"a\":{\"b\":1}}",
+		"{\"a\\\"b\":1}",
+		"{a:1}",
+	};
+	for (const char* json : invalid) {
+		members.clear();
+		if (parseFlatJsonObject(json, members)) {
+			std::cerr << "parseFlatJsonObject accepted " << json << std::endl;
+			g_failures++;
+		}
+	}
+}
+
+// Timer wheel ==============================================================================
+
+static void testTimerWheel()
+{
+	typedef std::chrono::steady_clock Clock;
+	TimerWheel wheel;
+	Clock::time_point start = Clock::now();
+	auto at = [&](fmx::int64 ms) { return start + std::chrono::milliseconds(ms); };
+	std::vector<TimerWheel::Timer*> fired;
+	auto collect = [&](TimerWheel::Timer& timer) { fired.push_back(&timer); };
+
+	CHECK(wheel.nextExpiry() == Clock::time_point::max());
+
+	// Fires at its tick, not before
+	TimerWheel::Timer soon, cancelled;
+	wheel.schedule(soon, at(10));
+	wheel.schedule(cancelled, at(10));
+	CHECK(wheel.size() == 2);
+	CHECK(wheel.nextExpiry() <= at(11));
+	wheel.cancel(cancelled);
+	CHECK(!cancelled.scheduled());
+	CHECK(wheel.size() == 1);
+	wheel.advance(at(5), collect);
+	CHECK(fired.empty());
+	wheel.advance(at(11), collect);
+	CHECK(fired.size() == 1 && fired[0] == &soon);
+	CHECK(!soon.scheduled());
+	CHECK(wheel.size() == 0);
+
+	// Timers beyond the first level (256 ticks) are cascaded down and still fire on time
+	fired.clear();
+	TimerWheel::Timer second, third, fourth;
+	wheel.schedule(second, at(1000));
+	wheel.schedule(third, at(70000));
+	wheel.schedule(fourth, at(5000000));
+	wheel.advance(at(998), collect);
+	CHECK(fired.empty());
+	wheel.advance(at(1001), collect);
+	CHECK(fired.size() == 1 && fired[0] == &second);
+	wheel.advance(at(69998), collect);
+	CHECK(fired.size() == 1);
+	wheel.advance(at(70001), collect);
+	CHECK(fired.size() == 2 && fired[1] == &third);
+	// nextExpiry may be early for a timer in a further level, but never late
+	CHECK(wheel.nextExpiry() <= at(5000001));
+	wheel.advance(at(4999998), collect);
+	CHECK(fired.size() == 2);
+	wheel.advance(at(5000001), collect);
+	CHECK(fired.size() == 3 && fired[2] == &fourth);
+
+	// Rescheduling moves a timer, and a handler may schedule the timer it was given again
+	fired.clear();
+	TimerWheel::Timer moved;
+	wheel.schedule(moved, at(5000100));
+	wheel.schedule(moved, at(5000300));
+	CHECK(wheel.size() == 1);
+	int repeats = 0;
+	wheel.advance(at(5000200), collect);
+	CHECK(fired.empty());
+	wheel.advance(at(5000700), [&](TimerWheel::Timer& timer) {
+		if (++repeats < 3)
+			wheel.schedule(timer, at(5000300 + 100 * repeats));
+	});
+	CHECK(repeats == 3);
+	CHECK(wheel.size() == 0);
+
+	// An idle wheel jumps to the next timer: a day of ticks with one timer costs one advance
+	TimerWheel::Timer late;
+	wheel.schedule(late, at(5000700 + 86400000));
+	auto started = Clock::now();
+	wheel.advance(at(5000700 + 86400000 - 1), collect);
+	CHECK(fired.empty());
+	wheel.advance(at(5000700 + 86400000 + 1), collect);
+	CHECK(fired.size() == 1 && fired[0] == &late);
+	CHECK(Clock::now() - started < std::chrono::milliseconds(100));
+
+	// Cleared timers are forgotten at once
+	TimerWheel::Timer forgotten;
+	wheel.schedule(forgotten, at(5000700 + 86400000 + 50));
+	wheel.clear();
+	CHECK(wheel.size() == 0);
+	CHECK(wheel.nextExpiry() == Clock::time_point::max());
+}
+
+// Answer cache =============================================================================
+
+static size_t testEntryBytes(const std::string& key, const CacheEntry& entry)
+{
+	size_t bytes = CACHE_ENTRY_OVERHEAD + key.size() + entry.rendered.size();
+	for (const auto& response : entry.responses)
+		bytes += CACHE_RESPONSE_OVERHEAD + response.size();
+	return bytes;
+}
+
+static CacheEntry testEntry(size_t responseBytes)
+{
+	CacheEntry entry;
+	entry.responses.push_back(std::string(responseBytes, 'x'));
+	entry.expires = std::chrono::system_clock::now() + std::chrono::hours(1);
+	return entry;
+}
+
+// Inserts key as a lookup would, counting it in the frequency sketch first
+static bool testInsert(AnswerCache& cache, const std::string& key, size_t responseBytes, int lookups = 1)
+{
+	CacheShard& s = cache.shardFor(hashKey(key));
+	std::lock_guard<std::shared_timed_mutex> lock(s.lock);
+	for (int i = 0; i < lookups; ++i)
+		s.sketch.increment(hashKey(key));
+	return cache.insert(s, key, testEntry(responseBytes)) != s.entries.end();
+}
+
+static bool testCached(AnswerCache& cache, const std::string& key)
+{
+	CacheShard& s = cache.shardFor(hashKey(key));
+	std::shared_lock<std::shared_timed_mutex> lock(s.lock);
+	return s.entries.count(key) != 0;
+}
+
+// The bytes of the segments are those of the entries they hold, within the budget
+static bool testAccounted(AnswerCache& cache)
+{
+	CacheShard& s = cache.shard(0);
+	std::shared_lock<std::shared_timed_mutex> lock(s.lock);
+	size_t bytes = 0, pinnedBytes = 0;
+	for (const auto& entry : s.entries)
+		(entry.second.segment == kSegmentPinned ? pinnedBytes : bytes) += testEntryBytes(entry.first, entry.second);
+	const CacheUsage& usage = s.usage;
+	return usage.entries == s.entries.size() && usage.pinnedBytes == pinnedBytes &&
+		usage.windowBytes + usage.probationBytes + usage.protectedBytes == bytes && bytes <= usage.budget;
+}
+
+static void testAnswerCache()
+{
+	const size_t budget = 100000;
+	const size_t responseBytes = 300;
+	AnswerCache cache(1);
+	cache.setBudget(budget);
+
+	// A name looked up often is admitted to the main cache and survives a scan of one-off names
+	std::string hot = cacheKey("A", "hot.example");
+	for (int i = 0; i < 20; ++i)
+		testInsert(cache, cacheKey("A", "warm" + std::to_string(i) + ".example"), responseBytes, 8);
+	testInsert(cache, hot, responseBytes, 10);
+
+	const int scanned = 2000;
+	for (int i = 0; i < scanned; ++i)
+		testInsert(cache, cacheKey("A", "scan" + std::to_string(i) + ".example"), responseBytes);
+	CHECK(testAccounted(cache));
+	CHECK(testCached(cache, hot));
+
+	CacheUsage usage = cache.usage();
+	CHECK(usage.budget == budget);
+	CHECK(usage.windowBytes + usage.probationBytes + usage.protectedBytes <= budget);
+	CHECK(usage.windowBytes <= budget * CACHE_WINDOW_PERCENT / 100 + testEntryBytes(hot, testEntry(responseBytes)));
+	// Every insert is still cached, or was evicted or refused admission
+	CHECK(usage.entries + usage.evictions + usage.rejections == 21 + scanned);
+	CHECK(usage.rejections > 0);
+
+	// An entry larger than the main cache is not inserted at all
+	CHECK(!testInsert(cache, cacheKey("A", "huge.example"), budget));
+	CHECK(testAccounted(cache));
+	CHECK(cache.usage().entries == usage.entries);
+
+	// Pinned names stay regardless of the budget, and count apart from it
+	cache.pin(reversedName(cacheKey("A", "pinned.example")), true);
+	CHECK(testInsert(cache, cacheKey("A", "pinned.example"), budget));
+	CHECK(testInsert(cache, cacheKey("AAAA", "pinned.example"), responseBytes));
+	for (int i = 0; i < scanned; ++i)
+		testInsert(cache, cacheKey("A", "again" + std::to_string(i) + ".example"), responseBytes);
+	CHECK(testCached(cache, cacheKey("A", "pinned.example")));
+	CHECK(testCached(cache, cacheKey("AAAA", "pinned.example")));
+	CHECK(testAccounted(cache));
+	CHECK(cache.usage().pinnedBytes > budget);
+
+	// Unpinned, they compete for the main cache again
+	cache.pin(reversedName(cacheKey("A", "pinned.example")), false);
+	CHECK(cache.usage().pinnedBytes == 0);
+	CHECK(testAccounted(cache));
+
+	// A flush removes the name and, if asked, its subdomains through the name index
+	cache.setBudget(10 * budget);
+	testInsert(cache, cacheKey("A", "flush.example"), responseBytes);
+	testInsert(cache, cacheKey("MX", "flush.example"), responseBytes);
+	testInsert(cache, cacheKey("A", "a.flush.example"), responseBytes);
+	testInsert(cache, cacheKey("A", "b.a.flush.example"), responseBytes);
+	testInsert(cache, cacheKey("A", "noflush.example"), responseBytes);
+	std::string flushed = reversedName(cacheKey("A", "flush.example"));
+	CHECK(cache.flush(flushed, false, std::chrono::seconds(60)) == 2);
+	CHECK(testCached(cache, cacheKey("A", "a.flush.example")));
+	CHECK(cache.flush(flushed, true, std::chrono::seconds(60)) == 2);
+	CHECK(!testCached(cache, cacheKey("A", "b.a.flush.example")));
+	CHECK(testCached(cache, cacheKey("A", "noflush.example")));
+	CHECK(testAccounted(cache));
+
+	// A smaller budget shrinks the cache right away
+	size_t evictions = cache.usage().evictions;
+	cache.setBudget(budget / 10);
+	usage = cache.usage();
+	CHECK(usage.windowBytes + usage.probationBytes + usage.protectedBytes <= budget / 10);
+	CHECK(usage.evictions > evictions);
+	CHECK(testAccounted(cache));
+
+	cache.clear();
+	usage = cache.usage();
+	CHECK(usage.entries == 0 && usage.windowBytes + usage.probationBytes + usage.protectedBytes + usage.pinnedBytes == 0);
+}
+
+// Responses ================================================================================
+
+// A response for x.test with one answer of type and rdata
+static std::string testResponse(int type, const std::string& rdata)
+{
+	std::string message("\x12\x34\x81\x80\x00\x01\x00\x01\x00\x00\x00\x00", 12);
+	message += std::string("\x01x\x04test\x00", 8);
+	message += { 0, static_cast<char>(type), 0, 1 };
+	message += std::string("\xc0\x0c", 2);
+	message += { 0, static_cast<char>(type) };
+	message += std::string("\x00\x01\x00\x00\x00\x3c", 6);
+	message += { static_cast<char>(rdata.size() >> 8), static_cast<char>(rdata.size() & 0xff) };
+	return message + rdata;
+}
+
+static size_t testDecoded(int type, const std::string& rdata)
+{
+	DNSRecords records;
+	decodeResponse(testResponse(type, rdata), records);
+	return records.size();
+}
+
+static void testDecodeResponse()
+{
+	DNSRecords records;
+	decodeResponse(testResponse(ns_t_a, std::string("\x0a\x01\x02\x03", 4)), records);
+	CHECK(records.size() == 1 && records[0].second == "10.1.2.3");
+	CHECK(testDecoded(ns_t_aaaa, std::string(16, '\0')) == 1);
+	CHECK(testDecoded(ns_t_mx, std::string("\x00\x0a\xc0\x0c", 4)) == 1);
+	CHECK(testDecoded(ns_t_txt, std::string("\x03" "abc", 4)) == 1);
+	CHECK(testDecoded(ns_t_srv, std::string("\x00\x01\x00\x02\x00\x35\xc0\x0c", 8)) == 1);
+	CHECK(testDecoded(ns_t_cname, std::string("\xc0\x0c", 2)) == 1);
+
+	// Records whose data does not match their type are skipped
+	CHECK(testDecoded(ns_t_a, std::string("\x0a\x01", 2)) == 0);
+	CHECK(testDecoded(ns_t_a, std::string("\x0a\x01\x02\x03\x04", 5)) == 0);
+	CHECK(testDecoded(ns_t_aaaa, std::string(8, '\1')) == 0);
+	CHECK(testDecoded(ns_t_mx, std::string("\x00", 1)) == 0);
+	CHECK(testDecoded(ns_t_mx, std::string("\x00\x0a", 2)) == 0);
+	CHECK(testDecoded(ns_t_mx, std::string("\x00\x0a\x03" "ab", 5)) == 0);
+	CHECK(testDecoded(ns_t_txt, std::string("\x09" "abc", 4)) == 0);
+	CHECK(testDecoded(ns_t_txt, std::string()) == 0);
+	CHECK(testDecoded(ns_t_srv, std::string("\x00\x01\x00", 3)) == 0);
+	CHECK(testDecoded(ns_t_cname, std::string()) == 0);
+
+	// Truncated and garbage messages decode to nothing
+	std::string response = testResponse(ns_t_a, std::string("\x0a\x01\x02\x03", 4));
+	for (size_t length = 0; length < response.size(); ++length) {
+		records.clear();
+		decodeResponse(response.substr(0, length), records);
+		CHECK(records.empty());
+	}
+	records.clear();
+	decodeResponse(std::string(512, '\xff'), records);
+	CHECK(records.empty());
+}
+
+// Bulk engine ==============================================================================
+
+static std::vector<std::string> testReadLines(const std::string& path)
+{
+	std::vector<std::string> lines;
+	std::ifstream file(path);
+	std::string line;
+	while (std::getline(file, line))
+		lines.push_back(line);
+	return lines;
+}
+
+static void testResolveBulk(const TestServer& server)
+{
+	char inputPath[] = "/tmp/fDNS_tests_inXXXXXX";
+	char outputPath[] = "/tmp/fDNS_tests_outXXXXXX";
+	close(mkstemp(inputPath));
+	close(mkstemp(outputPath));
+	const int names = 5000;
+	{
+		std::ofstream input(inputPath);
+		input << "# a comment\n\n" << std::string(300, 'x') << ".test\n";
+		for (int i = 0; i < names; ++i)
+			input << "host" << i << ".test.\n";
+	}
+
+	for (int maxInFlight : { 1, 64, 65536 }) {
+		std::string json;
+		CHECK(resolveBulk(server.udpServer(), inputPath, outputPath, ns_t_a, maxInFlight, 0, json) == 0);
+		CHECK(json.find("\"names\":" + std::to_string(names + 1) + ",") != std::string::npos);
+		CHECK(json.find("\"answered\":" + std::to_string(names) + ",") != std::string::npos);
+		CHECK(json.find("\"invalid\":1,") != std::string::npos);
+
+		std::vector<std::string> lines = testReadLines(outputPath);
+		CHECK(lines.size() == static_cast<size_t>(names + 1));
+		std::set<std::string> answered;
+		size_t invalid = 0;
+		for (const auto& line : lines) {
+			if (line.compare(0, 300, std::string(300, 'x')) == 0 && line.find("\tINVALID\t") != std::string::npos)
+				invalid++;
+			else if (line.find("\tNOERROR\t10.1.2.3") != std::string::npos)
+				answered.insert(line.substr(0, line.find('\t')));
+		}
+		CHECK(invalid == 1);
+		CHECK(answered.size() == static_cast<size_t>(names));
+	}
+
+	std::string json;
+	CHECK(resolveBulk("not a server", inputPath, outputPath, ns_t_a, 64, 0, json) == 1);
+	CHECK(resolveBulk(server.udpServer(), "/nonexistent/fDNS_tests", outputPath, ns_t_a, 64, 0, json) == 1);
+	unlink(inputPath);
+	unlink(outputPath);
+}
+
+// TCP benchmark ============================================================================
+
+#ifdef FDNS_BENCHMARKS
+static void testMeasureTcpQueries(const TestServer& server)
+{
+	struct sockaddr_storage address;
+	socklen_t length = 0;
+	server.tcpAddress(address, length);
+	std::function<QueryConnection*()> connect = [&]() -> QueryConnection* { return new StreamConnection(address, length); };
+	// The modes of fDNS_Benchmark_TCP: a connection per query, one connection, and pipelined
+	const struct {
+		int queries;
+		int depth;
+		bool newConnections;
+	} modes[] = { { 100, 1, true }, { 100, 1, false }, { 1000, 32, false } };
+	for (const auto& mode : modes) {
+		TcpBenchmarkResult result = measureTcpQueries(connect, mode.queries, mode.depth, mode.newConnections);
+		CHECK(result.answered == mode.queries);
+		CHECK(result.failed == 0);
+		CHECK(result.seconds > 0);
+	}
+}
+#endif
+
+int main()
+{
+	testZoneLines();
+	testLocalZone();
+	testParseFlatJsonObject();
+	testTimerWheel();
+	testAnswerCache();
+	testDecodeResponse();
+	{
+		TestServer server;
+		testResolveBulk(server);
+#ifdef FDNS_BENCHMARKS
+		testMeasureTcpQueries(server);
+#endif
+	}
+	if (g_failures) {
+		std::cerr << g_failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All tests passed" << std::endl;
+	return 0;
+}